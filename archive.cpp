@@ -0,0 +1,415 @@
+#include "archive.hpp"
+
+#include <QBuffer>
+#include <QFileInfo>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QtEndian>
+
+#include <climits>
+#include <cstring>
+
+#include <zlib.h>
+
+
+//
+// Paths
+//
+
+bool isArchiveFile(const QString &name) {
+    return name.endsWith(".zip", Qt::CaseInsensitive) ||
+           name.endsWith(".tar", Qt::CaseInsensitive);
+}
+
+// Whether a path with an archive suffix is a file, rather than a directory
+// that happens to be named like one
+static bool isArchive(const QString &path) {
+    static QMutex lock;
+    static QHash<QString, bool> known;
+    QMutexLocker locker(&lock);
+    auto it = known.find(path);
+    if (it == known.end())
+        it = known.insert(path, QFileInfo(path).isFile());
+    return *it;
+}
+
+bool splitArchivePath(const QString &path, QString &archive, QString &entry) {
+    for (int start = 0; start <= path.size();) {
+        int slash = path.indexOf('/', start);
+        if (slash < 0)
+            slash = path.size();
+        QString prefix = path.left(slash);
+        if (isArchiveFile(prefix) && isArchive(prefix)) {
+            archive = prefix;
+            entry = path.mid(slash + 1);
+            return true;
+        }
+        start = slash + 1;
+    }
+    return false;
+}
+
+QString sidecarPath(const QString &path) {
+    QString archive, entry;
+    if (!splitArchivePath(path, archive, entry))
+        return path;
+    return archive + ".results" + (entry.isEmpty() ? "" : "/" + entry);
+}
+
+QIODevice *openFile(const QString &path) {
+    QString archive_path, entry;
+    if (splitArchivePath(path, archive_path, entry)) {
+        auto archive = Archive::open(archive_path);
+        return archive ? archive->openEntry(entry) : nullptr;
+    }
+
+    auto file = new QFile(path);
+    if (!file->open(QIODevice::ReadOnly)) {
+        delete file;
+        return nullptr;
+    }
+    return file;
+}
+
+
+//
+// Inflation
+//
+
+// Deflated data, inflated as it is read
+class InflateDevice : public QIODevice {
+  public:
+    InflateDevice(const uchar *data, qint64 packed, qint64 size)
+        : data(data), packed(packed), inflated(size) {
+        stream.zalloc = Z_NULL;
+        stream.zfree = Z_NULL;
+        stream.opaque = Z_NULL;
+        stream.next_in = Z_NULL;
+        stream.avail_in = 0;
+        valid = inflateInit2(&stream, -MAX_WBITS) == Z_OK; // raw deflate
+    }
+    ~InflateDevice() {
+        if (valid)
+            inflateEnd(&stream);
+    }
+
+    bool isSequential() const override { return true; }
+    qint64 size() const override { return inflated; }
+    qint64 bytesAvailable() const override {
+        return inflated - produced + QIODevice::bytesAvailable();
+    }
+
+  protected:
+    qint64 readData(char *out, qint64 max) override {
+        if (!valid) {
+            setErrorString("Could not set up inflation");
+            return -1;
+        }
+
+        stream.next_out = (Bytef *)out;
+        stream.avail_out = (uInt)qMin<qint64>(max, UINT_MAX);
+        uInt wanted = stream.avail_out;
+        while (stream.avail_out > 0 && !finished) {
+            // the input is mapped, so it can be handed over at once
+            if (stream.avail_in == 0) {
+                qint64 chunk = qMin<qint64>(packed - consumed, UINT_MAX);
+                stream.next_in = (Bytef *)data + consumed;
+                stream.avail_in = (uInt)chunk;
+                consumed += chunk;
+            }
+
+            int status = inflate(&stream, Z_NO_FLUSH);
+            if (status == Z_STREAM_END) {
+                finished = true;
+            } else if (status != Z_OK) {
+                setErrorString(stream.msg ? stream.msg : "Corrupt data");
+                return -1;
+            }
+        }
+
+        qint64 count = wanted - stream.avail_out;
+        produced += count;
+        return count;
+    }
+
+    qint64 writeData(const char *, qint64) override { return -1; }
+
+  private:
+    z_stream stream;
+    const uchar *data;
+    qint64 packed, inflated;
+    qint64 consumed = 0, produced = 0;
+    bool valid, finished = false;
+};
+
+
+//
+// Archive
+//
+
+static quint16 le16(const uchar *p) { return qFromLittleEndian<quint16>(p); }
+static quint32 le32(const uchar *p) { return qFromLittleEndian<quint32>(p); }
+static quint64 le64(const uchar *p) { return qFromLittleEndian<quint64>(p); }
+
+std::shared_ptr<Archive> Archive::open(const QString &path) {
+    static QMutex lock;
+    static QHash<QString, std::shared_ptr<Archive>> archives;
+
+    // indexed once, while other threads wait for it
+    QMutexLocker locker(&lock);
+    auto &archive = archives[path];
+    if (!archive) {
+        std::shared_ptr<Archive> opened(new Archive(path));
+        if (opened->data == nullptr) {
+            archives.remove(path);
+            return nullptr;
+        }
+        archive = opened;
+    }
+    return archive;
+}
+
+Archive::Archive(const QString &path) : file(path) {
+    if (!file.open(QIODevice::ReadOnly))
+        return;
+    size = file.size();
+    data = size > 0 ? file.map(0, size) : nullptr;
+    if (data == nullptr)
+        return;
+
+    zip = path.endsWith(".zip", Qt::CaseInsensitive);
+    if (!(zip ? readZip() : readTar())) {
+        qWarning("Could not read archive %s", qPrintable(path));
+        file.unmap((uchar *)data);
+        data = nullptr;
+    }
+}
+
+void Archive::list(const QString &dir, QStringList &files,
+                   QStringList &subdirs) const {
+    auto it = dirs.find(dir);
+    if (it == dirs.end())
+        return;
+    files << it->files;
+    subdirs << it->dirs;
+}
+
+QIODevice *Archive::openEntry(const QString &name) const {
+    // stored entries are read as they are, so must be as large as declared
+    auto it = entries.find(name);
+    if (it == entries.end() || it->offset < 0 || it->size < 0 ||
+        it->size > INT_MAX || it->packed < 0 ||
+        (!it->deflated && it->packed != it->size))
+        return nullptr;
+
+    // the local header of zip entries can differ from the central one
+    qint64 offset = it->offset;
+    if (zip) {
+        if (offset > size - 30 || le32(data + offset) != 0x04034b50)
+            return nullptr;
+        offset += 30 + le16(data + offset + 26) + le16(data + offset + 28);
+    }
+    if (it->packed > size - offset)
+        return nullptr;
+
+    QIODevice *device;
+    if (it->deflated) {
+        device = new InflateDevice(data + offset, it->packed, it->size);
+    } else {
+        auto buffer = new QBuffer();
+        buffer->setData(
+            QByteArray::fromRawData((const char *)data + offset, it->size));
+        device = buffer;
+    }
+    device->open(QIODevice::ReadOnly);
+    return device;
+}
+
+// Make a directory known, along with all directories leading to it
+void Archive::addDirectory(const QString &dir) {
+    if (dirs.contains(dir))
+        return;
+    if (!dir.isEmpty()) {
+        int slash = dir.lastIndexOf('/');
+        QString parent = slash < 0 ? QString("") : dir.left(slash);
+        addDirectory(parent);
+        dirs[parent].dirs << dir.mid(slash + 1);
+    }
+    dirs[dir];
+}
+
+// Make an entry known, or a directory for names ending in a slash
+void Archive::addEntry(QString name, qint64 offset, qint64 size,
+                       qint64 packed, bool deflated) {
+    while (name.startsWith("./"))
+        name.remove(0, 2);
+    while (name.startsWith("/"))
+        name.remove(0, 1);
+    if (name.endsWith("/")) {
+        name.chop(1);
+        addDirectory(name);
+        return;
+    }
+    if (name.isEmpty())
+        return;
+
+    int slash = name.lastIndexOf('/');
+    QString dir = slash < 0 ? QString("") : name.left(slash);
+    addDirectory(dir);
+
+    // appended again, as tar archives can be
+    if (!entries.contains(name))
+        dirs[dir].files << name.mid(slash + 1);
+    entries[name] = {offset, size, packed, deflated};
+}
+
+bool Archive::readZip() {
+    // end of central directory record, followed by a comment of up to 64 KiB
+    qint64 end = -1;
+    for (qint64 pos = size - 22; pos >= qMax<qint64>(0, size - 0xffff - 22);
+         pos--) {
+        if (le32(data + pos) == 0x06054b50) {
+            end = pos;
+            break;
+        }
+    }
+    if (end < 0)
+        return false;
+
+    quint64 count = le16(data + end + 10);
+    quint64 directory_size = le32(data + end + 12);
+    quint64 directory_offset = le32(data + end + 16);
+    if (count == 0xffff || directory_size == 0xffffffff ||
+        directory_offset == 0xffffffff) {
+        // zip64 end of central directory record, found through its locator
+        if (end < 20 || le32(data + end - 20) != 0x07064b50)
+            return false;
+        quint64 end64 = le64(data + end - 20 + 8);
+        if (size < 56 || end64 > (quint64)size - 56 ||
+            le32(data + end64) != 0x06064b50)
+            return false;
+        count = le64(data + end64 + 32);
+        directory_size = le64(data + end64 + 40);
+        directory_offset = le64(data + end64 + 48);
+    }
+    // compared so that corrupt 64-bit values can't overflow
+    if (directory_offset > (quint64)size ||
+        directory_size > (quint64)size - directory_offset)
+        return false;
+
+    const uchar *record = data + directory_offset;
+    const uchar *records_end = record + directory_size;
+    for (quint64 i = 0; i < count && record + 46 <= records_end; i++) {
+        if (le32(record) != 0x02014b50)
+            return false;
+        quint16 flags = le16(record + 8), method = le16(record + 10);
+        qint64 packed = le32(record + 20), unpacked = le32(record + 24);
+        int name_length = le16(record + 28), extra_length = le16(record + 30);
+        qint64 offset = le32(record + 42);
+        const uchar *name = record + 46;
+        const uchar *extra = name + name_length;
+        const uchar *next = extra + extra_length + le16(record + 32);
+        if (next > records_end)
+            return false;
+
+        // 64-bit sizes and offset, for the fields that didn't fit, each read
+        // only if within the length the field declares
+        for (const uchar *field = extra; field + 4 <= extra + extra_length;
+             field += 4 + le16(field + 2)) {
+            const uchar *value = field + 4;
+            const uchar *field_end = value + le16(field + 2);
+            if (le16(field) != 0x0001 || field_end > extra + extra_length)
+                continue;
+            if (unpacked == 0xffffffff && value + 8 <= field_end)
+                unpacked = le64(value), value += 8;
+            if (packed == 0xffffffff && value + 8 <= field_end)
+                packed = le64(value), value += 8;
+            if (offset == 0xffffffff && value + 8 <= field_end)
+                offset = le64(value);
+        }
+
+        // encrypted entries, and compression methods other than deflate,
+        // aren't supported
+        if (!(flags & 0x0001) && (method == 0 || method == 8))
+            addEntry(QString::fromUtf8((const char *)name, name_length),
+                     offset, unpacked, packed, method == 8);
+        record = next;
+    }
+    return true;
+}
+
+// Numeric field of a tar header: octal, or base-256 for large values, which
+// are -1 if they don't fit (or are negative)
+static qint64 tarNumber(const uchar *field, int length) {
+    qint64 value = 0;
+    if (field[0] & 0x80) {
+        for (int i = 1; i < length; i++) {
+            if (value >> 55)
+                return -1;
+            value = value << 8 | field[i];
+        }
+        return value;
+    }
+    for (int i = 0; i < length && field[i] != '\0'; i++)
+        if (field[i] >= '0' && field[i] <= '7')
+            value = value << 3 | (field[i] - '0');
+    return value;
+}
+
+// Zero-terminated string of a tar header
+static QString tarString(const uchar *field, int length) {
+    return QString::fromUtf8((const char *)field,
+                             qstrnlen((const char *)field, length));
+}
+
+bool Archive::readTar() {
+    QString long_name;
+    for (qint64 pos = 0; pos + 512 <= size;) {
+        const uchar *header = data + pos;
+        if (header[0] == '\0')
+            break; // end-of-archive blocks
+
+        // corrupt sizes would move backwards, or overflow
+        qint64 entry_size = tarNumber(header + 124, 12);
+        if (entry_size < 0 || entry_size > size - pos - 512)
+            break; // truncated
+        qint64 next = pos + 512 + (entry_size + 511) / 512 * 512;
+        const uchar *content = header + 512;
+
+        char type = header[156];
+        if (type == 'x') {
+            // pax records: "<length> <key>=<value>\n"
+            QByteArray records((const char *)content, entry_size);
+            for (int start = 0; start < records.size();) {
+                int space = records.indexOf(' ', start);
+                int length = records.mid(start, space - start).toInt();
+                if (space < 0 || length <= 0)
+                    break;
+                QByteArray record = records.mid(space + 1,
+                                                length - (space - start) - 2);
+                if (record.startsWith("path="))
+                    long_name = QString::fromUtf8(record.mid(5));
+                start += length;
+            }
+        } else if (type == 'L') {
+            long_name = tarString(content, entry_size);
+        } else if (type == '0' || type == '\0' || type == '7' || type == '5') {
+            QString name = long_name;
+            if (name.isEmpty()) {
+                name = tarString(header, 100);
+                if (memcmp(header + 257, "ustar", 5) == 0 &&
+                    header[345] != '\0')
+                    name = tarString(header + 345, 155) + "/" + name;
+            }
+            if (type == '5' && !name.endsWith("/"))
+                name += "/";
+            addEntry(name, pos + 512, entry_size, entry_size, false);
+            long_name.clear();
+        } else if (type != 'g') {
+            long_name.clear(); // links and special files are skipped
+        }
+
+        pos = next;
+    }
+    return true;
+}
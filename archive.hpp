@@ -0,0 +1,70 @@
+#pragma once
+
+#include <QFile>
+#include <QHash>
+#include <QIODevice>
+#include <QString>
+#include <QStringList>
+
+#include <memory>
+
+// Zip and tar archives of scans are read as if they were directories, with
+// paths leading through the archive file: "/batch.zip/box1/page1.jpg".
+// Files that belong next to such scans (results, leases) are kept in a
+// directory next to the archive instead: "/batch.zip.results/box1/page1.dat".
+
+// Whether a file name is that of an archive read as directory
+bool isArchiveFile(const QString &name);
+
+// Split a path leading into an archive into the archive file and the path
+// inside of it, which is empty for the archive itself. Returns false for
+// ordinary paths.
+bool splitArchivePath(const QString &path, QString &archive, QString &entry);
+
+// Where to keep a file belonging next to `path` (see above)
+QString sidecarPath(const QString &path);
+
+// Open a file for reading, which can also be in an archive. Returns nullptr
+// if it doesn't exist.
+QIODevice *openFile(const QString &path);
+
+// Contents of an archive, mapped into memory and indexed once, and shared by
+// all threads. Archives stay open until the process exits.
+class Archive {
+  public:
+    // Opened archive, or nullptr if it cannot be read
+    static std::shared_ptr<Archive> open(const QString &path);
+
+    // Files and directories right inside a directory of the archive (the
+    // empty string for its root)
+    void list(const QString &dir, QStringList &files,
+              QStringList &subdirs) const;
+
+    // Open an entry for reading: stored entries are read straight from the
+    // mapped archive, compressed ones are inflated while being read
+    QIODevice *openEntry(const QString &name) const;
+
+  private:
+    Archive(const QString &path);
+    bool readZip();
+    bool readTar();
+    void addDirectory(const QString &dir);
+    void addEntry(QString name, qint64 offset, qint64 size, qint64 packed,
+                  bool deflated);
+
+    struct Entry {
+        qint64 offset; // of the data, or of the local header in zip files
+        qint64 size, packed;
+        bool deflated;
+    };
+    struct Directory {
+        QStringList files, dirs;
+    };
+
+    QFile file;
+    const uchar *data = nullptr;
+    qint64 size = 0;
+    bool zip = false;
+    QHash<QString, Entry> entries;
+    QHash<QString, Directory> dirs;
+};
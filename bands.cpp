@@ -0,0 +1,175 @@
+#include "bands.hpp"
+
+#include <QFileInfo>
+#include <QImageReader>
+
+#include <cmath>
+#include <cstring>
+#include <functional>
+
+#include "jpeg.hpp"
+#include "tiff.hpp"
+
+// Rows of the reduced copy of a scan made at once
+#define REDUCED_BAND_ROWS 64
+
+
+//
+// Reduction
+//
+
+// Integer factor reducing a size to at most `pixels`
+static int reductionFactor(QSize size, qint64 pixels) {
+    double area = (double)size.width() * size.height();
+    return qMax(1, (int)ceil(sqrt(area / pixels)));
+}
+
+// Copy of an image reduced by an integer factor, read band by band from top
+// to bottom
+static QImage reduce(QSize size, int factor,
+                     const std::function<QImage(int, int)> &read) {
+    QImage reduced(qMax(1, size.width() / factor),
+                   qMax(1, size.height() / factor), QImage::Format_RGB32);
+    if (reduced.isNull())
+        return reduced;
+
+    for (int y = 0; y < reduced.height(); y += REDUCED_BAND_ROWS) {
+        int rows = qMin(REDUCED_BAND_ROWS, reduced.height() - y);
+        int top = y * factor;
+        QImage band = read(top, qMin(rows * factor, size.height() - top));
+        if (band.isNull())
+            return QImage();
+        band = band.scaled(reduced.width(), rows, Qt::IgnoreAspectRatio,
+                           Qt::SmoothTransformation);
+        for (int i = 0; i < rows; i++)
+            memcpy(reduced.scanLine(y + i), band.constScanLine(i),
+                   reduced.bytesPerLine());
+    }
+    return reduced;
+}
+
+QImage BandReader::reduced(qint64 pixels, double &scale) {
+    int factor = reductionFactor(size(), pixels);
+    QImage image = reduce(size(), factor, [this](int top, int rows) {
+        return read(top, rows);
+    });
+    scale = (double)image.width() / size().width();
+    return image;
+}
+
+
+//
+// TIFF
+//
+
+class TiffBandReader : public BandReader {
+  public:
+    TiffBandReader(std::unique_ptr<TiffPage> page) : page(std::move(page)) {}
+
+    QSize size() const override { return page->rect().size(); }
+
+    QImage read(int top, int rows) override {
+        return page->read(QRect(0, top, page->rect().width(), rows));
+    }
+
+  private:
+    std::unique_ptr<TiffPage> page;
+};
+
+
+//
+// JPEG
+//
+
+class JpegBandReader : public BandReader {
+  public:
+    JpegBandReader(const QString &file) : file(file), decoder(file) {}
+
+    bool isOpen() const { return decoder.isOpen(); }
+    QSize size() const override { return decoder.size(); }
+
+    QImage read(int top, int rows) override {
+        QImage band(size().width(), rows, QImage::Format_RGB32);
+        if (band.isNull() || top < previousTop)
+            return QImage();
+
+        // rows decoded for the previous band already
+        int reused = 0;
+        if (!previous.isNull() && top < previousTop + previous.height()) {
+            reused = qMin(rows, previousTop + previous.height() - top);
+            for (int y = 0; y < reused; y++)
+                memcpy(band.scanLine(y),
+                       previous.constScanLine(top - previousTop + y),
+                       band.bytesPerLine());
+        }
+
+        // decode the rest, skipping rows between the bands
+        for (; next < top; next++)
+            if (!decoder.read(band.scanLine(reused), band.bytesPerLine(), 1))
+                return QImage();
+        if (!decoder.read(band.scanLine(reused), band.bytesPerLine(),
+                          rows - reused))
+            return QImage();
+        next = top + rows;
+
+        previous = band;
+        previousTop = top;
+        return band;
+    }
+
+    // decoded at a reduced scale by libjpeg, and reduced further as needed
+    QImage reduced(qint64 pixels, double &scale) override {
+        int denominator = 1;
+        while (denominator < 8 &&
+               denominator * 2 <= reductionFactor(size(), pixels))
+            denominator *= 2;
+
+        JpegDecoder scaled(file, denominator);
+        if (!scaled.isOpen())
+            return QImage();
+        QSize scaled_size = scaled.size();
+        QImage image =
+            reduce(scaled_size, reductionFactor(scaled_size, pixels),
+                   [&](int, int rows) {
+                       QImage band(scaled_size.width(), rows,
+                                   QImage::Format_RGB32);
+                       if (band.isNull() ||
+                           !scaled.read(band.bits(), band.bytesPerLine(),
+                                        rows))
+                           return QImage();
+                       return band;
+                   });
+        scale = (double)image.width() / size().width();
+        return image;
+    }
+
+  private:
+    QString file;
+    JpegDecoder decoder;
+    int next = 0; // row decoded next
+    QImage previous;
+    int previousTop = 0;
+};
+
+
+//
+// BandReader
+//
+
+std::unique_ptr<BandReader> BandReader::open(const QString &file) {
+    auto page = TiffPage::open(file);
+    if (page)
+        return std::unique_ptr<BandReader>(new TiffBandReader(std::move(page)));
+
+    // rows can only be read in the orientation they are stored in
+    QString suffix = QFileInfo(file).suffix();
+    if ((suffix.compare("jpg", Qt::CaseInsensitive) == 0 ||
+         suffix.compare("jpeg", Qt::CaseInsensitive) == 0) &&
+        QImageReader(file).transformation() ==
+            QImageIOHandler::TransformationNone) {
+        std::unique_ptr<JpegBandReader> reader(new JpegBandReader(file));
+        if (reader->isOpen())
+            return std::unique_ptr<BandReader>(reader.release());
+    }
+    return nullptr;
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <QImage>
+#include <QSize>
+#include <QString>
+
+#include <memory>
+
+// Horizontal bands of a scan at full resolution, read from top to bottom
+// without ever decoding the scan as a whole: uncompressed TIFF pages are read
+// from their mapping, JPEG files are decoded row by row. Other scans (and JPEG
+// files rotated on loading) can't be read in bands.
+class BandReader {
+  public:
+    // Reader of a scan, or nullptr if it can't be read in bands
+    static std::unique_ptr<BandReader> open(const QString &file);
+    virtual ~BandReader() {}
+
+    virtual QSize size() const = 0;
+
+    // Rows of the scan, as 32-bit image (QImage::Format_RGB32), or a null
+    // image on failure. Bands may overlap, but none may start above the
+    // previous one.
+    virtual QImage read(int top, int rows) = 0;
+
+    // Copy of the whole scan reduced to at most `pixels`, along with its
+    // scale, read through a pass of its own over the scan
+    virtual QImage reduced(qint64 pixels, double &scale);
+};
@@ -0,0 +1,252 @@
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QFile>
+#include <QTextStream>
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+
+#include "clip.hpp"
+#include "detection.hpp"
+#include "postprocessing.hpp"
+#include "scanner.hpp"
+#include "synthetic.hpp"
+
+using namespace cv;
+using namespace std;
+
+
+//
+// Timing
+//
+
+// Time a function over a number of iterations, reporting the amount of items
+// it produced (as returned by the function)
+static QJsonObject measure(const QString &name, int iterations,
+                           function<size_t()> f) {
+    vector<double> times;
+    size_t items = 0;
+    for (int i = 0; i < iterations; i++) {
+        auto start = chrono::steady_clock::now();
+        items = f();
+        auto end = chrono::steady_clock::now();
+        times.push_back(
+            chrono::duration<double, milli>(end - start).count());
+    }
+    sort(times.begin(), times.end());
+
+    double total = 0;
+    for (auto time : times)
+        total += time;
+
+    QJsonObject result;
+    result["name"] = name;
+    result["iterations"] = iterations;
+    result["items"] = (qint64)items;
+    result["min_ms"] = times.front();
+    result["median_ms"] = times[times.size() / 2];
+    result["mean_ms"] = total / times.size();
+    return result;
+}
+
+static QImage toImage(const Mat &mat) {
+    return QImage(mat.data, mat.cols, mat.rows, mat.step,
+                  QImage::Format_RGB32)
+        .copy();
+}
+
+static QPolygon toPolygon(const vector<Point> &shape) {
+    QPolygon polygon;
+    for (auto point : shape)
+        polygon << QPoint(point.x, point.y);
+    return polygon;
+}
+
+
+//
+// Main
+//
+
+int main(int argc, char *argv[]) {
+    QCoreApplication app(argc, argv);
+    QCoreApplication::setApplicationName("FotoScan benchmark");
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription(
+        "Benchmark the FotoScan pipeline on synthetic album pages");
+    parser.addHelpOption();
+
+    QCommandLineOption photosOption("photos", "Photos per page.", "count",
+                                    "4");
+    parser.addOption(photosOption);
+    QCommandLineOption dpiOption("dpi", "Scan resolution.", "dpi", "300");
+    parser.addOption(dpiOption);
+    QCommandLineOption rotationOption(
+        "rotation", "Maximal rotation of a photo.", "degrees", "5");
+    parser.addOption(rotationOption);
+    QCommandLineOption perspectiveOption(
+        "perspective", "Maximal relative corner displacement.", "fraction",
+        "0.01");
+    parser.addOption(perspectiveOption);
+    QCommandLineOption contrastOption(
+        "contrast", "Contrast of the photo borders against the page.",
+        "fraction", "0.5");
+    parser.addOption(contrastOption);
+    QCommandLineOption noiseOption("noise", "Standard deviation of the noise.",
+                                   "level", "4");
+    parser.addOption(noiseOption);
+    QCommandLineOption seedOption("seed", "Random seed.", "seed", "1");
+    parser.addOption(seedOption);
+    QCommandLineOption iterationsOption(
+        "iterations", "Iterations per benchmark.", "count", "5");
+    parser.addOption(iterationsOption);
+    QCommandLineOption outputOption(
+        QStringList() << "o"
+                      << "output",
+        "Write results to <file> instead of standard output.", "file");
+    parser.addOption(outputOption);
+
+    parser.process(app);
+
+    SyntheticOptions options;
+    options.photos = parser.value(photosOption).toInt();
+    options.dpi = parser.value(dpiOption).toDouble();
+    options.rotation = parser.value(rotationOption).toDouble();
+    options.perspective = parser.value(perspectiveOption).toDouble();
+    options.contrast = parser.value(contrastOption).toDouble();
+    options.noise = parser.value(noiseOption).toDouble();
+    options.seed = parser.value(seedOption).toUInt();
+    int iterations = parser.value(iterationsOption).toInt();
+
+    SyntheticPage page = generatePage(options);
+    QJsonArray results;
+
+    // detection stages
+    ContourList contours, rejects, ungrouped, shapes;
+    results << measure("extractContours", iterations, [&]() {
+        contours = extractContours(page.image);
+        return contours.size();
+    });
+    results << measure("filterShapes", iterations, [&]() {
+        rejects.clear();
+        ungrouped = filterShapes(contours, rejects);
+        return ungrouped.size();
+    });
+    results << measure("minimizeShapes", iterations, [&]() {
+        shapes = minimizeShapes(ungrouped);
+        return shapes.size();
+    });
+    results << measure("poly_clip", iterations, [&]() {
+        size_t clips = 0;
+        vector<Point> clip;
+        for (size_t i = 0; i < ungrouped.size(); i++)
+            for (size_t j = 0; j < ungrouped.size(); j++) {
+                poly_clip(ungrouped.begin(i), ungrouped.count(i),
+                          ungrouped.begin(j), ungrouped.count(j), clip);
+                if (clip.size())
+                    clips++;
+            }
+        return clips;
+    });
+    results << measure("extractShapesAdaptive", iterations, [&]() {
+        ContourList adaptive_rejects;
+        QVector<LevelYield> yields;
+        return extractShapesAdaptive(page.image, adaptive_rejects, yields)
+            .size();
+    });
+    results << measure("snapShapes", iterations, [&]() {
+        ContourList snapped;
+        snapShapes(page.image, page.photos, snapped);
+        return snapped.size();
+    });
+
+    // post-processing stages, using the true shapes
+    ScanData data("synthetic");
+    data.image = toImage(page.image);
+    for (auto &shape : page.photos)
+        data.shapes << toPolygon(shape);
+    results << measure("extractPhotos", iterations, [&]() {
+        data.photos.clear();
+        extractPhotos(&data);
+        return (size_t)data.photos.size();
+    });
+    results << measure("encodePhotos", iterations, [&]() {
+        data.encoded.clear();
+        encodePhotos(&data);
+        return (size_t)data.encoded.size();
+    });
+
+    for (auto cascade : cascadeFiles()) {
+        FileStorage fs(cascade.absoluteFilePath().toStdString(),
+                       FileStorage::READ);
+        if (!fs.isOpened() || data.photos.isEmpty())
+            continue;
+
+        auto photo = data.photos.first();
+        Mat mat(photo.height(), photo.width(), CV_8UC4, photo.bits(),
+                photo.bytesPerLine());
+        Mat grayscale;
+        cvtColor(mat, grayscale, COLOR_BGR2GRAY);
+        results << measure("detectFeatures", iterations, [&]() {
+            unsigned int votes[4] = {0, 0, 0, 0};
+            detectFeatures(grayscale, fs, votes);
+            return (size_t)(votes[0] + votes[1] + votes[2] + votes[3]);
+        });
+        break;
+    }
+
+    // end-to-end, through the tasks as used by the application
+    auto throughput = measure("end-to-end", iterations, [&]() {
+        ScanData scan("synthetic");
+        scan.image = data.image;
+
+        DetectionTask detection(&scan);
+        detection.setAutoDelete(false);
+        detection.run();
+
+        PostprocessTask postprocess(&scan);
+        postprocess.setAutoDelete(false);
+        postprocess.run();
+        return (size_t)scan.photos.size();
+    });
+    throughput["pages_per_second"] = 1000 / throughput["median_ms"].toDouble();
+    results << throughput;
+
+    QJsonObject config;
+    config["photos"] = options.photos;
+    config["dpi"] = options.dpi;
+    config["rotation"] = options.rotation;
+    config["perspective"] = options.perspective;
+    config["contrast"] = options.contrast;
+    config["noise"] = options.noise;
+    config["seed"] = (qint64)options.seed;
+    config["width"] = page.image.cols;
+    config["height"] = page.image.rows;
+
+    QJsonObject root;
+    root["config"] = config;
+    root["results"] = results;
+    QByteArray json = QJsonDocument(root).toJson();
+
+    if (parser.isSet(outputOption)) {
+        QFile output(parser.value(outputOption));
+        if (!output.open(QIODevice::WriteOnly | QIODevice::Text)) {
+            qCritical("Could not write results to %s: %s",
+                      qPrintable(output.fileName()),
+                      qPrintable(output.errorString()));
+            return 1;
+        }
+        output.write(json);
+    } else {
+        QTextStream(stdout) << json;
+    }
+
+    return 0;
+}
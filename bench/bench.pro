@@ -0,0 +1,6 @@
+include(../fotoscan.pri)
+
+TARGET        = bench
+HEADERS      += synthetic.hpp
+SOURCES      += synthetic.cpp \
+                bench.cpp
@@ -0,0 +1,126 @@
+#include "synthetic.hpp"
+
+#include <opencv2/imgproc/imgproc.hpp>
+
+#include <algorithm>
+#include <cmath>
+
+using namespace cv;
+using namespace std;
+
+// Dimensions of the page and the photos on it, in inches
+static const double page_width = 11.7, page_height = 8.3;
+static const double photo_long = 6, photo_short = 4;
+static const double photo_border = 0.15;
+
+// Album page background level
+static const double background = 60;
+
+
+//
+// Auxiliary
+//
+
+// Smooth random texture, created by upscaling a small random image
+static Mat texture(RNG &rng, Size size, int cells, double mean,
+                   double stddev) {
+    Mat small(cells, cells, CV_32FC3);
+    rng.fill(small, RNG::NORMAL, Scalar::all(mean), Scalar::all(stddev));
+
+    Mat large, result;
+    resize(small, large, size, 0, 0, INTER_CUBIC);
+    large.convertTo(result, CV_8U);
+    return result;
+}
+
+// Random photo contents: a smooth gradient with some sharp-edged objects
+static Mat photo(RNG &rng, Size size, const Scalar &border_color,
+                 int border) {
+    Mat contents = texture(rng, size, 6, 128, 60);
+    for (int i = 0; i < 8; i++) {
+        Point center(rng.uniform(0, size.width), rng.uniform(0, size.height));
+        Scalar color(rng.uniform(0, 256), rng.uniform(0, 256),
+                     rng.uniform(0, 256));
+        int radius = rng.uniform(size.height / 20, size.height / 5);
+        if (i % 2)
+            circle(contents, center, radius, color, FILLED);
+        else
+            rectangle(contents, center - Point(radius, radius),
+                      center + Point(radius, radius), color, FILLED);
+    }
+
+    Mat bordered, result;
+    copyMakeBorder(contents, bordered, border, border, border, border,
+                   BORDER_CONSTANT, border_color);
+    cvtColor(bordered, result, COLOR_BGR2BGRA);
+    return result;
+}
+
+
+//
+// Page generation
+//
+
+SyntheticPage generatePage(const SyntheticOptions &options) {
+    RNG rng(options.seed);
+    SyntheticPage page;
+
+    // textured album page
+    Size page_size(cvRound(page_width * options.dpi),
+                   cvRound(page_height * options.dpi));
+    Mat paper = texture(rng, page_size, 40, background, 8);
+    cvtColor(paper, page.image, COLOR_BGR2BGRA);
+
+    // lay out the photos in a grid, shrinking them if they don't fit
+    int cols = (int)ceil(sqrt((double)options.photos));
+    int rows = (options.photos + cols - 1) / cols;
+    double cell_width = page_width / cols, cell_height = page_height / rows;
+    double scale = min(1., min(0.8 * cell_width / photo_long,
+                               0.8 * cell_height / photo_short));
+    int border = cvRound(photo_border * scale * options.dpi);
+    Size photo_size(cvRound(photo_long * scale * options.dpi) - 2 * border,
+                    cvRound(photo_short * scale * options.dpi) - 2 * border);
+
+    double level = background + options.contrast * (255 - background);
+    Scalar border_color = Scalar::all(level);
+
+    for (int i = 0; i < options.photos; i++) {
+        Mat contents = photo(rng, photo_size, border_color, border);
+        double w = contents.cols, h = contents.rows;
+
+        // rotate, distort and position the photo within its cell
+        double angle = rng.uniform(-options.rotation, options.rotation) *
+                       CV_PI / 180;
+        Point2f center((i % cols + 0.5) * cell_width * options.dpi,
+                       (i / cols + 0.5) * cell_height * options.dpi);
+        Point2f src[4] = {{0, 0}, {(float)w, 0}, {(float)w, (float)h},
+                          {0, (float)h}};
+        Point2f dst[4];
+        double jitter = options.perspective * max(w, h);
+        for (int j = 0; j < 4; j++) {
+            double x = src[j].x - w / 2 + rng.uniform(-jitter, jitter);
+            double y = src[j].y - h / 2 + rng.uniform(-jitter, jitter);
+            dst[j] = center + Point2f(x * cos(angle) - y * sin(angle),
+                                      x * sin(angle) + y * cos(angle));
+        }
+
+        Mat transform = getPerspectiveTransform(src, dst);
+        warpPerspective(contents, page.image, transform, page.image.size(),
+                        INTER_LINEAR, BORDER_TRANSPARENT);
+
+        vector<Point> shape;
+        for (auto corner : dst)
+            shape.push_back(Point(cvRound(corner.x), cvRound(corner.y)));
+        page.photos.push_back(shape);
+    }
+
+    // scanner noise, leaving the alpha channel opaque
+    Mat noisy, noise(page.image.size(), CV_16SC4);
+    rng.fill(noise, RNG::NORMAL, Scalar::all(0),
+             Scalar(options.noise, options.noise, options.noise, 0));
+    page.image.convertTo(noisy, CV_16SC4);
+    noisy += noise;
+    noisy.convertTo(page.image, CV_8UC4);
+
+    return page;
+}
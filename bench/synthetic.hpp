@@ -0,0 +1,24 @@
+#pragma once
+
+#include <vector>
+
+#include <opencv2/core/core.hpp>
+
+// Parameters of a synthetic album page
+struct SyntheticOptions {
+    int photos = 4;
+    double dpi = 300;
+    double rotation = 5;       // maximal rotation of a photo, in degrees
+    double perspective = 0.01; // maximal corner displacement, relative
+    double contrast = 0.5;     // of the photo border against the background
+    double noise = 4;          // standard deviation of the scanner noise
+    unsigned int seed = 0;
+};
+
+// A synthetic album page, along with the true shape of every photo
+struct SyntheticPage {
+    cv::Mat image; // 4 channels, laid out like QImage::Format_RGB32
+    std::vector<std::vector<cv::Point>> photos;
+};
+
+SyntheticPage generatePage(const SyntheticOptions &options);
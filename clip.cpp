@@ -40,17 +40,21 @@ int line_sect(Point x0, Point x1, Point y0, Point y1, Point &res) {
 //   2. poly has no duplicate vertices;
 //   3. poly has at least three vertices;
 //   4. poly is convex (implying 3).
-int poly_winding(vector<Point> p) { return left_of(p[0], p[1], p[3]); }
+int poly_winding(const Point *p) { return left_of(p[0], p[1], p[3]); }
 
-vector<Point> poly_edge_clip(vector<Point> sub, Point x0, Point x1, int left) {
-    vector<Point> res;
+// clip `sub` against a single edge, into `res` (reusing its storage)
+void poly_edge_clip(const Point *sub, size_t count, Point x0, Point x1,
+                    int left, vector<Point> &res) {
+    res.clear();
+    if (count == 0)
+        return;
 
-    Point v0 = sub[sub.size() - 1], v1;
+    Point v0 = sub[count - 1], v1;
     int side0 = left_of(x0, x1, v0);
     if (side0 != -left)
         res.push_back(v0);
 
-    for (size_t i = 0; i < sub.size(); i++) {
+    for (size_t i = 0; i < count; i++) {
         v1 = sub[i];
         int side1 = left_of(x0, x1, v1);
         Point tmp;
@@ -58,30 +62,32 @@ vector<Point> poly_edge_clip(vector<Point> sub, Point x0, Point x1, int left) {
             // last point and current straddle the edge
             if (line_sect(x0, x1, v0, v1, tmp))
                 res.push_back(tmp);
-        if (i == sub.size() - 1)
+        if (i == count - 1)
             break;
         if (side1 != -left)
             res.push_back(v1);
         v0 = v1;
         side0 = side1;
     }
-
-    return res;
 }
 
-vector<Point> poly_clip(vector<Point> sub, vector<Point> clip) {
-    vector<Point> p1, p2;
+void poly_clip(const Point *sub, size_t sub_count, const Point *clip,
+               size_t clip_count, vector<Point> &result) {
+    // intermediate polygon, kept per thread so clipping doesn't allocate
+    static thread_local vector<Point> scratch;
 
     int dir = poly_winding(clip);
-    p2 = poly_edge_clip(sub, clip[clip.size() - 1], clip[0], dir);
-    for (size_t i = 0; i < clip.size() - 1; i++) {
-        swap(p1, p2);
-        if (p1.size() == 0) {
-            p2.clear();
-            break;
-        }
-        p2 = poly_edge_clip(p1, clip[i], clip[i + 1], dir);
+    poly_edge_clip(sub, sub_count, clip[clip_count - 1], clip[0], dir,
+                   result);
+    for (size_t i = 0; i < clip_count - 1 && !result.empty(); i++) {
+        swap(scratch, result);
+        poly_edge_clip(scratch.data(), scratch.size(), clip[i], clip[i + 1],
+                       dir, result);
     }
+}
 
-    return p2;
+vector<Point> poly_clip(const vector<Point> &sub, const vector<Point> &clip) {
+    vector<Point> result;
+    poly_clip(sub.data(), sub.size(), clip.data(), clip.size(), result);
+    return result;
 }
@@ -2,5 +2,10 @@
 
 #include <opencv2/core/core.hpp>
 
-std::vector<cv::Point> poly_clip(std::vector<cv::Point> sub,
-                                 std::vector<cv::Point> clip);
+// Clip polygon `sub` against convex polygon `clip`, into `result` (reusing its
+// storage), without copying either
+void poly_clip(const cv::Point *sub, size_t sub_count, const cv::Point *clip,
+               size_t clip_count, std::vector<cv::Point> &result);
+
+std::vector<cv::Point> poly_clip(const std::vector<cv::Point> &sub,
+                                 const std::vector<cv::Point> &clip);
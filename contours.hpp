@@ -0,0 +1,61 @@
+#pragma once
+
+#include <vector>
+
+#include <opencv2/core/core.hpp>
+
+typedef std::vector<cv::Point> Shape;
+typedef std::vector<Shape> ShapeList;
+
+// Flat list of contours: all points live in a single buffer, with offsets
+// marking where each contour starts. This avoids a heap allocation (and copy)
+// per contour, and frees everything at once when the list goes out of scope.
+class ContourList {
+  public:
+    size_t size() const { return offsets.size() - 1; }
+    bool empty() const { return size() == 0; }
+
+    // Amount of points of a contour
+    size_t count(size_t i) const { return offsets[i + 1] - offsets[i]; }
+
+    // Points of a contour
+    const cv::Point *begin(size_t i) const {
+        return points.data() + offsets[i];
+    }
+    const cv::Point *end(size_t i) const {
+        return points.data() + offsets[i + 1];
+    }
+
+    // View a contour as a matrix, without copying its points
+    cv::Mat operator[](size_t i) const {
+        return cv::Mat((int)count(i), 1, CV_32SC2, (void *)begin(i));
+    }
+
+    void push_back(const cv::Point *first, size_t count) {
+        points.insert(points.end(), first, first + count);
+        offsets.push_back(points.size());
+    }
+
+    void push_back(const std::vector<cv::Point> &contour) {
+        push_back(contour.data(), contour.size());
+    }
+
+    void append(const ContourList &other) {
+        for (size_t i = 0; i < other.size(); i++)
+            push_back(other.begin(i), other.count(i));
+    }
+
+    void reserve(size_t contours, size_t total_points) {
+        offsets.reserve(contours + 1);
+        points.reserve(total_points);
+    }
+
+    void clear() {
+        points.clear();
+        offsets.assign(1, 0);
+    }
+
+  private:
+    std::vector<cv::Point> points;
+    std::vector<size_t> offsets = {0};
+};
@@ -0,0 +1,243 @@
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QDirIterator>
+#include <QFile>
+#include <QFileInfo>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QTextStream>
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <tuple>
+
+#include "clip.hpp"
+#include "detection.hpp"
+#include "enumerator.hpp"
+#include "scanner.hpp"
+
+using namespace cv;
+using namespace std;
+
+
+//
+// Accuracy
+//
+
+static vector<Point> toShape(const QPolygon &polygon) {
+    vector<Point> shape;
+    for (auto point : polygon)
+        shape.push_back(Point(point.x(), point.y()));
+    return shape;
+}
+
+// Intersection over union of two quads
+static double iou(const QPolygon &a, const QPolygon &b) {
+    if (a.size() != 4 || b.size() != 4)
+        return 0;
+    auto shape_a = toShape(a), shape_b = toShape(b);
+
+    auto clip = poly_clip(shape_a, shape_b);
+    double intersection = clip.size() ? fabs(contourArea(clip)) : 0;
+    double total = fabs(contourArea(shape_a)) + fabs(contourArea(shape_b)) -
+                   intersection;
+    return total > 0 ? intersection / total : 0;
+}
+
+// Match detected shapes with reviewed ones, greedily starting with the pairs
+// that overlap best, and return the amount of matches
+static int match(const QList<QPolygon> &detected,
+                 const QList<QPolygon> &reviewed, double threshold) {
+    vector<tuple<double, int, int>> pairs;
+    for (int i = 0; i < detected.size(); i++)
+        for (int j = 0; j < reviewed.size(); j++) {
+            double overlap = iou(detected[i], reviewed[j]);
+            if (overlap >= threshold)
+                pairs.push_back(make_tuple(overlap, i, j));
+        }
+    sort(pairs.rbegin(), pairs.rend());
+
+    vector<bool> used_detected(detected.size()), used_reviewed(reviewed.size());
+    int matches = 0;
+    for (auto &pair : pairs) {
+        int i = get<1>(pair), j = get<2>(pair);
+        if (!used_detected[i] && !used_reviewed[j]) {
+            used_detected[i] = used_reviewed[j] = true;
+            matches++;
+        }
+    }
+    return matches;
+}
+
+
+//
+// Main
+//
+
+int main(int argc, char *argv[]) {
+    QCoreApplication app(argc, argv);
+    QCoreApplication::setApplicationName("FotoScan corpus");
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription(
+        "Re-run detection on reviewed scans, and compare against the review");
+    parser.addHelpOption();
+    parser.addPositionalArgument("INPUT-DIRECTORY",
+                                 "Path to scan for reviewed images.");
+
+    QCommandLineOption iouOption(
+        "iou", "Minimal intersection over union of a match.", "fraction",
+        "0.9");
+    parser.addOption(iouOption);
+    QCommandLineOption adaptiveOption("adaptive",
+                                      "Use adaptive threshold levels.");
+    parser.addOption(adaptiveOption);
+    QCommandLineOption priorOption(
+        "prior", "Use the review of the previous page as layout prior.");
+    parser.addOption(priorOption);
+    QCommandLineOption minPrecisionOption(
+        "min-precision", "Fail if the overall precision is lower.", "fraction",
+        "0");
+    parser.addOption(minPrecisionOption);
+    QCommandLineOption minRecallOption(
+        "min-recall", "Fail if the overall recall is lower.", "fraction", "0");
+    parser.addOption(minRecallOption);
+    QCommandLineOption outputOption(
+        QStringList() << "o"
+                      << "output",
+        "Write results to <file> instead of standard output.", "file");
+    parser.addOption(outputOption);
+
+    parser.process(app);
+
+    const QStringList args = parser.positionalArguments();
+    if (args.size() != 1)
+        parser.showHelp(1);
+    double threshold = parser.value(iouOption).toDouble();
+    DetectionOptions options;
+    options.adaptiveLevels = parser.isSet(adaptiveOption);
+
+    // find all reviewed scans, in order so the previous page is known
+    // NOTE: scans only detected by a worker have no review to compare against
+    DatStore store;
+    QStringList scans;
+    QDirIterator it(args[0], QDir::Files, QDirIterator::Subdirectories);
+    while (it.hasNext()) {
+        QString path = it.next();
+        if (!isScanFile(path))
+            continue;
+        ScanRecord record;
+        if (store.find(path, record) && record.status != ScanStatus::Detected)
+            scans << path;
+    }
+    scans.sort();
+
+    QJsonArray results;
+    size_t total_reviewed = 0, total_detected = 0, total_matched = 0;
+    size_t failures = 0;
+    double total_ms = 0;
+    QList<QPolygon> previous;
+    QString previous_dir;
+    for (auto path : scans) {
+        QJsonObject result;
+        result["file"] = path;
+
+        ScanData data(path);
+        QFile results_file(getResultPath(path));
+        if (!results_file.open(QIODevice::ReadOnly | QIODevice::Text)) {
+            result["error"] = results_file.errorString();
+            results << result;
+            failures++;
+            continue;
+        }
+        fromJson(&data, QJsonDocument::fromJson(results_file.readAll()));
+        QList<QPolygon> reviewed = data.shapes;
+        data.shapes.clear();
+
+        QString dir = QFileInfo(path).absolutePath();
+        if (parser.isSet(priorOption) && dir == previous_dir)
+            data.prior = previous;
+        previous = reviewed;
+        previous_dir = dir;
+
+        // detect headlessly, through the same task as the application
+        auto start = chrono::steady_clock::now();
+        QString error;
+        DetectionTask task(&data, options);
+        task.setAutoDelete(false);
+        QObject::connect(&task, &DetectionTask::failure,
+                         [&](ScanData *, std::exception *ex) {
+                             error = ex->what();
+                             delete ex;
+                         });
+        task.run();
+        auto end = chrono::steady_clock::now();
+
+        if (!error.isNull()) {
+            result["error"] = error;
+            results << result;
+            failures++;
+            continue;
+        }
+
+        int matched = match(data.shapes, reviewed, threshold);
+        double detect_ms = data.elapsed.count();
+        result["load_ms"] =
+            chrono::duration<double, milli>(end - start).count() - detect_ms;
+        result["detect_ms"] = detect_ms;
+        result["reviewed"] = reviewed.size();
+        result["detected"] = data.shapes.size();
+        result["matched"] = matched;
+        result["precision"] =
+            data.shapes.size() ? (double)matched / data.shapes.size() : 1.;
+        result["recall"] =
+            reviewed.size() ? (double)matched / reviewed.size() : 1.;
+        results << result;
+
+        total_reviewed += reviewed.size();
+        total_detected += data.shapes.size();
+        total_matched += matched;
+        total_ms += detect_ms;
+    }
+
+    double precision =
+        total_detected ? (double)total_matched / total_detected : 1.;
+    double recall = total_reviewed ? (double)total_matched / total_reviewed : 1.;
+    size_t detected_scans = scans.size() - failures;
+
+    QJsonObject summary;
+    summary["scans"] = scans.size();
+    summary["failures"] = (qint64)failures;
+    summary["detect_ms"] = total_ms;
+    summary["mean_detect_ms"] = detected_scans ? total_ms / detected_scans : 0;
+    summary["precision"] = precision;
+    summary["recall"] = recall;
+
+    QJsonObject root;
+    root["summary"] = summary;
+    root["scans"] = results;
+    QByteArray json = QJsonDocument(root).toJson();
+
+    if (parser.isSet(outputOption)) {
+        QFile output(parser.value(outputOption));
+        if (!output.open(QIODevice::WriteOnly | QIODevice::Text)) {
+            qCritical("Could not write results to %s: %s",
+                      qPrintable(output.fileName()),
+                      qPrintable(output.errorString()));
+            return 1;
+        }
+        output.write(json);
+    } else {
+        QTextStream(stdout) << json;
+    }
+
+    if (precision < parser.value(minPrecisionOption).toDouble() ||
+        recall < parser.value(minRecallOption).toDouble())
+        return 2;
+    return 0;
+}
@@ -0,0 +1,4 @@
+include(../fotoscan.pri)
+
+TARGET        = corpus
+SOURCES      += corpus.cpp
@@ -2,24 +2,30 @@
 
 #include <QFileInfo>
 #include <QDebug>
+#include <QJsonArray>
+#include <QJsonObject>
+#include <QStringList>
 
 #include <opencv2/core/core.hpp>
 #include <opencv2/objdetect/objdetect.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
 
+#include <algorithm>
 #include <iostream>
 #include <cmath>
 #include <chrono>
+#include <unordered_set>
 
+#include "bands.hpp"
 #include "clip.hpp"
+#include "contours.hpp"
+#include "duplicates.hpp"
 #include "scanner.hpp"
+#include "trace.hpp"
 
 using namespace cv;
 using namespace std;
 
-typedef vector<Point> Shape;
-typedef vector<Shape> ShapeList;
-
 
 //
 // Detection functionality
@@ -35,16 +41,97 @@ static double angle(Point pt1, Point pt2, Point pt0) {
            sqrt((dx1 * dx1 + dy1 * dy1) * (dx2 * dx2 + dy2 * dy2) + 1e-10);
 }
 
-// Extract a sequence of contours detected in the image.
 int thresh = 50, N = 11;
-ShapeList extractContours(const Mat &image) {
+
+// Binarize a single channel at a given threshold level, or using Canny for
+// level 0 (which would be pointless as a threshold)
+static void binarize(const Mat &gray0, int threshold, Mat &gray) {
+    // hack: use Canny instead of zero threshold level.
+    // Canny helps to catch squares with gradient shading
+    if (threshold == 0) {
+        // apply Canny. Take the upper threshold from slider
+        // and set the lower to 0 (which forces edges merging)
+        Canny(gray0, gray, 0, thresh, 5);
+        // dilate canny output to remove potential
+        // holes between edge segments
+        dilate(gray, gray, Mat(), Point(-1, -1));
+    } else {
+        // apply threshold if l!=0:
+        //     tgray(x,y) = gray(x,y) < (l+1)*255/N ? 255 : 0
+        gray = gray0 >= threshold;
+    }
+}
+
+// Quantization of the bounding box and perimeter when fingerprinting contours
+static const int fingerprint_grid = 8;
+static const double fingerprint_buckets = 8; // per doubling of the perimeter
+
+// Cheap fingerprint of a contour, identical for near-identical contours as
+// found by different channels or threshold levels. Contours too small to ever
+// be accepted get a fingerprint of 0.
+static uint64_t fingerprint(const Shape &contour) {
+    Rect bbox = boundingRect(contour);
+    if (bbox.area() < 1000)
+        return 0;
+
+    auto perimeter = arcLength(contour, true);
+    uint64_t fields[] = {
+        uint64_t(bbox.x / fingerprint_grid),
+        uint64_t(bbox.y / fingerprint_grid),
+        uint64_t(bbox.width / fingerprint_grid),
+        uint64_t(bbox.height / fingerprint_grid),
+        uint64_t(log2(perimeter) * fingerprint_buckets),
+        uint64_t(log2(contour.size()))};
+    const int bits[] = {12, 12, 12, 12, 8, 6};
+
+    uint64_t result = 1;
+    for (int i = 0; i < 6; i++)
+        result = (result << bits[i]) | (fields[i] & ((1 << bits[i]) - 1));
+    return result;
+}
+
+// Contours found by a single threshold pass, along with their fingerprints
+struct PassContours {
+    ContourList contours;
+    vector<uint64_t> fingerprints;
+};
+
+// Fingerprint the contours found by a pass, and move them into its buffer
+// unless they are too small to be of interest
+static void collectContours(const ShapeList &found, PassContours &pass) {
+    for (auto &contour : found) {
+        auto print = fingerprint(contour);
+        if (print != 0) {
+            pass.contours.push_back(contour);
+            pass.fingerprints.push_back(print);
+        }
+    }
+}
+
+// Merge the contours of a pass into a list, unless they are near-identical to
+// one that has been seen before.
+// NOTE: passes should be merged in a fixed order, so which copy of a contour
+//       survives does not depend on thread timing
+static void mergeUniqueContours(const PassContours &pass,
+                                ContourList &all_contours,
+                                unordered_set<uint64_t> &seen) {
+    for (size_t i = 0; i < pass.contours.size(); i++)
+        if (seen.insert(pass.fingerprints[i]).second)
+            all_contours.push_back(pass.contours.begin(i),
+                                   pass.contours.count(i));
+}
+
+// Extract a sequence of contours detected in the image.
+ContourList extractContours(const Mat &image) {
     // down-scale and upscale the image to filter out the noise
     Mat pyr, timg;
     pyrDown(image, pyr, Size(image.cols / 2, image.rows / 2));
     pyrUp(pyr, timg, image.size());
 
-    // find squares in every color plane of the image
-    ShapeList all_contours;
+    // find squares in every color plane of the image, every pass collecting
+    // into its own buffer
+    vector<PassContours> passes(3 * N);
+    const QString scan = TraceSpan::currentFile();
     #pragma omp parallel for
     for (int c = 0; c < 3; c++) {
         Mat gray0(image.size(), CV_8U);
@@ -55,84 +142,110 @@ ShapeList extractContours(const Mat &image) {
         // try several threshold levels
         #pragma omp parallel for
         for (int l = 0; l < N; l++) {
+            TraceSpan span("extractContours", scan);
+            span.arg("channel", c);
+            span.arg("level", l);
+
             Mat gray;
-            // hack: use Canny instead of zero threshold level.
-            // Canny helps to catch squares with gradient shading
-            if (l == 0) {
-                // apply Canny. Take the upper threshold from slider
-                // and set the lower to 0 (which forces edges merging)
-                Canny(gray0, gray, 0, thresh, 5);
-                // dilate canny output to remove potential
-                // holes between edge segments
-                dilate(gray, gray, Mat(), Point(-1, -1));
-            } else {
-                // apply threshold if l!=0:
-                //     tgray(x,y) = gray(x,y) < (l+1)*255/N ? 255 : 0
-                gray = gray0 >= (l + 1) * 255 / N;
-            }
+            binarize(gray0, l == 0 ? 0 : (l + 1) * 255 / N, gray);
 
             // find contours and store them all as a list
             ShapeList contours;
             findContours(gray, contours, RETR_LIST, CHAIN_APPROX_SIMPLE);
 
-            #pragma omp critical(all_contours)
-            all_contours.insert(all_contours.end(), contours.begin(),
-                                contours.end());
+            collectContours(contours, passes[c * N + l]);
         }
     }
 
+    // merge the unique contours of all passes, in order
+    ContourList all_contours;
+    unordered_set<uint64_t> seen;
+    for (auto &pass : passes)
+        mergeUniqueContours(pass, all_contours, seen);
+
     return all_contours;
 }
 
+// Classification of a candidate shape
+enum class Verdict {
+    Discard, // not a square at all, or too small to bother
+    Reject,  // a square, but not one we are looking for
+    Accept
+};
+
+// Find the maximum cosine of the angle between joint edges of a square
+static double maxCosine(const Shape &square) {
+    double result = 0;
+    for (int j = 2; j < 5; j++) {
+        double cosine =
+            fabs(angle(square[j % 4], square[j - 2], square[j - 1]));
+        result = max(result, cosine);
+    }
+    return result;
+}
+
+// Classify an approximated contour
+static Verdict classifyShape(const Shape &approx) {
+    // square contours should have 4 vertices after approximation
+    // and be convex.
+    if (approx.size() != 4 || !isContourConvex(Mat(approx)))
+        return Verdict::Discard;
+
+    // Filter on area
+    // Note: absolute value of an area is used because
+    // area may be positive or negative - in accordance with the
+    // contour orientation
+    auto area = fabs(contourArea(Mat(approx)));
+    if (area < 1000)
+        return Verdict::Discard; // truly-reject useless contours
+    if (area < 500000 || area > 20000000)
+        return Verdict::Reject;
+
+    // if cosines of all angles are small (angles should be ~90
+    // degrees)
+    if (maxCosine(approx) > 0.10)
+        return Verdict::Reject;
+
+    return Verdict::Accept;
+}
+
 // Filter the squares from a list of contours
-ShapeList filterShapes(const ShapeList &contours,
-                        ShapeList & rejects) {
-    ShapeList accepts;
+ContourList filterShapes(const ContourList &contours, ContourList &rejects) {
+    // every contour gets its own output slot, so no locking is needed and the
+    // results can be merged in order
+    vector<Verdict> verdicts(contours.size());
+    vector<Shape> squares(contours.size());
 
     // test each contour
-    #pragma omp parallel for
-    for (size_t i = 0; i < contours.size(); i++) {
-        // approximate contour with accuracy proportional
-        // to the contour perimeter
+    #pragma omp parallel
+    {
+        // reuse the approximation buffer across contours
         Shape approx;
-        approxPolyDP(Mat(contours[i]), approx,
-                     arcLength(Mat(contours[i]), true) * 0.02, true);
-
-        // square contours should have 4 vertices after approximation
-        // and be convex.
-        if (approx.size() == 4 && isContourConvex(Mat(approx))) {
-            double maxCosine = 0;
-
-            // Filter on area
-            // Note: absolute value of an area is used because
-            // area may be positive or negative - in accordance with the
-            // contour orientation
-            auto area = fabs(contourArea(Mat(approx)));
-            if (area < 1000)
-                continue; // truly-reject useless contours
-            if (area < 500000 || area > 20000000)
-                goto reject;
-
-            for (int j = 2; j < 5; j++) {
-                // find the maximum cosine of the angle between joint
-                // edges
-                double cosine =
-                    fabs(angle(approx[j % 4], approx[j - 2], approx[j - 1]));
-                maxCosine = max(maxCosine, cosine);
-            }
 
-            // if cosines of all angles are small (angles should be ~90
-            // degrees)
-            if (maxCosine > 0.10)
-                goto reject;
+        #pragma omp for
+        for (size_t i = 0; i < contours.size(); i++) {
+            // approximate contour with accuracy proportional
+            // to the contour perimeter
+            approxPolyDP(contours[i], approx,
+                         arcLength(contours[i], true) * 0.02, true);
 
-            #pragma omp critical(accepts)
-            accepts.push_back(approx);
-            continue;
+            verdicts[i] = classifyShape(approx);
+            if (verdicts[i] != Verdict::Discard)
+                squares[i] = approx;
+        }
+    }
 
-        reject:
-            #pragma omp critical(rejects)
-            rejects.push_back(approx);
+    ContourList accepts;
+    for (size_t i = 0; i < contours.size(); i++) {
+        switch (verdicts[i]) {
+        case Verdict::Accept:
+            accepts.push_back(squares[i]);
+            break;
+        case Verdict::Reject:
+            rejects.push_back(squares[i]);
+            break;
+        case Verdict::Discard:
+            break;
         }
     }
 
@@ -141,13 +254,16 @@ ShapeList filterShapes(const ShapeList &contours,
 
 // Comparison function for share partitioning, true if the intersection of
 // two shapes occupies 90% or more of the largest shape
-bool cmp_shape(const Shape &a, const Shape &b) {
-    auto clip = poly_clip(a, b);
+bool cmp_shape(const ContourList &a, size_t i, const ContourList &b,
+               size_t j) {
+    // intersection kept per thread, so comparing doesn't allocate
+    static thread_local vector<Point> clip;
+    poly_clip(a.begin(i), a.count(i), b.begin(j), b.count(j), clip);
     if (clip.size() == 0)
         return false;
 
-    auto a_a = contourArea(Mat(a));
-    auto a_b = contourArea(Mat(b));
+    auto a_a = contourArea(a[i]);
+    auto a_b = contourArea(b[j]);
     auto a_clip = contourArea(Mat(clip));
 
     return a_clip / max(a_a, a_b) > 0.90;
@@ -155,54 +271,482 @@ bool cmp_shape(const Shape &a, const Shape &b) {
 
 // Minimize the amount of shapes by partitioning based on the area of overlap
 // and selecting the square with the straightest corners
-ShapeList minimizeShapes(const ShapeList &shapes) {
+ContourList minimizeShapes(const ContourList &shapes) {
     // partition shapes according to the intersection area
+    // NOTE: partitioning indices, as the shapes live in a flat list
+    vector<size_t> indices(shapes.size());
+    for (size_t i = 0; i < shapes.size(); i++)
+        indices[i] = i;
     vector<int> labels;
-    int groups = partition(shapes, labels, cmp_shape);
+    int groups = partition(indices, labels, [&](size_t a, size_t b) {
+        return cmp_shape(shapes, a, shapes, b);
+    });
 
     // for each group, select shape with straightest corners
-    ShapeList grouped_squares(groups);
+    vector<int> grouped_squares(groups, -1);
     vector<float> minCosines(groups);
     for (size_t i = 0; i < shapes.size(); i++) {
         int group = labels[i];
+        const Point *shape = shapes.begin(i);
 
         // find the minimum cosine of the angle between joint edges
         double minCosine = std::numeric_limits<double>::max();
         for (int j = 2; j < 5; j++) {
-            double cosine = fabs(
-                angle(shapes[i][j % 4], shapes[i][j - 2], shapes[i][j - 1]));
+            double cosine =
+                fabs(angle(shape[j % 4], shape[j - 2], shape[j - 1]));
             minCosine = min(minCosine, cosine);
         }
 
-        if (grouped_squares[group].size() == 0 ||
-            minCosine < minCosines[group]) {
-            grouped_squares[group] = shapes[i];
+        if (grouped_squares[group] == -1 || minCosine < minCosines[group]) {
+            grouped_squares[group] = i;
             minCosines[group] = minCosine;
         }
     }
 
-    return grouped_squares;
+    ContourList grouped;
+    grouped.reserve(groups, 4 * groups);
+    for (int i : grouped_squares)
+        grouped.push_back(shapes.begin(i), shapes.count(i));
+    return grouped;
 }
 
 
-//
-// Auxiliary conversions (OpenCV to Qt)
-//
+// A single threshold pass of the adaptive detection
+struct Pass {
+    int channel;
+    int threshold;
+    double depth; // of the histogram valley, as a fraction of all pixels
+};
+
+// Minimal distance between threshold levels of a single channel, the amount of
+// passes evaluated in parallel, and the amount of consecutive batches without
+// new shapes after which the adaptive detection gives up
+static const int adaptive_spacing = 255 / N / 2;
+static const size_t adaptive_batch = 3;
+static const size_t adaptive_patience = 2;
+
+// Pick threshold levels for a single channel from the valleys in its
+// histogram, deepest first, followed by the regular grid levels as fallback
+static vector<Pass> histogramPasses(const Mat &gray0, int channel) {
+    Mat hist, smooth;
+    int histSize = 256;
+    int channels[] = {0};
+    float range[] = {0, 256};
+    const float *ranges[] = {range};
+    calcHist(&gray0, 1, channels, Mat(), hist, 1, &histSize, ranges);
+    GaussianBlur(hist, smooth, Size(1, 9), 0);
+
+    // a valley is as deep as the lowest of the highest peaks around it
+    vector<float> left(256), right(256);
+    for (int v = 0; v < 256; v++)
+        left[v] = max(smooth.at<float>(v), v > 0 ? left[v - 1] : 0.f);
+    for (int v = 255; v >= 0; v--)
+        right[v] = max(smooth.at<float>(v), v < 255 ? right[v + 1] : 0.f);
+
+    vector<Pass> valleys;
+    for (int v = 1; v < 255; v++) {
+        float h = smooth.at<float>(v);
+        if (h < smooth.at<float>(v - 1) && h <= smooth.at<float>(v + 1)) {
+            double depth = (min(left[v], right[v]) - h) / gray0.total();
+            valleys.push_back({channel, v, depth});
+        }
+    }
+    sort(valleys.begin(), valleys.end(),
+         [](const Pass &a, const Pass &b) { return a.depth > b.depth; });
+
+    // always start with Canny, and never try more levels than the regular
+    // grid has, or levels too close to one we already have
+    vector<Pass> passes = {{channel, 0, numeric_limits<double>::max()}};
+    auto add = [&](const Pass &pass) {
+        if (passes.size() >= (size_t)N)
+            return;
+        for (auto &other : passes)
+            if (other.threshold != 0 &&
+                abs(other.threshold - pass.threshold) < adaptive_spacing)
+                return;
+        passes.push_back(pass);
+    };
+    for (auto &valley : valleys)
+        add(valley);
+    for (int l = 1; l < N; l++)
+        add({channel, (l + 1) * 255 / N, 0});
+
+    return passes;
+}
+
+// Extract and filter shapes from the image, using threshold levels picked from
+// the histogram of every channel. Passes are processed in order of expected
+// yield, stopping when they no longer contribute any new shapes.
+ContourList extractShapesAdaptive(const Mat &image, ContourList &rejects,
+                                  QVector<LevelYield> &yields) {
+    // down-scale and upscale the image to filter out the noise
+    Mat pyr, timg;
+    pyrDown(image, pyr, Size(image.cols / 2, image.rows / 2));
+    pyrUp(pyr, timg, image.size());
+
+    vector<Mat> planes;
+    split(timg, planes);
+
+    // order the passes of all channels by the depth of their valley, making
+    // sure the Canny passes come first
+    vector<Pass> passes;
+    for (int c = 0; c < 3; c++) {
+        auto channel_passes = histogramPasses(planes[c], c);
+        passes.insert(passes.end(), channel_passes.begin(),
+                      channel_passes.end());
+    }
+    stable_sort(passes.begin(), passes.end(),
+                [](const Pass &a, const Pass &b) { return a.depth > b.depth; });
+
+    ContourList accepts;
+    unordered_set<uint64_t> seen;
+    size_t idle = 0;
+    for (size_t start = 0; start < passes.size(); start += adaptive_batch) {
+        size_t count = min(adaptive_batch, passes.size() - start);
+        vector<PassContours> batch(count);
+
+        const QString scan = TraceSpan::currentFile();
+        #pragma omp parallel for
+        for (int i = 0; i < (int)count; i++) {
+            auto &pass = passes[start + i];
+            TraceSpan span("extractContours", scan);
+            span.arg("channel", pass.channel);
+            span.arg("threshold", pass.threshold);
+
+            Mat gray;
+            binarize(planes[pass.channel], pass.threshold, gray);
+
+            ShapeList contours;
+            findContours(gray, contours, RETR_LIST, CHAIN_APPROX_SIMPLE);
+            collectContours(contours, batch[i]);
+        }
+
+        // deduplicate and filter the passes in order
+        vector<size_t> batch_contours(count);
+        vector<ContourList> batch_accepts(count), batch_rejects(count);
+        for (size_t i = 0; i < count; i++) {
+            TraceSpan span("filterShapes");
+            ContourList unique_contours;
+            mergeUniqueContours(batch[i], unique_contours, seen);
+
+            batch_contours[i] = unique_contours.size();
+            batch_accepts[i] = filterShapes(unique_contours, batch_rejects[i]);
+        }
+
+        // only count shapes which don't overlap with ones we already have
+        bool contributed = false;
+        for (size_t i = 0; i < count; i++) {
+            size_t fresh = 0;
+            for (size_t j = 0; j < batch_accepts[i].size(); j++) {
+                bool known = false;
+                for (size_t k = 0; k < accepts.size() && !known; k++)
+                    known = cmp_shape(batch_accepts[i], j, accepts, k);
+                if (!known)
+                    fresh++;
+                accepts.push_back(batch_accepts[i].begin(j),
+                                  batch_accepts[i].count(j));
+            }
+            rejects.append(batch_rejects[i]);
+
+            auto &pass = passes[start + i];
+            yields << LevelYield{pass.channel, pass.threshold,
+                                 batch_contours[i], batch_accepts[i].size(),
+                                 fresh};
+            contributed |= fresh > 0;
+        }
+
+        if (contributed)
+            idle = 0;
+        else if (++idle >= adaptive_patience)
+            break;
+    }
+
+    return accepts;
+}
+
+
+// Half-width of the band around an expected edge that is searched when
+// verifying a layout prior, the amount of samples taken along each edge, and
+// the minimal intensity step (summed over all channels) that counts as an edge
+static const int prior_band = 40;
+static const int prior_samples = 64;
+static const int prior_contrast = 60;
+
+// Intensity of a pixel summed over its colour channels, averaged over a small
+// segment along the given direction, or -1 when outside of the image (whose
+// top-left corner lies at `origin` in the scan)
+static int intensity(const Mat &image, Point2f origin, Point2f p,
+                     Point2f dir) {
+    int sum = 0;
+    for (int i = -1; i <= 1; i++) {
+        Point2f q = p - origin + dir * i;
+        int x = cvRound(q.x), y = cvRound(q.y);
+        if (x < 0 || y < 0 || x >= image.cols || y >= image.rows)
+            return -1;
+        const Vec4b &pixel = image.at<Vec4b>(y, x);
+        sum += pixel[0] + pixel[1] + pixel[2];
+    }
+    return sum / 3;
+}
+
+// Points along an expected edge at which to look for it, staying clear of the
+// corners, where the neighbouring edge interferes. None for edges too short to
+// be snapped.
+static vector<Point2f> edgeSamples(Point2f a, Point2f b) {
+    vector<Point2f> samples;
+    Point2f dir = b - a;
+    if (sqrt(dir.dot(dir)) < 2 * prior_band)
+        return samples;
+    for (int i = 0; i < prior_samples; i++) {
+        float t = 0.1f + 0.8f * (i + 0.5f) / prior_samples;
+        samples.push_back(a + (b - a) * t);
+    }
+    return samples;
+}
 
-static QPolygon toPolygon(Shape shape) {
-    QPolygon polygon;
-    for (auto point : shape)
-        polygon << QPoint(point.x, point.y);
-    return polygon;
+// Unit vectors along and across an edge
+static void edgeAxes(Point2f a, Point2f b, Point2f &dir, Point2f &normal) {
+    dir = b - a;
+    float length = sqrt(dir.dot(dir));
+    dir = length > 0 ? dir * (1 / length) : Point2f(1, 0);
+    normal = Point2f(-dir.y, dir.x);
 }
 
-static QList<QPolygon> toPolygonList(ShapeList shapes) {
+// Find the strongest intensity step across an edge near a sample point,
+// slightly preferring the expected position
+static bool findStep(const Mat &image, Point2f origin, Point2f p, Point2f dir,
+                     Point2f normal, Point2f &hit) {
+    double best_score = 0;
+    int best_offset = 0;
+    for (int o = -prior_band; o <= prior_band; o++) {
+        int i0 = intensity(image, origin, p + normal * (o - 2), dir);
+        int i1 = intensity(image, origin, p + normal * (o + 2), dir);
+        if (i0 < 0 || i1 < 0)
+            continue;
+        int step = abs(i1 - i0);
+        if (step < prior_contrast)
+            continue;
+        double score = step * (1 - fabs(o) / (4. * prior_band));
+        if (score > best_score) {
+            best_score = score;
+            best_offset = o;
+        }
+    }
+    hit = p + normal * best_offset;
+    return best_score > 0;
+}
+
+// Fit a line through the steps found along an edge. Returns false if too few
+// were found, or if they don't line up.
+static bool fitEdge(const vector<Point2f> &hits, Vec4f &line) {
+    if (hits.size() < prior_samples * 3 / 4)
+        return false;
+
+    fitLine(hits, line, DIST_HUBER, 0, 0.01, 0.01);
+
+    // the hits should line up, or we snapped to texture instead of an edge
+    Point2f line_dir(line[0], line[1]), line_pt(line[2], line[3]);
+    size_t inliers = 0;
+    for (auto hit : hits)
+        if (fabs(line_dir.cross(hit - line_pt)) <= 2)
+            inliers++;
+    return inliers >= hits.size() * 3 / 4;
+}
+
+// Snap a single edge of a prior shape to the strongest nearby intensity step,
+// looking only within a narrow band perpendicular to the expected edge.
+// Returns false if no straight, consistent edge was found.
+static bool snapEdge(const Mat &image, Point2f a, Point2f b, Vec4f &line) {
+    vector<Point2f> samples = edgeSamples(a, b);
+    if (samples.empty())
+        return false;
+    Point2f dir, normal;
+    edgeAxes(a, b, dir, normal);
+
+    vector<Point2f> hits;
+    for (auto p : samples) {
+        Point2f hit;
+        if (findStep(image, Point2f(0, 0), p, dir, normal, hit))
+            hits.push_back(hit);
+    }
+    return fitEdge(hits, line);
+}
+
+// Intersect two lines as returned by fitLine
+static bool intersect(const Vec4f &l1, const Vec4f &l2, Point &res) {
+    Point2f d1(l1[0], l1[1]), p1(l1[2], l1[3]);
+    Point2f d2(l2[0], l2[1]), p2(l2[2], l2[3]);
+    double cross = d1.cross(d2);
+    if (fabs(cross) < 1e-3)
+        return false;
+    double t = (p2 - p1).cross(d2) / cross;
+    res = Point(cvRound(p1.x + d1.x * t), cvRound(p1.y + d1.y * t));
+    return true;
+}
+
+// Verify a layout prior (eg. the reviewed shapes of the previous page) by
+// snapping every edge to the image, returning false if any shape cannot be
+// found back and a full detection is required
+bool snapShapes(const Mat &image, const ShapeList &prior, ContourList &shapes) {
+    shapes.clear();
+    for (auto &shape : prior) {
+        if (shape.size() != 4)
+            return false;
+
+        Vec4f lines[4];
+        for (int i = 0; i < 4; i++)
+            if (!snapEdge(image, shape[i], shape[(i + 1) % 4], lines[i]))
+                return false;
+
+        // every corner lies on the intersection of its adjoining edges
+        Shape snapped(4);
+        for (int i = 0; i < 4; i++)
+            if (!intersect(lines[(i + 3) % 4], lines[i], snapped[i]))
+                return false;
+
+        if (classifyShape(snapped) != Verdict::Accept)
+            return false;
+        shapes.push_back(snapped);
+    }
+
+    return !shapes.empty();
+}
+
+
+// Rows of a large scan read at once when refining its shapes
+static const int refine_band = 1024;
+
+// Refine shapes detected on a reduced copy of a scan by snapping their edges at
+// full resolution, reading the scan band by band. Only the band being searched
+// is kept in memory; every sample along an edge is searched in the band it
+// lies in, with enough overlap between bands for the search to fit.
+ContourList refineShapes(BandReader &bands, const ContourList &shapes,
+                         double scale) {
+    struct Edge {
+        Point2f a, b, dir, normal;
+        vector<Point2f> hits;
+    };
+    struct Sample {
+        size_t edge;
+        Point2f p;
+    };
+
+    // shapes scaled up to the scan, and where to look for their edges
+    vector<Edge> edges;
+    vector<Sample> samples;
+    for (size_t i = 0; i < shapes.size(); i++) {
+        const Point *shape = shapes.begin(i);
+        for (int j = 0; j < 4; j++) {
+            Edge edge;
+            edge.a = Point2f(shape[j].x, shape[j].y) * (1 / scale);
+            edge.b = Point2f(shape[(j + 1) % 4].x, shape[(j + 1) % 4].y) *
+                     (1 / scale);
+            edgeAxes(edge.a, edge.b, edge.dir, edge.normal);
+            for (auto p : edgeSamples(edge.a, edge.b))
+                samples.push_back(Sample{edges.size(), p});
+            edges.push_back(edge);
+        }
+    }
+    sort(samples.begin(), samples.end(),
+         [](const Sample &a, const Sample &b) { return a.p.y < b.p.y; });
+
+    QSize size = bands.size();
+    int margin = prior_band + 4; // reach of the search around a sample
+    auto sample = samples.begin();
+    for (int top = 0; top < size.height() && sample != samples.end();
+         top += refine_band) {
+        int bottom = min(top + refine_band, size.height());
+        for (; sample != samples.end() && sample->p.y < top; sample++)
+            ; // above the scan
+        if (sample == samples.end() || sample->p.y >= bottom)
+            continue;
+
+        TraceSpan span("refineBand");
+        int from = max(0, top - margin);
+        QImage band =
+            bands.read(from, min(bottom + margin, size.height()) - from);
+        if (band.isNull())
+            break;
+        Mat mat(band.height(), band.width(), CV_8UC4, band.bits(),
+                band.bytesPerLine());
+
+        for (; sample != samples.end() && sample->p.y < bottom; sample++) {
+            Edge &edge = edges[sample->edge];
+            Point2f hit;
+            if (findStep(mat, Point2f(0, from), sample->p, edge.dir,
+                         edge.normal, hit))
+                edge.hits.push_back(hit);
+        }
+    }
+
+    // edges that couldn't be snapped stay where they were detected
+    ContourList refined;
+    for (size_t i = 0; i < shapes.size(); i++) {
+        Vec4f lines[4];
+        for (int j = 0; j < 4; j++) {
+            Edge &edge = edges[4 * i + j];
+            if (!fitEdge(edge.hits, lines[j]))
+                lines[j] = Vec4f(edge.dir.x, edge.dir.y, edge.a.x, edge.a.y);
+        }
+
+        Shape shape(4);
+        for (int j = 0; j < 4; j++) {
+            Point2f corner = edges[4 * i + j].a;
+            if (!intersect(lines[(j + 3) % 4], lines[j], shape[j]))
+                shape[j] = Point(cvRound(corner.x), cvRound(corner.y));
+        }
+        if (classifyShape(shape) != Verdict::Accept)
+            for (int j = 0; j < 4; j++)
+                shape[j] = Point(cvRound(edges[4 * i + j].a.x),
+                                 cvRound(edges[4 * i + j].a.y));
+        refined.push_back(shape);
+    }
+    return refined;
+}
+
+// Scale all points of a list of contours
+static ContourList scaleContours(const ContourList &contours, double factor) {
+    ContourList scaled;
+    for (size_t i = 0; i < contours.size(); i++) {
+        Shape contour;
+        for (auto point = contours.begin(i); point != contours.end(i); point++)
+            contour.push_back(Point(cvRound(point->x * factor),
+                                    cvRound(point->y * factor)));
+        scaled.push_back(contour);
+    }
+    return scaled;
+}
+
+
+//
+// Auxiliary conversions (between OpenCV and Qt)
+//
+
+static QList<QPolygon> toPolygonList(const ContourList &shapes) {
     QList<QPolygon> polygons;
-    for (auto shape : shapes)
-        polygons << toPolygon(shape);
+    for (size_t i = 0; i < shapes.size(); i++) {
+        QPolygon polygon;
+        for (auto point = shapes.begin(i); point != shapes.end(i); point++)
+            polygon << QPoint(point->x, point->y);
+        polygons << polygon;
+    }
     return polygons;
 }
 
+static Shape toShape(QPolygon polygon) {
+    Shape shape;
+    for (auto point : polygon)
+        shape.push_back(Point(point.x(), point.y()));
+    return shape;
+}
+
+static ShapeList toShapeList(QList<QPolygon> polygons) {
+    ShapeList shapes;
+    for (auto polygon : polygons)
+        shapes.push_back(toShape(polygon));
+    return shapes;
+}
+
 static QRect toRect(Shape shape) {
     assert(shape.size() == 4);
     return QRect(QPoint(shape[0].x, shape[0].y),
@@ -221,16 +765,70 @@ static QList<QRect> toRectList(ShapeList shapes) {
 // DetectionTask
 //
 
-DetectionTask::DetectionTask(ScanData *data) : data(data) {}
+// Pixels of the reduced copy of a reviewed page decoded to align a rescan of
+// it to
+static const qint64 align_pixels = 4000000;
+
+// Verify the shapes of a similar page, at full resolution, on the image of a
+// scan at `scale`
+static bool snapPrior(const Mat &image, const QList<QPolygon> &shapes,
+                      double scale, ContourList &snapped) {
+    ShapeList prior = toShapeList(shapes);
+    for (auto &shape : prior)
+        for (auto &point : shape)
+            point = Point(cvRound(point.x * scale), cvRound(point.y * scale));
+    return snapShapes(image, prior, snapped);
+}
+
+// Shapes of the reviewed page a scan is a rescan of, aligned to the scan, or
+// none if it isn't a rescan (or can't be aligned). `strong` tells whether the
+// alignment can be trusted with the review of the page.
+static QList<QPolygon> alignDuplicate(const ScanData *data, QString &original,
+                                      bool &strong) {
+    const ReviewedPage *page = data->reviewed.find(data->file, data->phash);
+    if (page == nullptr)
+        return QList<QPolygon>();
+    TraceSpan span("alignDuplicate", data->file);
+    span.arg("original", page->file);
+
+    // a reduced copy will do, whose hashes are known already
+    ScanData copy(page->file);
+    copy.hash = page->hash;
+    copy.phash = page->phash;
+    copy.maxPixels = align_pixels;
+    try {
+        copy.load();
+    } catch (std::exception *ex) {
+        qWarning("Could not compare %s to %s: %s", qPrintable(data->file),
+                 qPrintable(page->file), ex->what());
+        delete ex;
+        return QList<QPolygon>();
+    }
+
+    QList<QPolygon> aligned;
+    if (!alignShapes(copy.image, copy.imageScale, data->image,
+                     data->imageScale, page->shapes, aligned, strong))
+        return QList<QPolygon>();
+    span.arg("strong", strong);
+    original = page->file;
+    return aligned;
+}
+
+DetectionTask::DetectionTask(ScanData *data, const DetectionOptions &options)
+    : data(data), options(options) {}
 
 void DetectionTask::run() {
-    // Lazy-load image data
+    TraceSpan span("detect", data->file);
+    emit started(data);
+
+    // Lazy-load image data, which is a reduced copy for large scans
     try {
         data->load();
     } catch (std::exception *ex) {
         emit failure(data, ex);
         return;
     }
+    double scale = data->imageScale;
 
     // Convert to OpenCV format
     Mat mat;
@@ -244,21 +842,90 @@ void DetectionTask::run() {
     }
 
     auto start = chrono::system_clock::now();
+    UsageMeter meter(data->stats.detect);
+
+    // a rescan of a reviewed page takes over its shapes (and review) once they
+    // snap to the scan, unless the alignment is weak: then they are only a
+    // prior, still to be reviewed
+    QString original;
+    bool strong = false;
+    QList<QPolygon> duplicate = alignDuplicate(data, original, strong);
+    data->reviewed.clear();
+
+    // try the layout prior next, only doing a full sweep if it doesn't fit
+    // NOTE: all contours of this run live in flat lists, freed at once when
+    //       returning from this function
+    ContourList cv_rejects, cv_ungrouped, cv_shapes;
+    bool snapped;
+    {
+        TraceSpan span("snapShapes");
+        snapped = snapPrior(mat, duplicate, scale, cv_shapes);
+        if (snapped && strong)
+            data->duplicateOf = original;
+        else if (!snapped)
+            snapped = snapPrior(mat, data->prior, scale, cv_shapes);
+    }
+    if (!data->duplicateOf.isEmpty()) {
+        span.arg("rescan_of", data->duplicateOf);
+        data->stats.rescans = 1;
+    }
+    if (!snapped) {
+        if (options.adaptiveLevels) {
+            cv_ungrouped = extractShapesAdaptive(mat, cv_rejects, data->yields);
+            for (auto &yield : data->yields)
+                data->stats.contours += yield.contours;
+        } else {
+            ContourList cv_contours = extractContours(mat);
+            data->stats.contours += cv_contours.size();
+
+            TraceSpan span("filterShapes");
+            cv_ungrouped = filterShapes(cv_contours, cv_rejects);
+        }
 
-    ShapeList cv_contours = extractContours(mat);
-
-    ShapeList cv_rejects;
-    ShapeList cv_ungrouped =
-        filterShapes(cv_contours, cv_rejects);
-
-    ShapeList cv_shapes = minimizeShapes(cv_ungrouped);
+        TraceSpan span("minimizeShapes");
+        cv_shapes = minimizeShapes(cv_ungrouped);
+    } else
+        cv_ungrouped = cv_shapes;
+
+    // shapes found on a reduced copy are refined at full resolution
+    if (scale != 1) {
+        TraceSpan span("refineShapes");
+        auto bands = BandReader::open(data->file);
+        cv_shapes = bands ? refineShapes(*bands, cv_shapes, scale)
+                          : scaleContours(cv_shapes, 1 / scale);
+        cv_rejects = scaleContours(cv_rejects, 1 / scale);
+        cv_ungrouped =
+            snapped ? cv_shapes : scaleContours(cv_ungrouped, 1 / scale);
+    }
+    data->stats.candidates += cv_ungrouped.size();
+    data->stats.shapes += cv_shapes.size();
 
     auto end = chrono::system_clock::now();
     data->elapsed += chrono::duration_cast<chrono::milliseconds>(end - start);
+    span.arg("elapsed_ms", (qint64)data->elapsed.count());
 
     data->rejects = toPolygonList(cv_rejects);
     data->ungrouped = toPolygonList(cv_ungrouped);
     data->shapes = toPolygonList(cv_shapes);
 
+    // the yield of the adaptive threshold passes goes into the trace
+    if (!data->yields.isEmpty()) {
+        QJsonArray passes;
+        for (auto &yield : data->yields)
+            passes.append(QJsonObject{{"channel", yield.channel},
+                                      {"threshold", yield.threshold},
+                                      {"contours", (qint64)yield.contours},
+                                      {"accepts", (qint64)yield.accepts},
+                                      {"fresh", (qint64)yield.fresh}});
+        span.arg("passes", passes);
+        span.arg("planned_passes", 3 * N);
+        data->stats.passes = data->yields.size();
+    }
+
+    meter.stop();
+
+    // encoded here rather than when a review client asks for the page
+    if (data->previewSize > 0)
+        data->encodePreview();
     emit success(data);
 }
\ No newline at end of file
@@ -3,20 +3,57 @@
 #include <QObject>
 #include <QRunnable>
 #include <QString>
+#include <QVector>
 
+#include "contours.hpp"
+
+class BandReader;
 struct ScanData;
 
+// Tunables for the detection
+struct DetectionOptions {
+    // pick threshold levels from the histogram of every channel, and stop
+    // when they no longer yield new shapes
+    bool adaptiveLevels = false;
+
+    // scans above this many pixels are detected on a reduced copy, and their
+    // shapes refined at full resolution band by band (0 to never do so)
+    qint64 streamPixels = 0;
+};
+
+// Contribution of a single threshold pass to the detection
+struct LevelYield {
+    int channel;
+    int threshold; // 0 for the Canny pass
+    size_t contours, accepts;
+    size_t fresh; // accepted shapes not overlapping earlier ones
+};
+
+// Detection stages, as used by DetectionTask (exposed for benchmarking)
+ContourList extractContours(const cv::Mat &image);
+ContourList filterShapes(const ContourList &contours, ContourList &rejects);
+ContourList minimizeShapes(const ContourList &shapes);
+ContourList extractShapesAdaptive(const cv::Mat &image, ContourList &rejects,
+                                  QVector<LevelYield> &yields);
+bool snapShapes(const cv::Mat &image, const ShapeList &prior,
+                ContourList &shapes);
+ContourList refineShapes(BandReader &bands, const ContourList &shapes,
+                         double scale);
+
 class DetectionTask : public QObject, public QRunnable {
     Q_OBJECT
 
   public:
-    DetectionTask(ScanData *);
+    DetectionTask(ScanData *,
+                  const DetectionOptions &options = DetectionOptions());
     void run();
 
   signals:
+    void started(ScanData *);
     void success(ScanData *);
     void failure(ScanData *, std::exception *);
 
   private:
     ScanData *data;
+    DetectionOptions options;
 };
@@ -0,0 +1,223 @@
+#include "duplicates.hpp"
+
+#include <QtAlgorithms>
+
+#include <opencv2/calib3d/calib3d.hpp>
+#include <opencv2/core/core.hpp>
+#include <opencv2/features2d/features2d.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+#include <opencv2/video/tracking.hpp>
+
+#include <algorithm>
+#include <vector>
+
+using namespace cv;
+using namespace std;
+
+// Bits two perceptual hashes may differ in for their pages to be duplicates,
+// and the parts hashes are split into to index them
+#define DUPLICATE_DISTANCE 6
+#define DUPLICATE_PARTS (DUPLICATE_DISTANCE + 1)
+
+// Longest side of the copies of both pages aligned, and the amount of
+// features matched between them
+#define ALIGN_SIZE 1024
+#define ALIGN_FEATURES 1000
+#define ALIGN_MIN_MATCHES 20
+
+// Share of the matches consistent with the transform, and the distance in
+// pixels of the alignment copies up to which they are, for an alignment to be
+// trusted with the review of a page
+#define ALIGN_MIN_INLIERS 0.5
+#define ALIGN_MAX_ERROR 3
+
+
+//
+// Perceptual hash
+//
+
+// View of a 32-bit image, converted to it first if in another format
+static Mat toMat(QImage &image) {
+    if (image.format() != QImage::Format_RGB32)
+        image = image.convertToFormat(QImage::Format_RGB32);
+    return Mat(image.height(), image.width(), CV_8UC4, image.bits(),
+               image.bytesPerLine());
+}
+
+quint64 perceptualHash(const QImage &image) {
+    if (image.isNull())
+        return 0;
+    QImage rgb = image;
+    Mat mat = toMat(rgb);
+
+    // reduced before anything else, so only a single pass reads the image
+    Mat reduced, gray, frequencies;
+    resize(mat, reduced, Size(32, 32), 0, 0, INTER_AREA);
+    cvtColor(reduced, gray, COLOR_BGRA2GRAY);
+    gray.convertTo(gray, CV_32F);
+    dct(gray, frequencies);
+
+    // median of the lowest frequencies, without the average brightness
+    vector<float> low;
+    for (int y = 0; y < 8; y++)
+        for (int x = 0; x < 8; x++)
+            if (x != 0 || y != 0)
+                low.push_back(frequencies.at<float>(y, x));
+    nth_element(low.begin(), low.begin() + low.size() / 2, low.end());
+    float median = low[low.size() / 2];
+
+    quint64 phash = 0;
+    for (int y = 0; y < 8; y++)
+        for (int x = 0; x < 8; x++)
+            if (frequencies.at<float>(y, x) > median)
+                phash |= (quint64)1 << (y * 8 + x);
+    return phash;
+}
+
+
+//
+// DuplicateIndex
+//
+
+// Key of a part of a perceptual hash: its bits, tagged with its number
+static quint64 partKey(quint64 phash, int part) {
+    int start = part * 64 / DUPLICATE_PARTS;
+    int end = (part + 1) * 64 / DUPLICATE_PARTS;
+    quint64 bits = (phash >> start) & (((quint64)1 << (end - start)) - 1);
+    return (quint64)part << 56 | bits;
+}
+
+void DuplicateIndex::insert(const ReviewedPage &page) {
+    auto old = pages.find(page.file);
+    if (old != pages.end()) {
+        for (int part = 0; part < DUPLICATE_PARTS; part++)
+            parts.remove(partKey(old->phash, part), page.file);
+        pages.erase(old);
+    }
+    if (page.phash == 0)
+        return;
+
+    pages.insert(page.file, page);
+    for (int part = 0; part < DUPLICATE_PARTS; part++)
+        parts.insert(partKey(page.phash, part), page.file);
+}
+
+void DuplicateIndex::clear() {
+    pages.clear();
+    parts.clear();
+}
+
+const ReviewedPage *DuplicateIndex::find(const QString &file,
+                                         quint64 phash) const {
+    if (phash == 0)
+        return nullptr;
+
+    const ReviewedPage *closest = nullptr;
+    int closest_distance = DUPLICATE_DISTANCE + 1;
+    for (int part = 0; part < DUPLICATE_PARTS; part++) {
+        auto range = parts.equal_range(partKey(phash, part));
+        for (auto it = range.first; it != range.second; ++it) {
+            auto page = pages.find(*it);
+            if (page == pages.end() || page->file == file ||
+                page->shapes.isEmpty())
+                continue;
+            int distance = qPopulationCount(page->phash ^ phash);
+            if (distance < closest_distance) {
+                closest = &*page;
+                closest_distance = distance;
+            }
+        }
+    }
+    return closest;
+}
+
+
+//
+// Alignment
+//
+
+// Greyscale copy of an image at ALIGN_SIZE along its longest side, along with
+// the factor it was reduced by
+static Mat alignmentCopy(const QImage &image, double &factor) {
+    QImage rgb = image;
+    Mat mat = toMat(rgb);
+    factor = min(1., (double)ALIGN_SIZE / max(mat.cols, mat.rows));
+
+    Mat reduced, gray;
+    resize(mat, reduced, Size(max<int>(1, round(mat.cols * factor)),
+                              max<int>(1, round(mat.rows * factor))),
+           0, 0, INTER_AREA);
+    cvtColor(reduced, gray, COLOR_BGRA2GRAY);
+    return gray;
+}
+
+bool alignShapes(const QImage &page, double pageScale, const QImage &rescan,
+                 double rescanScale, const QList<QPolygon> &shapes,
+                 QList<QPolygon> &aligned, bool &strong) {
+    double page_factor, rescan_factor;
+    Mat page_gray = alignmentCopy(page, page_factor);
+    Mat rescan_gray = alignmentCopy(rescan, rescan_factor);
+
+    // features matched both ways, leaving outliers to the estimation
+    Ptr<ORB> orb = ORB::create(ALIGN_FEATURES);
+    vector<KeyPoint> page_keys, rescan_keys;
+    Mat page_descriptors, rescan_descriptors;
+    orb->detectAndCompute(page_gray, noArray(), page_keys, page_descriptors);
+    orb->detectAndCompute(rescan_gray, noArray(), rescan_keys,
+                          rescan_descriptors);
+    if (page_descriptors.empty() || rescan_descriptors.empty())
+        return false;
+
+    BFMatcher matcher(NORM_HAMMING, /*crossCheck=*/true);
+    vector<DMatch> matches;
+    matcher.match(page_descriptors, rescan_descriptors, matches);
+    if (matches.size() < ALIGN_MIN_MATCHES)
+        return false;
+    vector<Point2f> page_points, rescan_points;
+    for (auto &match : matches) {
+        page_points.push_back(page_keys[match.queryIdx].pt);
+        rescan_points.push_back(rescan_keys[match.trainIdx].pt);
+    }
+    vector<uchar> inliers;
+#if CV_VERSION_MAJOR > 3 || (CV_VERSION_MAJOR == 3 && CV_VERSION_MINOR >= 2)
+    Mat transform = estimateAffinePartial2D(page_points, rescan_points, inliers,
+                                            RANSAC, ALIGN_MAX_ERROR);
+#else
+    Mat transform = estimateRigidTransform(page_points, rescan_points,
+                                           /*fullAffine=*/false);
+    if (!transform.empty()) {
+        vector<Point2f> moved;
+        cv::transform(page_points, moved, transform);
+        for (size_t i = 0; i < moved.size(); i++)
+            inliers.push_back(norm(moved[i] - rescan_points[i]) <=
+                              ALIGN_MAX_ERROR);
+    }
+#endif
+    if (transform.empty())
+        return false;
+    int consistent = countNonZero(inliers);
+    strong = consistent >= ALIGN_MIN_MATCHES &&
+             consistent >= ALIGN_MIN_INLIERS * matches.size();
+
+    // from the page at full resolution through both copies to the rescan at
+    // full resolution
+    double to_copy = pageScale * page_factor;
+    double from_copy = 1 / (rescanScale * rescan_factor);
+    aligned.clear();
+    for (auto &shape : shapes) {
+        QPolygon moved;
+        for (auto &point : shape) {
+            double x = point.x() * to_copy, y = point.y() * to_copy;
+            moved << QPoint(qRound((transform.at<double>(0, 0) * x +
+                                    transform.at<double>(0, 1) * y +
+                                    transform.at<double>(0, 2)) *
+                                   from_copy),
+                            qRound((transform.at<double>(1, 0) * x +
+                                    transform.at<double>(1, 1) * y +
+                                    transform.at<double>(1, 2)) *
+                                   from_copy));
+        }
+        aligned << moved;
+    }
+    return true;
+}
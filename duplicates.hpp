@@ -0,0 +1,51 @@
+#pragma once
+
+#include <QByteArray>
+#include <QHash>
+#include <QImage>
+#include <QList>
+#include <QMultiHash>
+#include <QPolygon>
+#include <QString>
+
+// Reviewed page, which rescans (under another name, or with another exposure)
+// are recognized as duplicates of by their perceptual hash
+struct ReviewedPage {
+    QString file;
+    QByteArray hash; // of the file
+    quint64 phash;
+    QList<QPolygon> shapes;
+};
+
+// Perceptual hash of an image: the signs of the 8x8 lowest frequencies of its
+// DCT at 32x32 pixels, against their median. Exposure, scale and compression
+// hardly change it.
+quint64 perceptualHash(const QImage &image);
+
+// Reviewed pages by file, indexed by parts of their perceptual hash: the hash
+// is split into one more part than bits two duplicates may differ in, so that
+// a duplicate shares at least one part with the page exactly, and only pages
+// sharing a part are compared.
+class DuplicateIndex {
+  public:
+    // Add a page, replacing an earlier version of the same file
+    void insert(const ReviewedPage &page);
+    void clear();
+
+    // Closest page to an image by its perceptual hash, as long as it is close
+    // enough to be a rescan of it, or nullptr
+    const ReviewedPage *find(const QString &file, quint64 phash) const;
+
+  private:
+    QHash<QString, ReviewedPage> pages;
+    QMultiHash<quint64, QString> parts;
+};
+
+// Move the shapes of a page onto a rescan of it, through the similarity
+// transform (rotation, uniform scale and translation) between both images,
+// returning false if they can't be aligned. Both images may be reduced copies
+// at a scale of their own, while the shapes are at full resolution. `strong`
+// tells whether most matched features agree with the transform.
+bool alignShapes(const QImage &page, double pageScale, const QImage &rescan,
+                 double rescanScale, const QList<QPolygon> &shapes,
+                 QList<QPolygon> &aligned, bool &strong);
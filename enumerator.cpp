@@ -0,0 +1,188 @@
+#include "enumerator.hpp"
+
+#include <QDir>
+#include <QFileInfo>
+#include <QRunnable>
+#include <QSet>
+
+#if defined(Q_OS_UNIX)
+#include <dirent.h>
+#include <sys/stat.h>
+#endif
+
+#include "archive.hpp"
+#include "tiff.hpp"
+#include "trace.hpp"
+
+// Directories read at once; enumeration is bound by file system latency
+// rather than CPU, especially on network mounts
+#define ENUMERATION_THREADS 8
+
+bool isScanFile(const QString &name) {
+    static const QStringList extensions = {"jpg", "png", "tif", "tiff"};
+    for (auto extension : extensions)
+        if (name.endsWith("." + extension, Qt::CaseInsensitive))
+            return true;
+    return false;
+}
+
+// Name of the .dat file holding the results of a scan (see getResultPath)
+static QString resultName(const QString &path) {
+    return scanBaseName(path) + ".dat";
+}
+
+
+//
+// Directory listing
+//
+
+struct Listing {
+    QStringList files, dirs;
+};
+
+// Directory inside an archive
+static bool listArchive(const QString &path, Listing &listing) {
+    QString archive_path, entry;
+    if (!splitArchivePath(path, archive_path, entry))
+        return false;
+    auto archive = Archive::open(archive_path);
+    if (archive)
+        archive->list(entry, listing.files, listing.dirs);
+    return true;
+}
+
+#if defined(Q_OS_UNIX)
+// Read a directory with readdir, only falling back to a stat for entries of
+// unknown type (some file systems don't report them) or symlinks. Like
+// QDirIterator, hidden entries are skipped and symlinked directories are not
+// descended into.
+static Listing list(const QString &path) {
+    Listing listing;
+    if (listArchive(path, listing))
+        return listing;
+    QByteArray native = QFile::encodeName(path);
+    DIR *dir = opendir(native.constData());
+    if (dir == nullptr)
+        return listing;
+
+    while (auto entry = readdir(dir)) {
+        if (entry->d_name[0] == '.')
+            continue;
+
+        unsigned char type = entry->d_type;
+        if (type == DT_UNKNOWN || type == DT_LNK) {
+            struct stat st;
+            if (fstatat(dirfd(dir), entry->d_name, &st, 0) != 0)
+                continue;
+            if (S_ISREG(st.st_mode))
+                type = DT_REG;
+            else if (S_ISDIR(st.st_mode) && entry->d_type == DT_UNKNOWN)
+                type = DT_DIR;
+        }
+
+        QString name = QFile::decodeName(entry->d_name);
+        if (type == DT_REG)
+            listing.files << name;
+        else if (type == DT_DIR)
+            listing.dirs << name;
+    }
+
+    closedir(dir);
+    return listing;
+}
+#else
+static Listing list(const QString &path) {
+    Listing listing;
+    if (listArchive(path, listing))
+        return listing;
+    QDir dir(path);
+    listing.files = dir.entryList(QDir::Files);
+    listing.dirs = dir.entryList(QDir::Dirs | QDir::NoDotAndDotDot |
+                                 QDir::NoSymLinks);
+    return listing;
+}
+#endif
+
+
+void listScans(const QString &path, QStringList &scans, QList<bool> &listed,
+               QStringList &subdirs) {
+    Listing listing = list(path);
+    QDir dir(path);
+
+    for (auto name : listing.dirs)
+        subdirs << dir.filePath(name);
+
+    // results of scans in archives are kept next to the archive
+    QString results_path = sidecarPath(path);
+    QSet<QString> files = QSet<QString>::fromList(
+        results_path == path ? listing.files : list(results_path).files);
+
+    // archives are read as directories, though not those inside archives
+    listing.files.sort();
+    for (auto name : listing.files) {
+        if (isArchiveFile(name) && results_path == path) {
+            subdirs << dir.filePath(name);
+            continue;
+        }
+        if (!isScanFile(name))
+            continue;
+        for (auto scan : scanPages(dir.filePath(name))) {
+            scans << scan;
+            listed << files.contains(resultName(scan));
+        }
+    }
+}
+
+
+//
+// Enumerator
+//
+
+class DirectoryTask : public QRunnable {
+  public:
+    DirectoryTask(Enumerator *enumerator, const QString &path)
+        : enumerator(enumerator), path(path) {}
+
+    void run() {
+        if (!enumerator->stopping) {
+            TraceSpan span("enumerate", path);
+            QStringList scans, subdirs;
+            QList<bool> listed;
+            listScans(path, scans, listed, subdirs);
+
+            // descend first, so subdirectories are read in parallel
+            for (auto subdir : subdirs)
+                enumerator->enter(subdir);
+
+            emit enumerator->found(path, scans, listed);
+        }
+        enumerator->leave();
+    }
+
+  private:
+    Enumerator *enumerator;
+    QString path;
+};
+
+Enumerator::Enumerator(QObject *parent)
+    : QObject(parent), pending(0), stopping(false) {
+    qRegisterMetaType<QList<bool>>("QList<bool>");
+    pool.setMaxThreadCount(ENUMERATION_THREADS);
+}
+
+Enumerator::~Enumerator() {
+    stopping = true;
+    pool.waitForDone();
+}
+
+void Enumerator::start(const QString &root) { enter(root); }
+
+void Enumerator::enter(const QString &dir) {
+    pending++;
+    pool.start(new DirectoryTask(this, dir));
+}
+
+void Enumerator::leave() {
+    if (--pending == 0)
+        emit finished();
+}
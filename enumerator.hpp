@@ -0,0 +1,44 @@
+#pragma once
+
+#include <QObject>
+#include <QString>
+#include <QStringList>
+#include <QThreadPool>
+
+#include <atomic>
+
+// Whether a file name looks like a scan we can process
+bool isScanFile(const QString &name);
+
+// Read a single directory: its scans, in order, whether their .dat file is in
+// the same directory, and its subdirectories
+void listScans(const QString &dir, QStringList &scans, QList<bool> &listed,
+               QStringList &subdirs);
+
+// Lists all scans below a directory in the background, in parallel per
+// subdirectory. Every directory is read once, without a stat per file where
+// the file system reports entry types, and its scans are reported as soon as
+// it has been read.
+class Enumerator : public QObject {
+    Q_OBJECT
+
+  public:
+    Enumerator(QObject *parent = nullptr);
+    ~Enumerator();
+
+    void start(const QString &root);
+
+  signals:
+    // Scans of a single directory (see listScans), for every directory read
+    void found(QString dir, QStringList scans, QList<bool> listed);
+    void finished();
+
+  private:
+    friend class DirectoryTask;
+    void enter(const QString &dir);
+    void leave();
+
+    QThreadPool pool;
+    std::atomic<int> pending;
+    std::atomic<bool> stopping;
+};
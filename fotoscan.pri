@@ -0,0 +1,53 @@
+QT += widgets sql network
+
+INCLUDEPATH += $$PWD
+
+HEADERS      += $$PWD/scanner.hpp \
+                $$PWD/detection.hpp \
+                $$PWD/duplicates.hpp \
+                $$PWD/bands.hpp \
+                $$PWD/results.hpp \
+                $$PWD/enumerator.hpp \
+                $$PWD/watcher.hpp \
+                $$PWD/archive.hpp \
+                $$PWD/output.hpp \
+                $$PWD/leases.hpp \
+                $$PWD/server.hpp \
+                $$PWD/postprocessing.hpp \
+                $$PWD/jpeg.hpp \
+                $$PWD/png.hpp \
+                $$PWD/tiff.hpp \
+                $$PWD/clip.hpp \
+                $$PWD/contours.hpp \
+                $$PWD/trace.hpp \
+                $$PWD/metrics.hpp \
+                $$PWD/stats.hpp \
+                $$PWD/viewer.hpp \
+                $$PWD/graphicsview.hpp
+SOURCES      += $$PWD/scanner.cpp \
+                $$PWD/detection.cpp \
+                $$PWD/duplicates.cpp \
+                $$PWD/bands.cpp \
+                $$PWD/results.cpp \
+                $$PWD/enumerator.cpp \
+                $$PWD/watcher.cpp \
+                $$PWD/archive.cpp \
+                $$PWD/output.cpp \
+                $$PWD/leases.cpp \
+                $$PWD/server.cpp \
+                $$PWD/postprocessing.cpp \
+                $$PWD/jpeg.cpp \
+                $$PWD/png.cpp \
+                $$PWD/tiff.cpp \
+                $$PWD/clip.cpp \
+                $$PWD/trace.cpp \
+                $$PWD/metrics.cpp \
+                $$PWD/stats.cpp \
+                $$PWD/viewer.cpp \
+                $$PWD/graphicsview.cpp
+
+QMAKE_CXXFLAGS += -fopenmp
+LIBS += -fopenmp -ljpeg -lpng -lz
+
+CONFIG += link_pkgconfig
+PKGCONFIG += opencv
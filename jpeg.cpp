@@ -0,0 +1,518 @@
+#include "jpeg.hpp"
+
+#include <QFile>
+#include <QColor>
+
+#include <csetjmp>
+#include <cstdio>
+#include <cstdlib>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <jpeglib.h>
+
+
+//
+// Error handling
+//
+
+// libjpeg's default error handler exits the process, so errors jump back into
+// the calling function instead
+struct JpegError {
+    jpeg_error_mgr mgr;
+    jmp_buf jump;
+    char message[JMSG_LENGTH_MAX];
+};
+
+static void onJpegError(j_common_ptr cinfo) {
+    auto error = (JpegError *)cinfo->err;
+    error->mgr.format_message(cinfo, error->message);
+    longjmp(error->jump, 1);
+}
+
+static jpeg_error_mgr *initError(JpegError &error) {
+    jpeg_std_error(&error.mgr);
+    error.mgr.error_exit = onJpegError;
+    error.message[0] = '\0';
+    return &error.mgr;
+}
+
+
+//
+// Header
+//
+
+QSize jpegMcuSize(const QString &file) {
+    FILE *fp = fopen(QFile::encodeName(file).constData(), "rb");
+    if (fp == nullptr)
+        return QSize();
+
+    jpeg_decompress_struct cinfo;
+    JpegError error;
+    cinfo.err = initError(error);
+    jpeg_create_decompress(&cinfo);
+    if (setjmp(error.jump)) {
+        jpeg_destroy_decompress(&cinfo);
+        fclose(fp);
+        return QSize();
+    }
+
+    // only reads up to the first scan
+    jpeg_stdio_src(&cinfo, fp);
+    jpeg_read_header(&cinfo, TRUE);
+    QSize mcu(cinfo.max_h_samp_factor * DCTSIZE,
+              cinfo.max_v_samp_factor * DCTSIZE);
+
+    jpeg_destroy_decompress(&cinfo);
+    fclose(fp);
+    return mcu;
+}
+
+// Luminance quantization table of the JPEG standard (Annex K), which the IJG
+// quality scales, in natural order
+static const int standardLuminance[DCTSIZE2] = {
+    16, 11, 10, 16, 24,  40,  51,  61,  12, 12, 14, 19, 26,  58,  60,  55,
+    14, 13, 16, 24, 40,  57,  69,  56,  14, 17, 22, 29, 51,  87,  80,  62,
+    18, 22, 37, 56, 68,  109, 103, 77,  24, 35, 55, 64, 81,  104, 113, 92,
+    49, 64, 78, 87, 103, 121, 120, 101, 72, 92, 95, 98, 112, 100, 103, 99};
+
+int jpegQuality(const QString &file) {
+    FILE *fp = fopen(QFile::encodeName(file).constData(), "rb");
+    if (fp == nullptr)
+        return 0;
+
+    jpeg_decompress_struct cinfo;
+    JpegError error;
+    cinfo.err = initError(error);
+    jpeg_create_decompress(&cinfo);
+    if (setjmp(error.jump)) {
+        jpeg_destroy_decompress(&cinfo);
+        fclose(fp);
+        return 0;
+    }
+
+    jpeg_stdio_src(&cinfo, fp);
+    jpeg_read_header(&cinfo, TRUE);
+
+    // invert the scaling of jpeg_set_quality, on average over the table
+    int quality = 0;
+    if (auto table = cinfo.quant_tbl_ptrs[0]) {
+        double sum = 0, standard = 0;
+        for (int i = 0; i < DCTSIZE2; i++) {
+            sum += table->quantval[i];
+            standard += standardLuminance[i];
+        }
+        double scale = 100 * sum / standard;
+        quality = scale <= 100 ? qRound((200 - scale) / 2)
+                               : qRound(5000 / scale);
+        quality = qBound(1, quality, 100);
+    }
+
+    jpeg_destroy_decompress(&cinfo);
+    fclose(fp);
+    return quality;
+}
+
+
+//
+// Lossless transformation
+//
+
+// Rotate the coefficients of a single block. Rotating by a quarter turn is a
+// transposition followed by a mirroring, which negates the odd frequencies
+// along the mirrored axis.
+static void rotateBlock(const JCOEF *in, JCOEF *out, int turns) {
+    for (int i = 0; i < DCTSIZE; i++) {
+        for (int j = 0; j < DCTSIZE; j++) {
+            JCOEF coef = in[i * DCTSIZE + j];
+            switch (turns) {
+            case 0:
+                out[i * DCTSIZE + j] = coef;
+                break;
+            case 1:
+                out[j * DCTSIZE + i] = i % 2 ? -coef : coef;
+                break;
+            case 2:
+                out[i * DCTSIZE + j] = (i + j) % 2 ? -coef : coef;
+                break;
+            case 3:
+                out[j * DCTSIZE + i] = j % 2 ? -coef : coef;
+                break;
+            }
+        }
+    }
+}
+
+// Swap the horizontal and vertical parameters of an image about to be written
+// transposed
+static void transposeParameters(jpeg_compress_struct *cinfo) {
+    for (int c = 0; c < cinfo->num_components; c++) {
+        auto comp = cinfo->comp_info + c;
+        std::swap(comp->h_samp_factor, comp->v_samp_factor);
+    }
+
+    for (int t = 0; t < NUM_QUANT_TBLS; t++) {
+        auto table = cinfo->quant_tbl_ptrs[t];
+        if (table == nullptr)
+            continue;
+        for (int i = 0; i < DCTSIZE; i++)
+            for (int j = 0; j < i; j++)
+                std::swap(table->quantval[i * DCTSIZE + j],
+                          table->quantval[j * DCTSIZE + i]);
+    }
+}
+
+// Where a block of the output comes from, within the `width` by `height`
+// blocks of the cropped input
+static void sourceBlock(int turns, int width, int height, int x, int y,
+                        int &src_x, int &src_y) {
+    switch (turns) {
+    case 0:
+        src_x = x, src_y = y;
+        break;
+    case 1:
+        src_x = y, src_y = height - 1 - x;
+        break;
+    case 2:
+        src_x = width - 1 - x, src_y = height - 1 - y;
+        break;
+    case 3:
+        src_x = width - 1 - y, src_y = x;
+        break;
+    }
+}
+
+// Region cut out of a scan, with the coefficient arrays it is written from
+struct JpegCrop {
+    QRect rect;
+    int turns = 0;
+    jvirt_barray_ptr *coefs = nullptr; // null for regions that can't be cut
+};
+
+// Write the coefficients of a crop as a new JPEG file, failing on its own
+static QByteArray writeCrop(jpeg_decompress_struct *src, const JpegCrop &crop,
+                            const QString &file) {
+    jpeg_compress_struct dst;
+    JpegError error;
+    dst.err = initError(error);
+    jpeg_create_compress(&dst);
+
+    unsigned char *buffer = nullptr;
+    unsigned long size = 0;
+    if (setjmp(error.jump)) {
+        qWarning("Could not transform %s: %s", qPrintable(file),
+                 error.message);
+        jpeg_destroy_compress(&dst);
+        free(buffer);
+        return QByteArray();
+    }
+
+    const bool transposed = crop.turns % 2;
+    jpeg_copy_critical_parameters(src, &dst);
+    dst.image_width = transposed ? crop.rect.height() : crop.rect.width();
+    dst.image_height = transposed ? crop.rect.width() : crop.rect.height();
+    if (transposed)
+        transposeParameters(&dst);
+
+    jpeg_mem_dest(&dst, &buffer, &size);
+    jpeg_write_coefficients(&dst, crop.coefs);
+    jpeg_finish_compress(&dst);
+    QByteArray result((const char *)buffer, size);
+
+    jpeg_destroy_compress(&dst);
+    free(buffer);
+    return result;
+}
+
+QVector<QByteArray> cropJpeg(const QString &file, const QVector<QRect> &rects,
+                             const QVector<int> &turns) {
+    QVector<QByteArray> results(rects.size());
+    QVector<JpegCrop> crops(rects.size());
+
+    FILE *fp = fopen(QFile::encodeName(file).constData(), "rb");
+    if (fp == nullptr)
+        return results;
+
+    jpeg_decompress_struct src;
+    JpegError error;
+    src.err = initError(error);
+    jpeg_create_decompress(&src);
+    if (setjmp(error.jump)) {
+        qWarning("Could not transform %s: %s", qPrintable(file),
+                 error.message);
+        jpeg_destroy_decompress(&src);
+        fclose(fp);
+        return QVector<QByteArray>(rects.size());
+    }
+
+    jpeg_stdio_src(&src, fp);
+    jpeg_read_header(&src, TRUE);
+
+    // the output arrays of all crops have to be requested before the input is
+    // read, so that it is read only once
+    const int mcu_width = src.max_h_samp_factor * DCTSIZE;
+    const int mcu_height = src.max_v_samp_factor * DCTSIZE;
+    bool any = false;
+    for (int i = 0; i < rects.size(); i++) {
+        JpegCrop &crop = crops[i];
+        crop.turns = (turns[i] % 4 + 4) % 4;
+
+        // trim the edges that end up at the top or left, as partial MCUs are
+        // only allowed at the bottom and right of an image
+        QRect rect = rects[i] & QRect(0, 0, src.image_width, src.image_height);
+        if (crop.turns == 2 || crop.turns == 3)
+            rect.setWidth(rect.width() / mcu_width * mcu_width);
+        if (crop.turns == 1 || crop.turns == 2)
+            rect.setHeight(rect.height() / mcu_height * mcu_height);
+        if (rect.isEmpty() || rect.x() % mcu_width || rect.y() % mcu_height)
+            continue;
+        crop.rect = rect;
+
+        const int mcus_x = (rect.width() + mcu_width - 1) / mcu_width;
+        const int mcus_y = (rect.height() + mcu_height - 1) / mcu_height;
+        const bool transposed = crop.turns % 2;
+        crop.coefs = (jvirt_barray_ptr *)src.mem->alloc_small(
+            (j_common_ptr)&src, JPOOL_IMAGE,
+            sizeof(jvirt_barray_ptr) * src.num_components);
+        for (int c = 0; c < src.num_components; c++) {
+            auto comp = src.comp_info + c;
+            int width = mcus_x * comp->h_samp_factor;
+            int height = mcus_y * comp->v_samp_factor;
+            crop.coefs[c] = src.mem->request_virt_barray(
+                (j_common_ptr)&src, JPOOL_IMAGE, FALSE,
+                transposed ? height : width, transposed ? width : height,
+                transposed ? comp->h_samp_factor : comp->v_samp_factor);
+        }
+        any = true;
+    }
+    if (!any) {
+        jpeg_destroy_decompress(&src);
+        fclose(fp);
+        return results;
+    }
+
+    jvirt_barray_ptr *src_coefs = jpeg_read_coefficients(&src);
+
+    for (int i = 0; i < crops.size(); i++) {
+        const JpegCrop &crop = crops[i];
+        if (crop.coefs == nullptr)
+            continue;
+
+        const int mcus_x = (crop.rect.width() + mcu_width - 1) / mcu_width;
+        const int mcus_y = (crop.rect.height() + mcu_height - 1) / mcu_height;
+        const bool transposed = crop.turns % 2;
+        for (int c = 0; c < src.num_components; c++) {
+            auto comp = src.comp_info + c;
+            int offset_x = crop.rect.x() / mcu_width * comp->h_samp_factor;
+            int offset_y = crop.rect.y() / mcu_height * comp->v_samp_factor;
+            int width = mcus_x * comp->h_samp_factor;
+            int height = mcus_y * comp->v_samp_factor;
+
+            for (int y = 0; y < (transposed ? width : height); y++) {
+                JBLOCKROW out = src.mem->access_virt_barray(
+                    (j_common_ptr)&src, crop.coefs[c], y, 1, TRUE)[0];
+                for (int x = 0; x < (transposed ? height : width); x++) {
+                    int src_x, src_y;
+                    sourceBlock(crop.turns, width, height, x, y, src_x, src_y);
+                    JBLOCKROW in = src.mem->access_virt_barray(
+                        (j_common_ptr)&src, src_coefs[c], offset_y + src_y, 1,
+                        FALSE)[0];
+                    rotateBlock(in[offset_x + src_x], out[x], crop.turns);
+                }
+            }
+        }
+
+        results[i] = writeCrop(&src, crop, file);
+    }
+
+    jpeg_finish_decompress(&src);
+    jpeg_destroy_decompress(&src);
+    fclose(fp);
+    return results;
+}
+
+QByteArray cropJpeg(const QString &file, QRect rect, int turns) {
+    return cropJpeg(file, QVector<QRect>() << rect, QVector<int>() << turns)
+        .first();
+}
+
+
+//
+// Encoding
+//
+
+// Compressor of a thread, reused for all its images as long as the options
+// don't change. Progressive scripts and Huffman optimization leave state
+// behind in the compressor, so it is re-created for other options.
+struct JpegEncoder {
+    jpeg_compress_struct cinfo;
+    JpegError error;
+    JpegOptions options;
+
+    JpegEncoder(const JpegOptions &options) : options(options) {
+        cinfo.err = initError(error);
+        jpeg_create_compress(&cinfo);
+    }
+    ~JpegEncoder() { jpeg_destroy_compress(&cinfo); }
+};
+
+static bool sameOptions(const JpegOptions &a, const JpegOptions &b) {
+    return a.quality == b.quality && a.subsampling == b.subsampling &&
+           a.optimize == b.optimize && a.progressive == b.progressive &&
+           a.fastDct == b.fastDct;
+}
+
+QByteArray encodeJpeg(const uchar *bits, int width, int height, int stride,
+                      const JpegOptions &options) {
+    static thread_local std::unique_ptr<JpegEncoder> encoder;
+    if (!encoder || !sameOptions(encoder->options, options))
+        encoder.reset(new JpegEncoder(options));
+    jpeg_compress_struct &cinfo = encoder->cinfo;
+
+    // start from a clean compressor, even after a failed image
+    jpeg_abort_compress(&cinfo);
+    cinfo.scan_info = nullptr;
+    cinfo.num_scans = 0;
+
+    unsigned char *buffer = nullptr;
+    unsigned long size = 0;
+    std::vector<JSAMPLE> converted;
+    if (setjmp(encoder->error.jump)) {
+        jpeg_abort_compress(&cinfo);
+        free(buffer);
+        throw new std::runtime_error(std::string("Could not encode JPEG: ") +
+                                     encoder->error.message);
+    }
+
+    jpeg_mem_dest(&cinfo, &buffer, &size);
+    cinfo.image_width = width;
+    cinfo.image_height = height;
+#ifdef JCS_EXTENSIONS
+    // read the pixels as they are
+    cinfo.input_components = 4;
+    cinfo.in_color_space =
+        Q_BYTE_ORDER == Q_LITTLE_ENDIAN ? JCS_EXT_BGRX : JCS_EXT_XRGB;
+#else
+    // converted to RGB row by row
+    cinfo.input_components = 3;
+    cinfo.in_color_space = JCS_RGB;
+    converted.resize(width * 3);
+#endif
+    jpeg_set_defaults(&cinfo);
+
+    jpeg_set_quality(&cinfo, options.quality, TRUE);
+    cinfo.comp_info[0].h_samp_factor = options.subsampling == 444 ? 1 : 2;
+    cinfo.comp_info[0].v_samp_factor = options.subsampling == 420 ? 2 : 1;
+    cinfo.optimize_coding = options.optimize;
+    if (options.progressive)
+        jpeg_simple_progression(&cinfo);
+    cinfo.dct_method = options.fastDct ? JDCT_IFAST : JDCT_ISLOW;
+
+    jpeg_start_compress(&cinfo, TRUE);
+    while (cinfo.next_scanline < cinfo.image_height) {
+        auto line = (const QRgb *)(bits + (size_t)cinfo.next_scanline * stride);
+        JSAMPROW row = (JSAMPROW)line;
+        if (!converted.empty()) {
+            for (int x = 0; x < width; x++) {
+                converted[3 * x] = qRed(line[x]);
+                converted[3 * x + 1] = qGreen(line[x]);
+                converted[3 * x + 2] = qBlue(line[x]);
+            }
+            row = converted.data();
+        }
+        jpeg_write_scanlines(&cinfo, &row, 1);
+    }
+    jpeg_finish_compress(&cinfo);
+
+    QByteArray result((const char *)buffer, size);
+    free(buffer);
+    return result;
+}
+
+
+//
+// Decoding
+//
+
+struct JpegDecoder::State {
+    jpeg_decompress_struct cinfo;
+    JpegError error;
+    FILE *fp = nullptr;
+    bool started = false;
+    std::vector<JSAMPLE> converted;
+};
+
+JpegDecoder::JpegDecoder(const QString &file, int denominator)
+    : state(new State) {
+    jpeg_decompress_struct &cinfo = state->cinfo;
+    cinfo.err = initError(state->error);
+    jpeg_create_decompress(&cinfo);
+
+    state->fp = fopen(QFile::encodeName(file).constData(), "rb");
+    if (state->fp == nullptr)
+        return;
+    if (setjmp(state->error.jump)) {
+        state->started = false;
+        return;
+    }
+
+    jpeg_stdio_src(&cinfo, state->fp);
+    jpeg_read_header(&cinfo, TRUE);
+    if (cinfo.jpeg_color_space != JCS_GRAYSCALE &&
+        cinfo.jpeg_color_space != JCS_YCbCr &&
+        cinfo.jpeg_color_space != JCS_RGB)
+        return; // CMYK and others are left to QImageReader
+
+    cinfo.scale_num = 1;
+    cinfo.scale_denom = denominator;
+#ifdef JCS_EXTENSIONS
+    // written as they are
+    cinfo.out_color_space =
+        Q_BYTE_ORDER == Q_LITTLE_ENDIAN ? JCS_EXT_BGRX : JCS_EXT_XRGB;
+#else
+    // converted from RGB row by row
+    cinfo.out_color_space = JCS_RGB;
+#endif
+    jpeg_start_decompress(&cinfo);
+    state->converted.resize(cinfo.output_width * cinfo.output_components);
+    state->started = true;
+}
+
+JpegDecoder::~JpegDecoder() {
+    jpeg_destroy_decompress(&state->cinfo);
+    if (state->fp != nullptr)
+        fclose(state->fp);
+}
+
+bool JpegDecoder::isOpen() const { return state->started; }
+
+QSize JpegDecoder::size() const {
+    if (!state->started)
+        return QSize();
+    return QSize(state->cinfo.output_width, state->cinfo.output_height);
+}
+
+bool JpegDecoder::read(uchar *bits, int stride, int rows) {
+    jpeg_decompress_struct &cinfo = state->cinfo;
+    if (!state->started ||
+        cinfo.output_scanline + rows > cinfo.output_height)
+        return false;
+    if (setjmp(state->error.jump)) {
+        state->started = false;
+        return false;
+    }
+
+    for (int y = 0; y < rows; y++) {
+        auto line = (QRgb *)(bits + (size_t)y * stride);
+        JSAMPROW row = cinfo.output_components == 4
+                           ? (JSAMPROW)line
+                           : state->converted.data();
+        jpeg_read_scanlines(&cinfo, &row, 1);
+        if (cinfo.output_components == 3)
+            for (JDIMENSION x = 0; x < cinfo.output_width; x++)
+                line[x] = qRgb(row[3 * x], row[3 * x + 1], row[3 * x + 2]);
+    }
+    return true;
+}
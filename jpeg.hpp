@@ -0,0 +1,67 @@
+#pragma once
+
+#include <QByteArray>
+#include <QRect>
+#include <QSize>
+#include <QString>
+#include <QVector>
+
+#include <memory>
+
+// Settings of the JPEG encoder
+struct JpegOptions {
+    int quality = 75;         // 1-100, or 0 to match the source
+    int subsampling = 420;    // chroma subsampling: 444, 422 or 420
+    bool optimize = false;    // compute optimal Huffman tables
+    bool progressive = false;
+    bool fastDct = false;     // faster, slightly less accurate DCT
+};
+
+// Size of the MCUs (minimum coded units) of a JPEG file, in pixels, or an
+// invalid size if the file cannot be read
+QSize jpegMcuSize(const QString &file);
+
+// Cut a region out of a JPEG file and rotate it by a number of clockwise
+// quarter turns, losslessly: the DCT coefficients are moved around without
+// being decoded. The region must start on the MCU grid; edges that rotation
+// moves to the top or left are trimmed to whole MCUs. Returns the new JPEG
+// file, or an empty array on failure.
+QByteArray cropJpeg(const QString &file, QRect rect, int turns);
+
+// Cut several regions out of a JPEG file as above, each rotated by its number
+// of `turns`, reading the file only once. Returns a new JPEG file per region,
+// empty for those that failed.
+QVector<QByteArray> cropJpeg(const QString &file, const QVector<QRect> &rects,
+                             const QVector<int> &turns);
+
+// Quality of a JPEG file, estimated from its luminance quantization table on
+// the IJG scale, or 0 if the file cannot be read
+int jpegQuality(const QString &file);
+
+// Encode an image of 32-bit pixels (as in QImage::Format_RGB32) as JPEG,
+// throwing on failure. The compressor is reused by later calls on the same
+// thread with the same options.
+QByteArray encodeJpeg(const uchar *bits, int width, int height, int stride,
+                      const JpegOptions &options);
+
+// Decoder reading a JPEG file row by row, from top to bottom, into 32-bit
+// pixels (as in QImage::Format_RGB32), so a large scan can be processed in
+// bands without being decoded as a whole. With a `denominator` of 2, 4 or 8,
+// libjpeg decodes the file at that reduced scale, at a fraction of the cost.
+class JpegDecoder {
+  public:
+    JpegDecoder(const QString &file, int denominator = 1);
+    ~JpegDecoder();
+
+    bool isOpen() const;
+
+    // Size of the decoded image
+    QSize size() const;
+
+    // Decode the next rows, returning false on failure
+    bool read(uchar *bits, int stride, int rows);
+
+  private:
+    struct State;
+    std::unique_ptr<State> state;
+};
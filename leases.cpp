@@ -0,0 +1,132 @@
+#include "leases.hpp"
+
+#include <QCoreApplication>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <utime.h>
+
+#include "archive.hpp"
+#include "tiff.hpp"
+
+// Interval at which held leases are refreshed, in milliseconds
+#define LEASE_HEARTBEAT 10000
+
+// Age after which a lease is considered abandoned, in seconds. This is well
+// above the heartbeat, to allow for some clock skew between machines.
+#define LEASE_TIMEOUT 120
+
+QString getLeasePath(QString image) {
+    QFileInfo info(sidecarPath(image));
+    return QDir(info.absolutePath())
+        .absoluteFilePath(QString("%1.lease").arg(scanBaseName(image)));
+}
+
+// Identification of this process, written into its lease files
+static QString processId() {
+    char host[256] = "";
+    gethostname(host, sizeof(host) - 1);
+    return QString("%1:%2").arg(host).arg(QCoreApplication::applicationPid());
+}
+
+Leases::Leases(QObject *parent)
+    : QObject(parent), owner(processId()), id(owner.toUtf8() + "\n") {
+    connect(&timer, SIGNAL(timeout()), this, SLOT(heartbeat()));
+    timer.start(LEASE_HEARTBEAT);
+}
+
+Leases::~Leases() {
+    for (auto image : held.values())
+        release(image);
+}
+
+// Create the lease file, which only succeeds for a single process
+static bool create(const QByteArray &path, const QByteArray &owner) {
+    int fd = open(path.constData(), O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if (fd < 0)
+        return false;
+    bool written = write(fd, owner.constData(), owner.size()) == owner.size();
+    close(fd);
+    if (!written)
+        unlink(path.constData());
+    return written;
+}
+
+// Owner written into a lease file, empty if it can't be read
+static QByteArray readOwner(const QByteArray &path) {
+    QFile file(QFile::decodeName(path));
+    if (!file.open(QIODevice::ReadOnly))
+        return QByteArray();
+    return file.readAll();
+}
+
+static bool stale(const QByteArray &path) {
+    struct stat st;
+    return stat(path.constData(), &st) == 0 &&
+           time(nullptr) - st.st_mtime > LEASE_TIMEOUT;
+}
+
+// Take over an abandoned lease by moving it out of the way, which only
+// succeeds for a single process, then creating a fresh one like any other. A
+// lease moved just after another process replaced it is fresh, and put back.
+bool Leases::takeOver(const QString &path) {
+    QByteArray native = QFile::encodeName(path);
+    if (!stale(native))
+        return false;
+
+    QByteArray moved = native + "." + owner.toUtf8();
+    if (rename(native.constData(), moved.constData()) != 0)
+        return false;
+    if (!stale(moved)) {
+        if (link(moved.constData(), native.constData()) != 0)
+            qWarning("Could not restore lease %s", native.constData());
+        unlink(moved.constData());
+        return false;
+    }
+    unlink(moved.constData());
+    if (!create(native, id))
+        return false;
+
+    qWarning("Took over abandoned lease %s", native.constData());
+    return true;
+}
+
+bool Leases::acquire(const QString &image) {
+    QString path = getLeasePath(image);
+    QByteArray native = QFile::encodeName(path);
+    if (sidecarPath(image) != image)
+        QFileInfo(path).absoluteDir().mkpath(".");
+
+    if (!create(native, id) && !takeOver(path))
+        return false;
+    held << image;
+    return true;
+}
+
+// Leases taken over by another process are left to it
+void Leases::release(const QString &image) {
+    if (!held.remove(image))
+        return;
+    QByteArray native = QFile::encodeName(getLeasePath(image));
+    if (readOwner(native) == id)
+        unlink(native.constData());
+}
+
+void Leases::heartbeat() {
+    for (auto it = held.begin(); it != held.end();) {
+        QByteArray native = QFile::encodeName(getLeasePath(*it));
+        if (readOwner(native) != id) {
+            qWarning("Lost lease %s", native.constData());
+            it = held.erase(it);
+            continue;
+        }
+        if (utime(native.constData(), nullptr) != 0)
+            qWarning("Could not refresh lease %s", native.constData());
+        ++it;
+    }
+}
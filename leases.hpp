@@ -0,0 +1,34 @@
+#pragma once
+
+#include <QObject>
+#include <QSet>
+#include <QString>
+#include <QTimer>
+
+// Claims on scans, shared between processes (possibly on several machines)
+// through lease files next to the scans. Held leases are kept alive by
+// refreshing their modification time, and leases that haven't been refreshed
+// for a while are considered abandoned by a crashed process, and taken over.
+class Leases : public QObject {
+    Q_OBJECT
+
+  public:
+    Leases(QObject *parent = nullptr);
+    ~Leases();
+
+    bool acquire(const QString &image);
+    void release(const QString &image);
+
+  private slots:
+    void heartbeat();
+
+  private:
+    bool takeOver(const QString &path);
+
+    QString owner;
+    QByteArray id; // contents of the lease files
+    QSet<QString> held;
+    QTimer timer;
+};
+
+QString getLeasePath(QString image);
@@ -3,9 +3,20 @@
 
 #include <QMessageBox>
 
+#include <algorithm>
+#include <functional>
+
 #include "scanner.hpp"
+#include "trace.hpp"
 
 int main(int argc, char *argv[]) {
+    // workers and servers run headless
+    for (int i = 1; i < argc; i++)
+        if ((QString(argv[i]).startsWith("--worker") ||
+             QString(argv[i]).startsWith("--serve")) &&
+            qgetenv("QT_QPA_PLATFORM").isEmpty())
+            qputenv("QT_QPA_PLATFORM", "offscreen");
+
     Scanner app(argc, argv);
     QGuiApplication::setApplicationDisplayName("Foto Scanner");
     QGuiApplication::setApplicationVersion("0.1");
@@ -20,7 +31,8 @@ int main(int argc, char *argv[]) {
     QCommandLineOption outputDirectoryOption(
         QStringList() << "o"
                       << "output-directory",
-        "Write photos to <directory>.", "directory");
+        "Write photos to <directory>, or to a .tar or .zip archive.",
+        "directory");
     parser.addOption(outputDirectoryOption);
 
     QCommandLineOption correctOption(QStringList() << "c"
@@ -28,30 +40,296 @@ int main(int argc, char *argv[]) {
                                      "Correct most recent results");
     parser.addOption(correctOption);
 
+    QCommandLineOption watchOption(
+        "watch", "Keep watching the input directory for new scans.");
+    parser.addOption(watchOption);
+
+    QCommandLineOption workerOption(
+        "worker", "Run headless, performing the given <stages> (detect, "
+                  "postprocess or both, separated by a comma) for scans not "
+                  "claimed by other processes.", "stages");
+    parser.addOption(workerOption);
+
+    QCommandLineOption reviewOnlyOption(
+        "review-only", "Only review scans detected by workers.");
+    parser.addOption(reviewOnlyOption);
+
+    QCommandLineOption serveOption(
+        "serve", "Run headless as detection server on the local socket "
+                 "<name>, handing out pages to review clients.", "name");
+    parser.addOption(serveOption);
+
+    QCommandLineOption connectOption(
+        "connect", "Review pages of the detection server on the local socket "
+                   "<name>, submitting INPUT-DIRECTORY if given.", "name");
+    parser.addOption(connectOption);
+
+    QCommandLineOption indexOption(
+        "index", "Keep the results of all scans in a single index <file>, "
+                 "instead of a .dat file next to every scan.", "file");
+    parser.addOption(indexOption);
+
+    QCommandLineOption noPriorOption(
+        "no-prior", "Always perform a full detection, without trying the "
+                    "layout of the previous page first");
+    parser.addOption(noPriorOption);
+
+    QCommandLineOption noDuplicatesOption(
+        "no-duplicates", "Detect and review rescans of reviewed pages like "
+                         "any other scan, rather than taking over their "
+                         "shapes");
+    parser.addOption(noDuplicatesOption);
+
+    QCommandLineOption adaptiveOption(
+        "adaptive", "Pick threshold levels from the histogram, and stop "
+                    "detecting when they no longer yield new shapes");
+    parser.addOption(adaptiveOption);
+
+    QCommandLineOption streamOption(
+        "stream", "Detect scans above <megapixels> on a reduced copy, "
+                  "refining their shapes and extracting photos at full "
+                  "resolution band by band (except with --color-reference)",
+        "megapixels");
+    parser.addOption(streamOption);
+
+    QCommandLineOption exifOrientationOption(
+        "exif-orientation", "Record the orientation of JPEG photos as EXIF "
+                            "tag, instead of rotating them");
+    parser.addOption(exifOrientationOption);
+
+    QCommandLineOption losslessCropOption(
+        "lossless-crop", "Cut axis-aligned photos out of JPEG scans "
+                         "losslessly, without re-encoding them");
+    parser.addOption(losslessCropOption);
+
+    QCommandLineOption colorReferenceOption(
+        "color-reference", "Balance the colours of photos against a neutral "
+                           "<region> of every scan (x,y,width,height), or "
+                           "against the page background for \"auto\".",
+        "region");
+    parser.addOption(colorReferenceOption);
+
+    QCommandLineOption referenceLevelOption(
+        "reference-level", "Correct the exposure of photos to bring the "
+                           "colour reference to <level> (1-255).",
+        "level");
+    parser.addOption(referenceLevelOption);
+
+    QCommandLineOption sizesOption(
+        "sizes", "Also write every photo reduced to the given <sizes> (in "
+                 "pixels along its longest side, separated by a comma).",
+        "sizes");
+    parser.addOption(sizesOption);
+
+    QCommandLineOption qualityOption(
+        "quality", "Encode JPEG photos at <quality> (1-100), or at the "
+                   "estimated quality of their scan for \"source\".",
+        "quality", "75");
+    parser.addOption(qualityOption);
+
+    QCommandLineOption subsamplingOption(
+        "subsampling", "Chroma subsampling of JPEG photos: 444, 422 or 420.",
+        "mode", "420");
+    parser.addOption(subsamplingOption);
+
+    QCommandLineOption optimizeOption(
+        "optimize", "Compute optimal Huffman tables for JPEG photos");
+    parser.addOption(optimizeOption);
+
+    QCommandLineOption progressiveOption("progressive",
+                                         "Write progressive JPEG photos");
+    parser.addOption(progressiveOption);
+
+    QCommandLineOption fastDctOption(
+        "fast-dct", "Use a faster, less accurate DCT for JPEG photos");
+    parser.addOption(fastDctOption);
+
+    QCommandLineOption traceOption(
+        "trace", "Record a trace of all processing steps to <file>.", "file");
+    parser.addOption(traceOption);
+
+    QCommandLineOption metricsOption(
+        "metrics", "Periodically write pipeline metrics to <file>.", "file");
+    parser.addOption(metricsOption);
+
+    QCommandLineOption statsOption(
+        "stats-csv", "Append the resources used per scan to <file>.", "file");
+    parser.addOption(statsOption);
+
     parser.process(app);
 
     bool correct = parser.isSet(correctOption);
     if (correct)
         app.setMode(ProgramMode::CORRECT_RESULTS);
 
+    if (parser.isSet(workerOption)) {
+        QList<Stage> stages;
+        for (auto stage : parser.value(workerOption).split(",")) {
+            if (stage == "detect")
+                stages << Stage::Detection;
+            else if (stage == "postprocess")
+                stages << Stage::Postprocess;
+            else {
+                qCritical("Unknown stage %s", qPrintable(stage));
+                return 1;
+            }
+        }
+        app.setWorker(stages);
+    } else if (parser.isSet(reviewOnlyOption))
+        app.setReviewOnly();
+
+    if (parser.isSet(serveOption) &&
+        !app.setServer(parser.value(serveOption)))
+        return 1;
+    if (parser.isSet(connectOption) &&
+        !app.setClient(parser.value(connectOption)))
+        return 1;
+
+    // the index is read once at start-up, so can't be shared between processes
+    bool shared = parser.isSet(workerOption) || parser.isSet(reviewOnlyOption);
+    if (shared && parser.isSet(indexOption)) {
+        qCritical("An index can't be used by workers or review-only instances");
+        return 1;
+    }
+
+    if (parser.isSet(watchOption))
+        app.setWatch(true);
+
+    if (parser.isSet(noPriorOption))
+        app.setLayoutPrior(false);
+    if (parser.isSet(noDuplicatesOption))
+        app.setDuplicateDetection(false);
+
+    DetectionOptions detectionOptions;
+    detectionOptions.adaptiveLevels = parser.isSet(adaptiveOption);
+    if (parser.isSet(streamOption)) {
+        bool valid;
+        double megapixels = parser.value(streamOption).toDouble(&valid);
+        if (!valid || megapixels <= 0) {
+            qCritical("Invalid stream size %s",
+                      qPrintable(parser.value(streamOption)));
+            return 1;
+        }
+        detectionOptions.streamPixels = megapixels * 1000000;
+    }
+    app.setDetectionOptions(detectionOptions);
+
+    PostprocessOptions postprocessOptions;
+    postprocessOptions.exifOrientation = parser.isSet(exifOrientationOption);
+    postprocessOptions.losslessCrop = parser.isSet(losslessCropOption);
+    if (parser.isSet(colorReferenceOption)) {
+        postprocessOptions.colorCorrection = true;
+        QString region = parser.value(colorReferenceOption);
+        QStringList values = region.split(",");
+        bool valid = values.size() == 4;
+        for (int i = 0; valid && i < 4; i++)
+            values[i].toInt(&valid);
+        if (valid)
+            postprocessOptions.colorReference =
+                QRect(values[0].toInt(), values[1].toInt(), values[2].toInt(),
+                      values[3].toInt());
+        if (region != "auto" &&
+            (!valid || postprocessOptions.colorReference.isEmpty())) {
+            qCritical("Invalid colour reference %s", qPrintable(region));
+            return 1;
+        }
+    }
+    if (parser.isSet(referenceLevelOption)) {
+        bool valid;
+        postprocessOptions.referenceLevel =
+            parser.value(referenceLevelOption).toInt(&valid);
+        if (!valid || postprocessOptions.referenceLevel < 1 ||
+            postprocessOptions.referenceLevel > 255 ||
+            !postprocessOptions.colorCorrection) {
+            qCritical("Invalid reference level %s, or no colour reference",
+                      qPrintable(parser.value(referenceLevelOption)));
+            return 1;
+        }
+    }
+    if (parser.isSet(sizesOption)) {
+        for (auto value : parser.value(sizesOption).split(",")) {
+            bool valid;
+            int size = value.toInt(&valid);
+            if (!valid || size <= 0) {
+                qCritical("Invalid size %s", qPrintable(value));
+                return 1;
+            }
+            if (!postprocessOptions.sizes.contains(size))
+                postprocessOptions.sizes << size;
+        }
+        // every size is reduced from the next larger one
+        std::sort(postprocessOptions.sizes.begin(),
+                  postprocessOptions.sizes.end(), std::greater<int>());
+    }
+    bool valid = true;
+    QString quality = parser.value(qualityOption);
+    postprocessOptions.jpeg.quality =
+        quality == "source" ? 0 : quality.toInt(&valid);
+    if (!valid || postprocessOptions.jpeg.quality < 0 ||
+        postprocessOptions.jpeg.quality > 100) {
+        qCritical("Invalid quality %s", qPrintable(quality));
+        return 1;
+    }
+    postprocessOptions.jpeg.subsampling =
+        parser.value(subsamplingOption).toInt();
+    if (postprocessOptions.jpeg.subsampling != 444 &&
+        postprocessOptions.jpeg.subsampling != 422 &&
+        postprocessOptions.jpeg.subsampling != 420) {
+        qCritical("Invalid subsampling %s",
+                  qPrintable(parser.value(subsamplingOption)));
+        return 1;
+    }
+    postprocessOptions.jpeg.optimize = parser.isSet(optimizeOption);
+    postprocessOptions.jpeg.progressive = parser.isSet(progressiveOption);
+    postprocessOptions.jpeg.fastDct = parser.isSet(fastDctOption);
+    app.setPostprocessOptions(postprocessOptions);
+
+    if (parser.isSet(traceOption) &&
+        !Trace::start(parser.value(traceOption))) {
+        qCritical("Could not write trace to %s",
+                  qPrintable(parser.value(traceOption)));
+        return 1;
+    }
+
+    if (parser.isSet(metricsOption))
+        app.setMetricsFile(parser.value(metricsOption));
+
+    if (parser.isSet(statsOption))
+        app.setStatsFile(parser.value(statsOption));
+
+    if (parser.isSet(indexOption) &&
+        !app.setIndexFile(parser.value(indexOption)))
+        return 1;
+
     const QStringList args = parser.positionalArguments();
-    if (args.size() != 1) {
+    bool optional = parser.isSet(connectOption) && args.isEmpty();
+    if (args.size() != 1 && !optional) {
         QMessageBox::critical(nullptr, "Invalid usage",
                               QString("Try `%0 --help` for more information.")
                               .arg(QFileInfo(QCoreApplication::applicationFilePath()).fileName()));
         return 1;
     }
-    app.setInputDir(args[0]);
+    if (!optional)
+        app.setInputDir(args[0]);
     app.scan();
 
-    QString outputDir = parser.value(outputDirectoryOption);
-    if (outputDir != QString())
-        app.setOutputDir(outputDir);
+    QString output = parser.value(outputDirectoryOption);
+    if (output != QString() && !app.setOutput(output))
+        return 1;
 
     QTimer::singleShot(0, &app, SLOT(onEventLoopStarted()));
+    int status;
     try {
-        return app.exec();
+        status = app.exec();
     } catch (std::exception e) {
         qFatal(e.what());
     }
+
+    app.reportStats();
+
+    if (!Trace::finish())
+        qWarning("Could not write trace to %s",
+                 qPrintable(parser.value(traceOption)));
+
+    return status;
 }
@@ -0,0 +1,199 @@
+#include "metrics.hpp"
+
+#include <QTextStream>
+
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <limits>
+
+using namespace std;
+
+static const Stage allStages[] = {Stage::Detection, Stage::Review,
+                                  Stage::Postprocess};
+
+static const char *stageName(Stage stage) {
+    switch (stage) {
+    case Stage::Detection:
+        return "detection";
+    case Stage::Review:
+        return "review";
+    case Stage::Postprocess:
+        return "postprocess";
+    }
+    return "unknown";
+}
+
+
+//
+// Ewma
+//
+
+void Ewma::add(double sample) {
+    if (samples++ == 0)
+        average = sample;
+    else
+        average = alpha * sample + (1 - alpha) * average;
+}
+
+
+//
+// Metrics
+//
+
+Metrics::Metrics() { clock.start(); }
+
+void Metrics::setConcurrency(int threads) { this->threads = max(threads, 1); }
+
+void Metrics::started(Stage stage, const ScanData *data) {
+    (*this)[stage].active[data] = clock.elapsed();
+}
+
+void Metrics::running(Stage stage, const ScanData *data) {
+    auto &metrics = (*this)[stage];
+    auto it = metrics.active.find(data);
+    if (it != metrics.active.end())
+        it.value() = clock.elapsed();
+}
+
+void Metrics::finished(Stage stage, const ScanData *data, bool success) {
+    auto &metrics = (*this)[stage];
+    qint64 now = clock.elapsed();
+
+    auto it = metrics.active.find(data);
+    if (it == metrics.active.end())
+        return;
+    qint64 start = it.value();
+    metrics.active.erase(it);
+
+    if (!success) {
+        metrics.failed++;
+        return;
+    }
+    metrics.completed++;
+    metrics.duration.add((now - start) / 1000.);
+    if (metrics.last_completion != -1)
+        metrics.interval.add((now - metrics.last_completion) / 1000.);
+    metrics.last_completion = now;
+}
+
+void Metrics::sample(int toDetect, int toReview, int toPostprocess) {
+    (*this)[Stage::Detection].queued = toDetect;
+    (*this)[Stage::Review].queued = toReview;
+    (*this)[Stage::Postprocess].queued = toPostprocess;
+}
+
+// Every scan still has to pass through all remaining stages. Detection and
+// post-processing share the thread pool, while review runs concurrently but
+// cannot get ahead of detection, nor post-processing ahead of review.
+double Metrics::eta(Stage stage) const {
+    const auto &detection = (*this)[Stage::Detection];
+    const auto &review = (*this)[Stage::Review];
+    const auto &postprocess = (*this)[Stage::Postprocess];
+
+    int detect_remaining = detection.queued + detection.active.size();
+    int review_remaining =
+        detect_remaining + review.queued + review.active.size();
+    int postprocess_remaining =
+        review_remaining + postprocess.queued + postprocess.active.size();
+
+    // time to process some scans, or NaN if we don't know how long one takes
+    auto work = [](const StageMetrics &metrics, int scans) -> double {
+        if (scans == 0)
+            return 0;
+        if (!metrics.duration.valid())
+            return numeric_limits<double>::quiet_NaN();
+        return scans * metrics.duration.value();
+    };
+
+    double detect_work = work(detection, detect_remaining);
+    double review_work = work(review, review_remaining);
+    double postprocess_work = work(postprocess, postprocess_remaining);
+    double last_postprocess =
+        work(postprocess, postprocess_remaining > 0 ? 1 : 0);
+
+    // unknown if any stage involved hasn't completed a single scan yet
+    switch (stage) {
+    case Stage::Postprocess:
+        if (std::isnan(postprocess_work))
+            return -1;
+    // fall through
+    case Stage::Review:
+        if (std::isnan(review_work))
+            return -1;
+    // fall through
+    case Stage::Detection:
+        if (std::isnan(detect_work))
+            return -1;
+    }
+
+    double detect_eta = detect_work / threads;
+    double review_eta = max(detect_eta, review_work);
+    double postprocess_eta = max((detect_work + postprocess_work) / threads,
+                                 review_eta + last_postprocess / threads);
+
+    switch (stage) {
+    case Stage::Detection:
+        return detect_eta;
+    case Stage::Review:
+        return review_eta;
+    case Stage::Postprocess:
+        return postprocess_eta;
+    }
+    return -1;
+}
+
+QString Metrics::toPrometheus() const {
+    QString text;
+    QTextStream stream(&text);
+
+    auto metric = [&](const char *name, const char *type, const char *help,
+                      function<double(Stage)> value) {
+        stream << "# HELP " << name << " " << help << "\n";
+        stream << "# TYPE " << name << " " << type << "\n";
+        for (auto stage : allStages) {
+            double v = value(stage);
+            stream << name << "{stage=\"" << stageName(stage) << "\"} ";
+            if (std::isnan(v))
+                stream << "NaN";
+            else
+                stream << QString::number(v, 'g', 10);
+            stream << "\n";
+        }
+    };
+
+    metric("fotoscan_queued", "gauge", "Scans waiting for a stage.",
+           [&](Stage stage) { return (*this)[stage].queued; });
+    metric("fotoscan_active", "gauge", "Scans currently in a stage.",
+           [&](Stage stage) { return (*this)[stage].active.size(); });
+    metric("fotoscan_completed_total", "counter",
+           "Scans that completed a stage.",
+           [&](Stage stage) { return (*this)[stage].completed; });
+    metric("fotoscan_failed_total", "counter", "Scans that failed a stage.",
+           [&](Stage stage) { return (*this)[stage].failed; });
+    metric("fotoscan_duration_seconds", "gauge",
+           "Moving average of the time spent on a single scan.",
+           [&](Stage stage) {
+               auto &duration = (*this)[stage].duration;
+               return duration.valid() ? duration.value()
+                                       : numeric_limits<double>::quiet_NaN();
+           });
+    metric("fotoscan_throughput_per_second", "gauge",
+           "Moving average of the rate at which scans complete a stage.",
+           [&](Stage stage) {
+               auto &interval = (*this)[stage].interval;
+               return interval.valid() && interval.value() > 0
+                          ? 1 / interval.value()
+                          : numeric_limits<double>::quiet_NaN();
+           });
+    metric("fotoscan_eta_seconds", "gauge",
+           "Estimated time until a stage has finished all work.",
+           [&](Stage stage) {
+               double seconds = eta(stage);
+               return seconds >= 0 ? seconds
+                                   : numeric_limits<double>::quiet_NaN();
+           });
+
+    stream.flush();
+    return text;
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <QElapsedTimer>
+#include <QHash>
+#include <QString>
+
+struct ScanData;
+
+enum class Stage { Detection, Review, Postprocess };
+
+// Exponentially weighted moving average
+class Ewma {
+  public:
+    Ewma(double alpha = 0.2) : alpha(alpha) {}
+    void add(double sample);
+    bool valid() const { return samples > 0; }
+    double value() const { return average; }
+
+  private:
+    double alpha;
+    double average = 0;
+    size_t samples = 0;
+};
+
+// Throughput, queue depths and ETA of every stage of the pipeline.
+// NOTE: not thread-safe, only use from the main thread
+class Metrics {
+  public:
+    Metrics();
+    void setConcurrency(int threads);
+
+    // Track a scan entering and leaving a stage. Scans queued in the thread
+    // pool are timed from when their task starts running.
+    void started(Stage, const ScanData *);
+    void running(Stage, const ScanData *);
+    void finished(Stage, const ScanData *, bool success = true);
+    int active(Stage stage) const { return (*this)[stage].active.size(); }
+
+    // Sample the queue depths (should be called with the queues locked)
+    void sample(int toDetect, int toReview, int toPostprocess);
+
+    // Estimated time until a stage has finished all work, or -1 if unknown
+    double eta(Stage) const;
+
+    // All counters in the Prometheus text exposition format
+    QString toPrometheus() const;
+
+  private:
+    struct StageMetrics {
+        Ewma duration; // seconds spent on a single scan
+        Ewma interval; // seconds between completions
+        size_t completed = 0, failed = 0;
+        int queued = 0;
+        QHash<const ScanData *, qint64> active; // start times
+        qint64 last_completion = -1;
+    };
+    StageMetrics &operator[](Stage stage) {
+        return stages[static_cast<int>(stage)];
+    }
+    const StageMetrics &operator[](Stage stage) const {
+        return stages[static_cast<int>(stage)];
+    }
+
+    StageMetrics stages[3];
+    QElapsedTimer clock;
+    int threads = 1;
+};
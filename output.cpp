@@ -0,0 +1,469 @@
+#include "output.hpp"
+
+#include <QDataStream>
+#include <QDateTime>
+#include <QFileInfo>
+#include <QtEndian>
+
+#include <cstring>
+
+#include <zlib.h>
+
+// Size of the write buffer of archives, which are also flushed after every
+// scan, in bytes
+#define ARCHIVE_BUFFER (8 << 20)
+
+
+//
+// DirectorySink
+//
+
+DirectorySink::DirectorySink(const QString &path) : dir(path) {}
+
+bool DirectorySink::write(const QString &path, const QByteArray &data) {
+    QString file_path = dir.absoluteFilePath(path);
+
+    // saves a round trip per photo on network file systems
+    QString parent = QFileInfo(file_path).absolutePath();
+    if (!created.contains(parent)) {
+        if (!QDir().mkpath(parent)) {
+            error = QString("Could not create %1").arg(parent);
+            return false;
+        }
+        created << parent;
+    }
+
+    QFile file(file_path);
+    if (!file.open(QIODevice::WriteOnly) || file.write(data) != data.size()) {
+        error = file.errorString();
+        return false;
+    }
+    return true;
+}
+
+
+//
+// ArchiveSink
+//
+
+ArchiveSink::ArchiveSink(const QString &path)
+    : file(path), lock(path + ".lock") {
+    // never stale while this process runs
+    lock.setStaleLockTime(0);
+    QDir().mkpath(QFileInfo(path).absolutePath());
+    if (!lock.tryLock()) {
+        open = fail("The archive is in use by another process");
+        return;
+    }
+    if (!file.open(QIODevice::ReadWrite))
+        open = fail(file.errorString());
+    buffer.reserve(ARCHIVE_BUFFER);
+}
+
+bool ArchiveSink::truncate(qint64 offset) {
+    if (!file.resize(offset) || !file.seek(offset))
+        return fail(file.errorString());
+    this->offset = offset;
+    return true;
+}
+
+bool ArchiveSink::append(const QByteArray &data) {
+    buffer += data;
+    return buffer.size() < ARCHIVE_BUFFER || ArchiveSink::flush();
+}
+
+bool ArchiveSink::flush() {
+    if (buffer.isEmpty())
+        return true;
+    if (file.write(buffer) != buffer.size() || !file.flush())
+        return fail(file.errorString());
+    offset += buffer.size();
+    buffer.resize(0); // keeps the reserved capacity
+    return true;
+}
+
+bool ArchiveSink::fail(const QString &message) {
+    error = message;
+    return false;
+}
+
+
+//
+// TarSink
+//
+
+// Octal number in a tar header field, zero-terminated
+static void putOctal(char *field, int length, qint64 value) {
+    QByteArray digits =
+        QByteArray::number(value, 8).rightJustified(length - 1, '0');
+    memcpy(field, digits.constData(), length - 1);
+    field[length - 1] = '\0';
+}
+
+static QByteArray tarHeader(const QByteArray &name, const QByteArray &prefix,
+                            qint64 size, char type) {
+    QByteArray header(512, '\0');
+    char *h = header.data();
+    memcpy(h, name.constData(), qMin(name.size(), 100));
+    putOctal(h + 100, 8, 0644);
+    putOctal(h + 108, 8, 0);
+    putOctal(h + 116, 8, 0);
+    putOctal(h + 124, 12, size);
+    putOctal(h + 136, 12, QDateTime::currentMSecsSinceEpoch() / 1000);
+    h[156] = type;
+    memcpy(h + 257, "ustar", 6);
+    memcpy(h + 263, "00", 2);
+    memcpy(h + 345, prefix.constData(), qMin(prefix.size(), 155));
+
+    // computed with the checksum field itself as spaces
+    memset(h + 148, ' ', 8);
+    unsigned int checksum = 0;
+    for (int i = 0; i < 512; i++)
+        checksum += (unsigned char)h[i];
+    putOctal(h + 148, 7, checksum);
+    return header;
+}
+
+// Zeros filling up the last 512-byte block of an entry
+static QByteArray tarPadding(qint64 size) {
+    return QByteArray((512 - size % 512) % 512, '\0');
+}
+
+// End of the last entry in a tar index, rounded up to whole blocks: 0 if it
+// lists none, -1 if it can't be read. A line left incomplete by an
+// interrupted write is dropped.
+static qint64 indexedEnd(QFile &index) {
+    QByteArray lines = index.readAll();
+    int complete = lines.lastIndexOf('\n') + 1;
+    if (complete < lines.size() && !index.resize(complete))
+        return -1;
+    if (complete == 0)
+        return 0;
+
+    // path, offset and size, split from the end as paths may contain tabs
+    int start = lines.lastIndexOf('\n', complete - 2) + 1;
+    QByteArray line = lines.mid(start, complete - 1 - start);
+    int size_at = line.lastIndexOf('\t');
+    int offset_at = size_at > 0 ? line.lastIndexOf('\t', size_at - 1) : -1;
+    if (offset_at < 0)
+        return -1;
+    bool ok_offset, ok_size;
+    qint64 offset = line.mid(offset_at + 1, size_at - offset_at - 1)
+                        .toLongLong(&ok_offset);
+    qint64 size = line.mid(size_at + 1).toLongLong(&ok_size);
+    if (!ok_offset || !ok_size || offset < 0 || size < 0)
+        return -1;
+    return offset + (size + 511) / 512 * 512;
+}
+
+TarSink::TarSink(const QString &path)
+    : ArchiveSink(path), index(path + ".index") {
+    if (!open)
+        return;
+    bool indexed = index.exists();
+    if (!index.open(QIODevice::ReadWrite)) {
+        open = fail(index.errorString());
+        return;
+    }
+
+    // continue after the last indexed entry, dropping whatever an interrupted
+    // run wrote past it along with the end-of-archive blocks
+    qint64 size = file.size();
+    qint64 end = indexed ? indexedEnd(index) : -1;
+    if (end > size) {
+        open = fail("The archive is shorter than its index");
+        return;
+    }
+
+    // archives without a usable index continue after their last entry
+    if (end < 0) {
+        if (size % 512 != 0) {
+            open = fail("Not a tar archive");
+            return;
+        }
+        end = size;
+        if (size >= 1024 && file.seek(size - 1024) &&
+            file.read(1024) == QByteArray(1024, '\0'))
+            end = size - 1024;
+    }
+    if (!truncate(end)) {
+        open = false;
+        return;
+    }
+    if (!index.seek(index.size()))
+        open = fail(index.errorString());
+}
+
+TarSink::~TarSink() {
+    if (!open)
+        return;
+    append(QByteArray(1024, '\0'));
+    if (!flush())
+        qWarning("Could not finish %s: %s", qPrintable(file.fileName()),
+                 qPrintable(error));
+}
+
+bool TarSink::write(const QString &path, const QByteArray &data) {
+    QByteArray name = path.toUtf8(), prefix;
+    bool ok = true;
+
+    // paths that don't fit the header, even when split, go in a pax header
+    if (name.size() > 100) {
+        int split = name.indexOf('/', name.size() - 101);
+        if (split > 0 && split <= 155) {
+            prefix = name.left(split);
+            name = name.mid(split + 1);
+        } else {
+            QByteArray record = " path=" + name + "\n";
+            int length = record.size();
+            length += QByteArray::number(length).size();
+            length = record.size() + QByteArray::number(length).size();
+            record.prepend(QByteArray::number(length));
+
+            ok &= append(tarHeader("PaxHeader", QByteArray(), record.size(),
+                                   'x'));
+            ok &= append(record + tarPadding(record.size()));
+            name = name.right(100);
+        }
+    }
+
+    ok &= append(tarHeader(name, prefix, data.size(), '0'));
+    entries += path.toUtf8() + '\t' + QByteArray::number(position()) + '\t' +
+               QByteArray::number(data.size()) + '\n';
+    ok &= append(data + tarPadding(data.size()));
+    return ok;
+}
+
+// Entries are only indexed once their data has been written
+bool TarSink::flush() {
+    if (!ArchiveSink::flush())
+        return false;
+    if (index.write(entries) != entries.size() || !index.flush())
+        return fail(index.errorString());
+    entries.clear();
+    return true;
+}
+
+
+//
+// ZipSink
+//
+
+static quint16 le16(const QByteArray &data, int pos) {
+    return qFromLittleEndian<quint16>((const uchar *)data.constData() + pos);
+}
+
+static quint32 le32(const QByteArray &data, int pos) {
+    return qFromLittleEndian<quint32>((const uchar *)data.constData() + pos);
+}
+
+static quint64 le64(const QByteArray &data, int pos) {
+    return qFromLittleEndian<quint64>((const uchar *)data.constData() + pos);
+}
+
+// Version needed to extract, with and without zip64 extensions
+#define ZIP_VERSION 20
+#define ZIP64_VERSION 45
+
+// UTF-8 names
+#define ZIP_FLAGS 0x0800
+
+static QByteArray localHeader(const QByteArray &name, quint32 crc,
+                              quint32 size, quint16 time, quint16 date) {
+    QByteArray header;
+    QDataStream stream(&header, QIODevice::WriteOnly);
+    stream.setByteOrder(QDataStream::LittleEndian);
+    stream << quint32(0x04034b50) << quint16(ZIP_VERSION)
+           << quint16(ZIP_FLAGS) << quint16(0) << time << date << crc << size
+           << size << quint16(name.size()) << quint16(0);
+    stream.writeRawData(name.constData(), name.size());
+    return header;
+}
+
+static QByteArray centralRecord(const QByteArray &name, quint32 crc,
+                                quint32 size, qint64 offset, quint16 time,
+                                quint16 date) {
+    bool zip64 = offset >= 0xffffffff;
+    QByteArray record;
+    QDataStream stream(&record, QIODevice::WriteOnly);
+    stream.setByteOrder(QDataStream::LittleEndian);
+    stream << quint32(0x02014b50) << quint16(0x0300 | ZIP64_VERSION)
+           << quint16(zip64 ? ZIP64_VERSION : ZIP_VERSION)
+           << quint16(ZIP_FLAGS) << quint16(0) << time << date << crc << size
+           << size << quint16(name.size()) << quint16(zip64 ? 12 : 0)
+           << quint16(0) << quint16(0) << quint16(0)
+           << (quint32(0100644) << 16)
+           << quint32(zip64 ? 0xffffffff : offset);
+    stream.writeRawData(name.constData(), name.size());
+    if (zip64)
+        stream << quint16(0x0001) << quint16(8) << quint64(offset);
+    return record;
+}
+
+ZipSink::ZipSink(const QString &path) : ArchiveSink(path) {
+    QDateTime now = QDateTime::currentDateTime();
+    time = now.time().hour() << 11 | now.time().minute() << 5 |
+           now.time().second() / 2;
+    date = (now.date().year() - 1980) << 9 | now.date().month() << 5 |
+           now.date().day();
+
+    if (open && file.size() > 0 && !readCentralDirectory() &&
+        !recoverCentralDirectory())
+        open = false;
+}
+
+ZipSink::~ZipSink() {
+    if (!open)
+        return;
+
+    qint64 directory_offset = position();
+    for (auto record : records)
+        append(record);
+    quint64 directory_size = position() - directory_offset;
+    quint64 count = records.size();
+
+    QByteArray end;
+    QDataStream stream(&end, QIODevice::WriteOnly);
+    stream.setByteOrder(QDataStream::LittleEndian);
+    if (count >= 0xffff || directory_offset >= 0xffffffff ||
+        directory_size >= 0xffffffff) {
+        // zip64 end of central directory record, and its locator
+        quint64 end64 = position();
+        stream << quint32(0x06064b50) << quint64(44)
+               << quint16(0x0300 | ZIP64_VERSION) << quint16(ZIP64_VERSION)
+               << quint32(0) << quint32(0) << count << count << directory_size
+               << quint64(directory_offset);
+        stream << quint32(0x07064b50) << quint32(0) << end64 << quint32(1);
+    }
+    stream << quint32(0x06054b50) << quint16(0) << quint16(0)
+           << quint16(qMin<quint64>(count, 0xffff))
+           << quint16(qMin<quint64>(count, 0xffff))
+           << quint32(qMin<quint64>(directory_size, 0xffffffff))
+           << quint32(qMin<quint64>(directory_offset, 0xffffffff))
+           << quint16(0);
+    append(end);
+
+    if (!flush())
+        qWarning("Could not finish %s: %s", qPrintable(file.fileName()),
+                 qPrintable(error));
+}
+
+bool ZipSink::write(const QString &path, const QByteArray &data) {
+    QByteArray name = path.toUtf8();
+    quint32 crc =
+        crc32(0, (const Bytef *)data.constData(), (uInt)data.size());
+    qint64 offset = position();
+
+    bool ok = append(localHeader(name, crc, data.size(), time, date));
+    ok &= append(data);
+    addRecord(path, centralRecord(name, crc, data.size(), offset, time, date));
+    return ok;
+}
+
+// Photos written again (by a later run) replace the earlier ones
+void ZipSink::addRecord(const QString &name, const QByteArray &record) {
+    if (names.contains(name)) {
+        records[names[name]] = record;
+    } else {
+        names[name] = records.size();
+        records << record;
+    }
+}
+
+// Read the central directory of an existing archive, to continue writing
+// where it starts
+bool ZipSink::readCentralDirectory() {
+    // end of central directory record, followed by a comment of up to 64 KiB
+    qint64 size = file.size();
+    qint64 tail_offset = qMax<qint64>(0, size - 0xffff - 22);
+    if (!file.seek(tail_offset))
+        return false;
+    QByteArray tail = file.read(size - tail_offset);
+    int end = tail.lastIndexOf("PK\x05\x06");
+    if (end < 0 || tail.size() - end < 22)
+        return false;
+
+    quint64 directory_size = le32(tail, end + 12);
+    quint64 directory_offset = le32(tail, end + 16);
+    if (le16(tail, end + 10) == 0xffff || directory_size == 0xffffffff ||
+        directory_offset == 0xffffffff) {
+        // zip64 end of central directory record, found through its locator
+        qint64 locator_offset = tail_offset + end - 20;
+        if (locator_offset < 0 || !file.seek(locator_offset))
+            return false;
+        QByteArray locator = file.read(20);
+        if (locator.size() < 20 || le32(locator, 0) != 0x07064b50 ||
+            !file.seek(le64(locator, 8)))
+            return false;
+        QByteArray end64 = file.read(56);
+        if (end64.size() < 56 || le32(end64, 0) != 0x06064b50)
+            return false;
+        directory_size = le64(end64, 40);
+        directory_offset = le64(end64, 48);
+    }
+
+    if (!file.seek(directory_offset))
+        return false;
+    QByteArray directory = file.read(directory_size);
+    if ((quint64)directory.size() != directory_size)
+        return false;
+
+    for (int pos = 0; pos + 46 <= directory.size();) {
+        if (le32(directory, pos) != 0x02014b50)
+            return false;
+        int name_length = le16(directory, pos + 28);
+        int length = 46 + name_length + le16(directory, pos + 30) +
+                     le16(directory, pos + 32);
+        addRecord(QString::fromUtf8(directory.mid(pos + 46, name_length)),
+                  directory.mid(pos, length));
+        pos += length;
+    }
+
+    return truncate(directory_offset);
+}
+
+// Rebuild the central directory of an archive that wasn't finished (eg. after
+// a crash) from the local headers of its entries, dropping a partial last one
+bool ZipSink::recoverCentralDirectory() {
+    qint64 size = file.size(), pos = 0;
+    while (pos + 30 <= size && file.seek(pos)) {
+        QByteArray header = file.read(30);
+        if (header.size() < 30 || le32(header, 0) != 0x04034b50)
+            break;
+
+        // only entries as written here can be recovered
+        quint16 flags = le16(header, 6), method = le16(header, 8);
+        quint32 size32 = le32(header, 18);
+        if ((flags & 0x0008) || method != 0 || size32 == 0xffffffff)
+            return fail("Could not recover the unfinished zip archive");
+
+        QByteArray name = file.read(le16(header, 26));
+        qint64 end = pos + 30 + name.size() + le16(header, 28) + size32;
+        if (end > size)
+            break;
+        addRecord(QString::fromUtf8(name),
+                  centralRecord(name, le32(header, 14), size32, pos,
+                                le16(header, 10), le16(header, 12)));
+        pos = end;
+    }
+
+    if (pos == 0)
+        return fail("Not a zip archive");
+    qWarning("Recovered %d photos from unfinished archive %s", records.size(),
+             qPrintable(file.fileName()));
+    return truncate(pos);
+}
+
+
+//
+// Construction
+//
+
+std::unique_ptr<OutputSink> createSink(const QString &path) {
+    QString suffix = QFileInfo(path).suffix().toLower();
+    if (suffix == "tar")
+        return std::unique_ptr<OutputSink>(new TarSink(path));
+    if (suffix == "zip")
+        return std::unique_ptr<OutputSink>(new ZipSink(path));
+    return std::unique_ptr<OutputSink>(new DirectorySink(path));
+}
@@ -0,0 +1,106 @@
+#pragma once
+
+#include <QByteArray>
+#include <QDir>
+#include <QFile>
+#include <QHash>
+#include <QList>
+#include <QLockFile>
+#include <QSet>
+#include <QString>
+
+#include <memory>
+
+// Destination of the extracted photos, written at paths relative to it
+class OutputSink {
+  public:
+    virtual ~OutputSink() {}
+
+    virtual bool write(const QString &path, const QByteArray &data) = 0;
+
+    // Hand everything written so far to the operating system, so it survives
+    // the process
+    virtual bool flush() { return true; }
+
+    bool isOpen() const { return open; }
+    QString errorString() const { return error; }
+
+  protected:
+    bool open = true;
+    QString error;
+};
+
+// Photos as separate files in a directory tree
+class DirectorySink : public OutputSink {
+  public:
+    DirectorySink(const QString &path);
+
+    bool write(const QString &path, const QByteArray &data) override;
+
+  private:
+    QDir dir;
+    QSet<QString> created; // directories known to exist
+};
+
+// Photos appended to a single archive file, through a large buffer. An archive
+// is used by a single process at a time, and is continued when opened again.
+class ArchiveSink : public OutputSink {
+  public:
+    ArchiveSink(const QString &path);
+
+    bool flush() override;
+
+  protected:
+    // Start writing at `offset`, dropping everything after it
+    bool truncate(qint64 offset);
+
+    bool append(const QByteArray &data);
+    qint64 position() const { return offset + buffer.size(); }
+    bool fail(const QString &message);
+
+    QFile file;
+
+  private:
+    QLockFile lock;
+    QByteArray buffer;
+    qint64 offset = 0; // of the buffer in the file
+};
+
+// Tar archive (POSIX ustar, with pax headers for long paths), along with an
+// index file listing the offset and size of every photo in it
+class TarSink : public ArchiveSink {
+  public:
+    TarSink(const QString &path);
+    ~TarSink();
+
+    bool write(const QString &path, const QByteArray &data) override;
+    bool flush() override;
+
+  private:
+    QFile index;
+    QByteArray entries; // index lines not yet written
+};
+
+// Zip archive, storing photos without compression (they are compressed
+// already), with zip64 extensions where offsets or counts require them
+class ZipSink : public ArchiveSink {
+  public:
+    ZipSink(const QString &path);
+    ~ZipSink();
+
+    bool write(const QString &path, const QByteArray &data) override;
+
+  private:
+    bool readCentralDirectory();
+    bool recoverCentralDirectory();
+    void addRecord(const QString &name, const QByteArray &record);
+
+    // central directory records, which are written on closing
+    QList<QByteArray> records;
+    QHash<QString, int> names;
+    quint16 time, date;
+};
+
+// Sink for an output path: an archive for .tar and .zip files, a directory
+// otherwise
+std::unique_ptr<OutputSink> createSink(const QString &path);
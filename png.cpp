@@ -0,0 +1,64 @@
+#include "png.hpp"
+
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <png.h>
+
+using namespace std;
+
+static void onPngError(png_structp png, png_const_charp message) {
+    *(string *)png_get_error_ptr(png) = message;
+    longjmp(png_jmpbuf(png), 1);
+}
+
+static void onPngWarning(png_structp, png_const_charp message) {
+    qWarning("PNG: %s", message);
+}
+
+static void writeData(png_structp png, png_bytep data, png_size_t length) {
+    ((QByteArray *)png_get_io_ptr(png))->append((const char *)data, length);
+}
+
+static void flushData(png_structp) {}
+
+QByteArray encodePng(const uchar *bits, int width, int height, int stride) {
+    string error;
+    png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, &error,
+                                              onPngError, onPngWarning);
+    png_infop info = png ? png_create_info_struct(png) : nullptr;
+    if (info == nullptr) {
+        png_destroy_write_struct(&png, nullptr);
+        throw new runtime_error("Could not set up the PNG encoder");
+    }
+
+    QByteArray result;
+    vector<png_bytep> rows(height);
+    if (setjmp(png_jmpbuf(png))) {
+        png_destroy_write_struct(&png, &info);
+        throw new runtime_error("Could not encode PNG: " + error);
+    }
+
+    png_set_write_fn(png, &result, writeData, flushData);
+    png_set_IHDR(png, info, width, height, 8, PNG_COLOR_TYPE_RGB,
+                 PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT,
+                 PNG_FILTER_TYPE_DEFAULT);
+    png_write_info(png, info);
+
+    // the pixels are read as they are, dropping their unused alpha byte
+#if Q_BYTE_ORDER == Q_LITTLE_ENDIAN
+    png_set_bgr(png);
+    png_set_filler(png, 0, PNG_FILLER_AFTER);
+#else
+    png_set_filler(png, 0, PNG_FILLER_BEFORE);
+#endif
+
+    for (int y = 0; y < height; y++)
+        rows[y] = (png_bytep)bits + (size_t)y * stride;
+    png_write_image(png, rows.data());
+    png_write_end(png, nullptr);
+
+    png_destroy_write_struct(&png, &info);
+    return result;
+}
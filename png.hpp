@@ -0,0 +1,7 @@
+#pragma once
+
+#include <QByteArray>
+
+// Encode an image of 32-bit pixels (as in QImage::Format_RGB32) as PNG,
+// throwing on failure
+QByteArray encodePng(const uchar *bits, int width, int height, int stride);
@@ -1,6 +1,7 @@
 #include "postprocessing.hpp"
 
 #include <QDebug>
+#include <QImageReader>
 
 #include <opencv2/core/core.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
@@ -8,11 +9,28 @@
 
 #include <chrono>
 
+#include "bands.hpp"
+#include "png.hpp"
 #include "scanner.hpp"
+#include "trace.hpp"
 
 using namespace cv;
 using namespace std;
 
+// Largest skew of a photo that is still cut out losslessly, in degrees. Its
+// edges can be off by the tangent of this times their length.
+#define LOSSLESS_SKEW 0.2
+
+// Spacing of the pixels sampled from the page background, in both directions
+#define REFERENCE_STEP 8
+
+// Darkest reference to balance against, below which noise dominates
+#define REFERENCE_MIN_LEVEL 32
+
+// Largest deviation of a channel of the page background from its grey, for
+// it to still pass as neutral rather than as a coloured album page
+#define REFERENCE_MAX_CAST 0.25
+
 
 //
 // Auxiliary
@@ -28,29 +46,231 @@ static bool isClockwise(const QPolygon &polygon) {
     return sum < 0.0;
 }
 
+static bool isJpeg(const QString &file) {
+    QString suffix = QFileInfo(file).suffix();
+    return suffix.compare("jpg", Qt::CaseInsensitive) == 0 ||
+           suffix.compare("jpeg", Qt::CaseInsensitive) == 0;
+}
+
+// Rectangle inside an (almost) axis-aligned photo, starting on the MCU grid so
+// it can be cut losslessly, or a null rectangle if the photo is skewed
+static QRect losslessCrop(const QPolygon &shape, const QSize &mcu,
+                          const QRect &bounds) {
+    for (int i = 0; i < shape.size(); i++) {
+        QPoint edge = shape[(i + 1) % shape.size()] - shape[i];
+        int along = max(abs(edge.x()), abs(edge.y()));
+        int across = min(abs(edge.x()), abs(edge.y()));
+        if (atan2(across, along) > LOSSLESS_SKEW * CV_PI / 180)
+            return QRect();
+    }
+
+    // corners are ordered clockwise, starting at the top left
+    int left = max(shape[0].x(), shape[3].x());
+    int top = max(shape[0].y(), shape[1].y());
+    int right = min(shape[1].x(), shape[2].x());
+    int bottom = min(shape[2].y(), shape[3].y());
+    left = (left + mcu.width() - 1) / mcu.width() * mcu.width();
+    top = (top + mcu.height() - 1) / mcu.height() * mcu.height();
+    if (right <= left || bottom <= top)
+        return QRect();
+    return QRect(left, top, right - left, bottom - top) & bounds;
+}
+
+
+//
+// Colour correction
+//
+
+// Region of the scan at full resolution, read from the mapping if it is mapped
+static QImage readScan(const ScanData *data, const QRect &region) {
+    if (data->mapped)
+        return data->mapped->read(region);
+    return data->image.copy(region);
+}
+
+// Mean colour (BGR) of the most common colour of the page background, ie. of
+// the pixels outside all photos, or false if no background is left
+static bool findBackground(const ScanData *data, const QRect &bounds,
+                           Scalar &reference) {
+    // colours are binned by their 4 most significant bits per channel
+    vector<int> counts(4096, 0);
+    vector<Vec3d> sums(4096, Vec3d(0, 0, 0));
+    for (int y = bounds.top(); y <= bounds.bottom(); y += REFERENCE_STEP) {
+        QImage row = readScan(data, QRect(bounds.left(), y, bounds.width(), 1));
+        const QRgb *pixels = (const QRgb *)row.constScanLine(0);
+        for (int x = 0; x < row.width(); x += REFERENCE_STEP) {
+            QPoint point(bounds.left() + x, y);
+            bool inside = false;
+            for (const auto &shape : data->shapes)
+                if (shape.containsPoint(point, Qt::OddEvenFill)) {
+                    inside = true;
+                    break;
+                }
+            if (inside)
+                continue;
+
+            QRgb pixel = pixels[x];
+            int bin = (qRed(pixel) >> 4) << 8 | (qGreen(pixel) >> 4) << 4 |
+                      qBlue(pixel) >> 4;
+            counts[bin]++;
+            sums[bin] += Vec3d(qBlue(pixel), qGreen(pixel), qRed(pixel));
+        }
+    }
+
+    int mode = max_element(counts.begin(), counts.end()) - counts.begin();
+    if (counts[mode] == 0)
+        return false;
+    Vec3d average = sums[mode] * (1. / counts[mode]);
+    reference = Scalar(average[0], average[1], average[2]);
+    return true;
+}
+
+// Lookup table (for a BGRX image) balancing the colours of a scan against a
+// neutral reference (BGR), or an empty one if the reference is unusable
+static Mat correctionTable(const Scalar &reference, int level, bool strict) {
+    double grey = (reference[0] + reference[1] + reference[2]) / 3;
+    if (grey < REFERENCE_MIN_LEVEL)
+        return Mat();
+    if (strict)
+        for (int c = 0; c < 3; c++)
+            if (abs(reference[c] - grey) > REFERENCE_MAX_CAST * grey)
+                return Mat();
+
+    double exposure = level > 0 ? level / grey : 1;
+    Mat table(1, 256, CV_8UC4);
+    for (int c = 0; c < 3; c++) {
+        double gain = grey / max(reference[c], 1.) * exposure;
+        for (int value = 0; value < 256; value++)
+            table.at<Vec4b>(value)[c] = saturate_cast<uchar>(value * gain);
+    }
+    for (int value = 0; value < 256; value++)
+        table.at<Vec4b>(value)[3] = value;
+    return table;
+}
+
+// Colour correction of the photos of a scan, or an empty table to leave them
+static Mat colorCorrection(const ScanData *data, const QRect &bounds,
+                           const PostprocessOptions &options) {
+    if (!options.colorCorrection)
+        return Mat();
+    TraceSpan span("colorReference", data->file);
+
+    // a given reference is trusted to be neutral, whatever its colour
+    Scalar reference;
+    bool given = !options.colorReference.isEmpty();
+    if (given) {
+        QImage region = readScan(data, options.colorReference & bounds);
+        if (region.isNull())
+            return Mat();
+        reference = mean(Mat(region.height(), region.width(), CV_8UC4,
+                             region.bits(), region.bytesPerLine()));
+    } else if (!findBackground(data, bounds, reference)) {
+        return Mat();
+    }
+    span.arg("blue", reference[0]);
+    span.arg("green", reference[1]);
+    span.arg("red", reference[2]);
+
+    Mat table = correctionTable(reference, options.referenceLevel, !given);
+    if (table.empty())
+        qWarning("No neutral reference found in %s, leaving its colours",
+                 qPrintable(data->file));
+    return table;
+}
+
 
 //
 // Detection
 //
 
-void extractPhotos(ScanData *data) {
-    // convert to OpenCV format
+// Bounding boxes of the photos of a streamed scan, read in a single pass from
+// top to bottom. Photos overlapping vertically are read from a common band,
+// so only the rows below a photo are ever held.
+static QVector<QImage> readRegions(BandReader &bands,
+                                   const QList<QPolygon> &shapes,
+                                   const QRect &bounds) {
+    QVector<QRect> boxes;
+    QVector<int> order;
+    for (const auto &shape : shapes) {
+        boxes << (shape.boundingRect() & bounds);
+        if (!boxes.last().isEmpty())
+            order << boxes.size() - 1;
+    }
+    sort(order.begin(), order.end(),
+         [&](int a, int b) { return boxes[a].top() < boxes[b].top(); });
+
+    QVector<QImage> regions(shapes.size());
+    for (int first = 0; first < order.size();) {
+        int top = boxes[order[first]].top();
+        int bottom = boxes[order[first]].bottom();
+        int last = first + 1;
+        while (last < order.size() && boxes[order[last]].top() <= bottom)
+            bottom = max(bottom, boxes[order[last++]].bottom());
+
+        QImage band = bands.read(top, bottom - top + 1);
+        if (band.isNull())
+            throw new runtime_error("Could not read the scan band by band");
+        for (int i = first; i < last; i++) {
+            const QRect &box = boxes[order[i]];
+            regions[order[i]] = band.copy(box.translated(0, -top));
+        }
+        first = last;
+    }
+    return regions;
+}
+
+void extractPhotos(ScanData *data, const PostprocessOptions &options) {
+    // convert to OpenCV format, unless photos are read out of a mapped scan
+    // one by one, touching only the strips or tiles below them, or out of the
+    // bands of a streamed one
     Mat mat;
-    if (data->image.format() == QImage::Format_RGB32)
+    QRect bounds;
+    QVector<QImage> regions;
+    if (data->mapped)
+        bounds = data->mapped->rect();
+    else if (data->streamed) {
+        TraceSpan span("readRegions", data->file);
+        bounds = QRect(QPoint(0, 0), data->streamed->size());
+        regions = readRegions(*data->streamed, data->shapes, bounds);
+    } else if (data->image.format() == QImage::Format_RGB32) {
         mat = Mat(data->image.height(), data->image.width(), CV_8UC4,
                   data->image.bits(), data->image.bytesPerLine());
-    else {
+        bounds = data->image.rect();
+    } else {
         throw new runtime_error("Could not convert Qt image to OpenCV");
     }
 
+    // every photo gets its own output slot, so their order doesn't depend on
+    // thread timing
+    QVector<QImage> photos(data->shapes.size());
+    QImage *photo_slots = photos.data();
+    QImage *region_slots = regions.data();
+
+    // applied while copying every photo out of its warped region, so it
+    // costs no pass of its own
+    Mat table = colorCorrection(data, bounds, options);
+
+    // axis-aligned photos can be cut losslessly out of JPEG scans, as long as
+    // the scan wasn't transformed on loading (nor has its colours corrected)
+    QSize mcu;
+    if (options.losslessCrop && table.empty() && isJpeg(data->file) &&
+        QImageReader(data->file).transformation() ==
+            QImageIOHandler::TransformationNone)
+        mcu = jpegMcuSize(data->file);
+    data->crops = QVector<QRect>(data->shapes.size());
+    QRect *crop_slots = data->crops.data();
+
     #pragma omp parallel for
     for (int index = 0; index < data->shapes.size(); ++index) {
+        TraceSpan span("extractPhoto", data->file);
+        span.arg("photo", index);
+
         auto shape = data->shapes[index];
         assert(shape.size() == 4);
 
         // start working with the bounding box -- this can be significantly
         // larger than the photo itself, eg. when it is rotated
-        auto bbox = shape.boundingRect() & data->image.rect();
+        auto bbox = shape.boundingRect() & bounds;
 
         // make sure the polygon is oriented clockwise
         if (!isClockwise(shape))
@@ -68,9 +288,31 @@ void extractPhotos(ScanData *data) {
         }
         rotate(shape.begin(), shape.begin() + topleft, shape.end());
 
+        // those only need their pixels for orientation detection
+        if (mcu.isValid()) {
+            QRect crop = losslessCrop(shape, mcu, bounds);
+            if (!crop.isNull()) {
+                crop_slots[index] = crop;
+                photo_slots[index] =
+                    data->streamed
+                        ? region_slots[index].copy(
+                              crop.translated(-bbox.topLeft()))
+                        : data->image.copy(crop);
+                continue;
+            }
+        }
+
         // extract the image data (coarsely, given its bounding box)
-        const Mat submat_coarse =
-            mat(Rect(bbox.x(), bbox.y(), bbox.width(), bbox.height()));
+        QImage region;
+        Mat submat_coarse;
+        if (mat.empty()) {
+            region = data->mapped ? data->mapped->read(bbox)
+                                  : std::move(region_slots[index]);
+            submat_coarse = Mat(region.height(), region.width(), CV_8UC4,
+                                region.bits(), region.bytesPerLine());
+        } else
+            submat_coarse =
+                mat(Rect(bbox.x(), bbox.y(), bbox.width(), bbox.height()));
         QPoint submat_offset = bbox.topLeft();
 
         // figure out a destination rectangle to warp the image to
@@ -106,22 +348,23 @@ void extractPhotos(ScanData *data) {
         const Mat submat_fine =
             sub_warped(Rect(dest.x(), dest.y(), dest.width(), dest.height()));
 
-        const auto qt_output =
-            QImage((uchar *)submat_fine.data, submat_fine.cols,
-                   submat_fine.rows, submat_fine.step, data->image.format());
-        #pragma omp critical
-        data->photos << qt_output.copy();
+        QImage qt_output(submat_fine.cols, submat_fine.rows,
+                         QImage::Format_RGB32);
+        Mat output(qt_output.height(), qt_output.width(), CV_8UC4,
+                   qt_output.bits(), qt_output.bytesPerLine());
+        if (table.empty())
+            submat_fine.copyTo(output);
+        else
+            LUT(submat_fine, table, output);
+        photo_slots[index] = qt_output;
     }
-}
 
-enum class Orientation {
-    Unknown = -1,
+    data->photos = photos.toList();
 
-    Correct = 0,
-    Clockwise = 1, // photo is rotated to the right
-    Flipped = 2,
-    Counterclockwise = 3 // photo is rotated to the left
-};
+    // only needed for extraction
+    data->mapped.reset();
+    data->streamed.reset();
+}
 
 QDebug operator<<(QDebug d, const Orientation &orientation) {
     switch (orientation) {
@@ -200,8 +443,12 @@ Mat correctOrientation(Mat image, Orientation orientation) {
 // per orientation into a reference-passed array.
 void detectFeatures(const Mat &image, const FileStorage &fs,
                     unsigned int(&votes)[4]) {
+    const QString scan = TraceSpan::currentFile();
     #pragma omp parallel for
     for (int orientation = 0; orientation < 4; orientation++) {
+        TraceSpan span("detectFeatures", scan);
+        span.arg("orientation", orientation);
+
         Mat rotated =
             correctOrientation(image, static_cast<Orientation>(orientation));
 
@@ -255,10 +502,10 @@ Orientation detectSky(const Mat &image) {
     return static_cast<Orientation>(winner);
 }
 
-// Detect and correct the orientation of all photos
-void correctOrientation(ScanData *data) {
+// Cascade classifier files used for orientation detection
+QList<QFileInfo> cascadeFiles() {
     QDir appdir = QDir(QCoreApplication::applicationDirPath());
-    const auto cascades = {
+    return {
         // listed in order most likely to appear in a photo
         // (processing bails out as soon as an orientation has been found)
         //// Arch Linux paths
@@ -270,6 +517,50 @@ void correctOrientation(ScanData *data) {
         QFileInfo(appdir, "haarcascades/haarcascade_profileface.xml"),
         QFileInfo(appdir, "haarcascades/haarcascade_fullbody.xml"),
         };
+}
+
+// Cut photos losslessly out of the scan where possible, leaving the others to
+// be encoded from their pixels
+static void cropLosslessly(ScanData *data,
+                           const QVector<Orientation> &orientations) {
+    data->encoded = QVector<QByteArray>(data->photos.size());
+    QVector<int> photos, turns;
+    QVector<QRect> rects;
+    for (int i = 0; i < data->crops.size(); ++i) {
+        if (data->crops[i].isNull())
+            continue;
+
+        // clockwise quarter turns undoing the orientation
+        int turn = 0;
+        if (orientations[i] == Orientation::Clockwise)
+            turn = 3;
+        else if (orientations[i] == Orientation::Flipped)
+            turn = 2;
+        else if (orientations[i] == Orientation::Counterclockwise)
+            turn = 1;
+
+        photos << i;
+        rects << data->crops[i];
+        turns << turn;
+    }
+    if (photos.isEmpty())
+        return;
+
+    // the coefficients of the scan are read once for all photos
+    TraceSpan span("crop", data->file);
+    span.arg("photos", photos.size());
+    auto encoded = cropJpeg(data->file, rects, turns);
+    for (int j = 0; j < photos.size(); ++j) {
+        data->encoded[photos[j]] = encoded[j];
+        if (encoded[j].isEmpty())
+            qWarning("Could not cut photo %d of %s losslessly", photos[j],
+                     qPrintable(data->file));
+    }
+}
+
+// Detect and correct the orientation of all photos
+void correctOrientation(ScanData *data, const PostprocessOptions &options) {
+    const auto cascades = cascadeFiles();
 
     unsigned int page_votes[4] = {0, 0, 0, 0};
     QVector<Orientation> orientations(data->photos.size());
@@ -298,6 +589,11 @@ void correctOrientation(ScanData *data) {
 
             // try at different scales to save on processing power
             for (int scale = 4; scale > 0; scale--) {
+                TraceSpan span("cascade", data->file);
+                span.arg("photo", i);
+                span.arg("cascade", cascade.fileName());
+                span.arg("scale", scale);
+
                 auto newsize = Size(round(grayscale.cols / scale),
                                     round(grayscale.rows / scale));
                 Mat scaled;
@@ -331,8 +627,25 @@ void correctOrientation(ScanData *data) {
             orientations[i] = page_winner;
     }
 
-    // apply orientations
+    // leave it to the EXIF tag, which only JPEG files carry
+    bool exif = options.exifOrientation && isJpeg(data->file);
+    if (exif)
+        data->orientations = orientations;
+
+    // photos cut losslessly are rotated losslessly as well
+    cropLosslessly(data, exif ? QVector<Orientation>(orientations.size(),
+                                                     Orientation::Correct)
+                              : orientations);
+    if (exif)
+        return;
+
+    // apply orientations (to photos cut losslessly only for their reduced
+    // sizes)
     for (int i = 0; i < data->photos.size(); ++i) {
+        if (orientations[i] == Orientation::Correct ||
+            (!data->encoded[i].isEmpty() && options.sizes.isEmpty()))
+            continue;
+
         // TODO: rotate QImage directly?
         auto photo = data->photos[i];
         Mat mat(photo.height(), photo.width(), CV_8UC4, photo.bits(),
@@ -346,26 +659,137 @@ void correctOrientation(ScanData *data) {
 }
 
 
+//
+// Encoding
+//
+
+QString photoSuffix(const QString &scan) {
+    QString suffix = QFileInfo(scan).suffix();
+    return isJpeg(scan) || suffix.compare("png", Qt::CaseInsensitive) == 0
+               ? suffix
+               : QString("png");
+}
+
+// Photo reduced to `size` pixels along its longest side: halved through the
+// image pyramid while it is at least twice that size, then resampled to it.
+// Photos that are smaller already are kept as they are.
+static Mat reducePhoto(const Mat &photo, int size) {
+    Mat reduced = photo;
+    while (max(reduced.cols, reduced.rows) >= 2 * size) {
+        Mat half;
+        pyrDown(reduced, half);
+        reduced = half;
+    }
+
+    double factor = (double)size / max(reduced.cols, reduced.rows);
+    if (factor >= 1)
+        return reduced;
+    Mat resized;
+    resize(reduced, resized, Size(max<int>(1, round(reduced.cols * factor)),
+                                  max<int>(1, round(reduced.rows * factor))),
+           0, 0, INTER_AREA);
+    return resized;
+}
+
+// Encode the photos that weren't cut losslessly, in the format of the scan,
+// along with their reduced sizes
+void encodePhotos(ScanData *data, const PostprocessOptions &options) {
+    UsageMeter meter(data->stats.encode);
+
+    bool jpeg = isJpeg(data->file);
+    JpegOptions jpeg_options = options.jpeg;
+    if (jpeg && jpeg_options.quality == 0) {
+        jpeg_options.quality = jpegQuality(data->file);
+        if (jpeg_options.quality == 0)
+            jpeg_options.quality = JpegOptions().quality;
+    }
+
+    // straight from the pixels, which needs no conversion
+    auto encode = [&](const Mat &pixels) {
+        return jpeg ? encodeJpeg(pixels.data, pixels.cols, pixels.rows,
+                                 pixels.step, jpeg_options)
+                    : encodePng(pixels.data, pixels.cols, pixels.rows,
+                                pixels.step);
+    };
+
+    data->encoded.resize(data->photos.size());
+    data->reduced = QVector<QVector<QByteArray>>(
+        options.sizes.size(), QVector<QByteArray>(data->photos.size()));
+    for (int i = 0; i < data->photos.size(); ++i) {
+        TraceSpan span("encode", data->file);
+        span.arg("photo", i);
+
+        const QImage &photo = data->photos[i];
+        if ((data->encoded[i].isEmpty() || !options.sizes.isEmpty()) &&
+            photo.format() != QImage::Format_RGB32)
+            throw new runtime_error("Cannot encode photo format");
+        Mat pixels(photo.height(), photo.width(), CV_8UC4,
+                   (void *)photo.constBits(), photo.bytesPerLine());
+        if (data->encoded[i].isEmpty())
+            data->encoded[i] = encode(pixels);
+
+        // every size is reduced from the next larger one
+        for (int j = 0; j < options.sizes.size(); ++j) {
+            TraceSpan span("reduce", data->file);
+            span.arg("photo", i);
+            span.arg("size", options.sizes[j]);
+
+            pixels = reducePhoto(pixels, options.sizes[j]);
+            data->reduced[j][i] = encode(pixels);
+        }
+
+        if (i < data->orientations.size()) {
+            data->encoded[i] =
+                setExifOrientation(data->encoded[i], data->orientations[i]);
+            for (auto &reduced : data->reduced)
+                reduced[i] =
+                    setExifOrientation(reduced[i], data->orientations[i]);
+        }
+        data->stats.bytes_encoded += data->encoded[i].size();
+        for (const auto &reduced : data->reduced)
+            data->stats.bytes_encoded += reduced[i].size();
+    }
+}
+
 //
 // PostprocessTask
 //
 
-PostprocessTask::PostprocessTask(ScanData *data) : data(data) {}
+PostprocessTask::PostprocessTask(ScanData *data,
+                                 const PostprocessOptions &options)
+    : data(data), options(options) {}
 
 void PostprocessTask::run() {
-    // Lazy-load image data
+    TraceSpan span("postprocess", data->file);
+    emit started(data);
+
+    // Lazy-load image data at full resolution, unless photos can be read
+    // straight from the scan, or from its bands for scans above the stream
+    // size (except for colour correction, which reads the scan at random)
     try {
-        data->load();
+        if ((data->image.isNull() || data->imageScale != 1) && !data->map() &&
+            (options.colorCorrection || !data->stream()))
+            data->load(true);
     } catch (exception *ex) {
         emit failure(data, ex);
         return;
     }
 
     auto start = chrono::system_clock::now();
+    UsageMeter meter(data->stats.postprocess);
+
+    try {
+        extractPhotos(data, options);
+        correctOrientation(data, options);
+    } catch (runtime_error *ex) {
+        meter.stop();
+        emit failure(data, ex);
+        return;
+    }
+    meter.stop();
 
     try {
-        extractPhotos(data);
-        correctOrientation(data);
+        encodePhotos(data, options);
     } catch (runtime_error *ex) {
         emit failure(data, ex);
         return;
@@ -373,6 +797,54 @@ void PostprocessTask::run() {
 
     auto end = chrono::system_clock::now();
     data->elapsed += chrono::duration_cast<chrono::milliseconds>(end - start);
+    span.arg("elapsed_ms", (qint64)data->elapsed.count());
 
     emit success(data);
-}
\ No newline at end of file
+}
+
+
+//
+// EXIF
+//
+
+// Value of the EXIF Orientation tag, telling viewers how to rotate a photo
+static quint16 exifOrientation(Orientation orientation) {
+    switch (orientation) {
+    case Orientation::Clockwise:
+        return 8; // rotate counter-clockwise to display
+    case Orientation::Flipped:
+        return 3;
+    case Orientation::Counterclockwise:
+        return 6; // rotate clockwise to display
+    default:
+        return 1;
+    }
+}
+
+QByteArray setExifOrientation(const QByteArray &jpeg, Orientation orientation) {
+    if (orientation == Orientation::Correct ||
+        orientation == Orientation::Unknown || !jpeg.startsWith("\xff\xd8"))
+        return jpeg;
+
+    // APP1 segment with an Exif header, and a big-endian TIFF structure
+    // holding a single IFD with the Orientation tag
+    quint16 value = exifOrientation(orientation);
+    const char app1[] = {
+        '\xff', '\xe1', 0, 34,                 // marker, length
+        'E', 'x', 'i', 'f', 0, 0,               // Exif header
+        'M', 'M', 0, 42, 0, 0, 0, 8,            // TIFF header, IFD at 8
+        0, 1,                                   // IFD with a single entry:
+        0x01, 0x12, 0, 3, 0, 0, 0, 1,           //   Orientation, SHORT, 1
+        (char)(value >> 8), (char)value, 0, 0,  //   value
+        0, 0, 0, 0                              // no next IFD
+    };
+
+    // after SOI and a JFIF APP0 segment, if any
+    int offset = 2;
+    if (jpeg.size() >= 6 && jpeg.mid(2, 2) == "\xff\xe0")
+        offset += 2 + ((uchar)jpeg[4] << 8 | (uchar)jpeg[5]);
+
+    QByteArray result = jpeg;
+    result.insert(offset, app1, sizeof(app1));
+    return result;
+}
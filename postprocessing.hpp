@@ -2,20 +2,83 @@
 
 #include <QObject>
 #include <QRunnable>
+#include <QFileInfo>
+#include <QList>
+#include <QRect>
+
+#include <opencv2/core/core.hpp>
+
+#include "jpeg.hpp"
 
 struct ScanData;
 
+enum class Orientation {
+    Unknown = -1,
+
+    Correct = 0,
+    Clockwise = 1, // photo is rotated to the right
+    Flipped = 2,
+    Counterclockwise = 3 // photo is rotated to the left
+};
+
+// Tunables for the post-processing
+struct PostprocessOptions {
+    // record the orientation of JPEG photos as EXIF tag, rather than rotating
+    // their pixels
+    bool exifOrientation = false;
+
+    // cut axis-aligned photos out of JPEG scans losslessly, rather than
+    // resampling and re-encoding them
+    bool losslessCrop = false;
+
+    // balance the colours of photos against a neutral reference in every
+    // scan: the given region (eg. a grey card), or the page background when
+    // empty, optionally correcting the exposure to bring the reference to
+    // `referenceLevel` (1-255)
+    bool colorCorrection = false;
+    QRect colorReference;
+    int referenceLevel = 0;
+
+    // longest sides of reduced copies written along with every photo, from
+    // large to small
+    QList<int> sizes;
+
+    // encoder settings of JPEG photos
+    JpegOptions jpeg;
+};
+
+// Post-processing stages, as used by PostprocessTask (exposed for benchmarking)
+void extractPhotos(ScanData *data,
+                   const PostprocessOptions &options = PostprocessOptions());
+void correctOrientation(ScanData *data,
+                        const PostprocessOptions &options = PostprocessOptions());
+void encodePhotos(ScanData *data,
+                  const PostprocessOptions &options = PostprocessOptions());
+void detectFeatures(const cv::Mat &image, const cv::FileStorage &fs,
+                    unsigned int(&votes)[4]);
+QList<QFileInfo> cascadeFiles();
+
+// Suffix of the encoded photos of a scan: photos of JPEG and PNG scans keep
+// their format, others are written as PNG
+QString photoSuffix(const QString &scan);
+
+// Add an EXIF Orientation tag to an encoded JPEG image
+QByteArray setExifOrientation(const QByteArray &jpeg, Orientation orientation);
+
 class PostprocessTask : public QObject, public QRunnable {
     Q_OBJECT
 
   public:
-    PostprocessTask(ScanData *data);
+    PostprocessTask(ScanData *data,
+                    const PostprocessOptions &options = PostprocessOptions());
     void run();
 
   signals:
+    void started(ScanData *);
     void success(ScanData *);
     void failure(ScanData *, std::exception *);
 
   private:
     ScanData *data;
+    PostprocessOptions options;
 };
@@ -0,0 +1,236 @@
+#include "results.hpp"
+
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QJsonArray>
+#include <QJsonObject>
+#include <QSqlDatabase>
+#include <QSqlError>
+#include <QSqlQuery>
+#include <QVariant>
+
+#include "archive.hpp"
+#include "scanner.hpp"
+#include "tiff.hpp"
+
+
+//
+// JSON
+//
+
+QList<QPolygon> shapesFromJson(const QJsonArray &json_shapes) {
+    QList<QPolygon> shapes;
+    for (auto json_shape_obj : json_shapes) {
+        auto json_shape = json_shape_obj.toArray();
+        QPolygon shape;
+        for (auto json_shape_obj : json_shape) {
+            auto json_point = json_shape_obj.toObject();
+            shape << QPoint(json_point["x"].toInt(), json_point["y"].toInt());
+        }
+        shapes << shape;
+    }
+    return shapes;
+}
+
+QJsonArray shapesToJson(const QList<QPolygon> &shapes) {
+    QJsonArray json_shapes;
+    for (auto shape : shapes) {
+        QJsonArray json_shape;
+        for (auto point : shape) {
+            QJsonObject json_point;
+            json_point["x"] = point.x();
+            json_point["y"] = point.y();
+            json_shape << json_point;
+        }
+        json_shapes << json_shape;
+    }
+    return json_shapes;
+}
+
+void fromJson(ScanData *data, QJsonDocument doc) {
+    data->shapes << shapesFromJson(doc.object()["pictures"].toArray());
+}
+
+static QString getResultPath(QFileInfo image_info) {
+    QDir dir(image_info.absolutePath());
+    QFile result(dir.absoluteFilePath(
+        QString("%1.dat").arg(scanBaseName(image_info.filePath()))));
+    QFileInfo result_info(result);
+    return result_info.absoluteFilePath();
+}
+
+QString getResultPath(QString image) {
+    return getResultPath(QFileInfo(sidecarPath(image)));
+}
+
+
+//
+// DatStore
+//
+
+bool DatStore::find(const QString &image, ScanRecord &record, bool listed) {
+    error.clear();
+    if (!listed)
+        return false;
+    QFileInfo info(getResultPath(image));
+    if (!info.exists())
+        return false;
+
+    QFile results(info.absoluteFilePath());
+    if (!results.open(QIODevice::ReadOnly | QIODevice::Text)) {
+        error = results.errorString();
+        return false;
+    }
+    QJsonObject root = QJsonDocument::fromJson(results.readAll()).object();
+
+    record.shapes = shapesFromJson(root["pictures"].toArray());
+    record.rejects = shapesFromJson(root["rejects"].toArray());
+    record.ungrouped = shapesFromJson(root["ungrouped"].toArray());
+    record.status = root.contains("status")
+                        ? (ScanStatus)root["status"].toInt()
+                        : ScanStatus::Reviewed;
+    record.hash = QByteArray::fromHex(root["hash"].toString().toLatin1());
+    record.phash = root["phash"].toString().toULongLong(nullptr, 16);
+    // the time of the review, which post-processing doesn't change, falling
+    // back to that of the file for results written before it was recorded
+    record.modified = root.contains("modified")
+                          ? QDateTime::fromMSecsSinceEpoch(
+                                (qint64)root["modified"].toDouble())
+                          : info.lastModified();
+    return true;
+}
+
+bool DatStore::store(const QString &image, const ScanRecord &record) {
+    error.clear();
+    QJsonObject root;
+    root["pictures"] = shapesToJson(record.shapes);
+    if (record.status == ScanStatus::Detected) {
+        root["rejects"] = shapesToJson(record.rejects);
+        root["ungrouped"] = shapesToJson(record.ungrouped);
+    }
+    root["status"] = (int)record.status;
+    if (record.modified.isValid())
+        root["modified"] = (double)record.modified.toMSecsSinceEpoch();
+    if (!record.hash.isEmpty())
+        root["hash"] = QString::fromLatin1(record.hash.toHex());
+    if (record.phash != 0)
+        root["phash"] = QString::number(record.phash, 16);
+
+    // the directory next to an archive is created on demand
+    QString path = getResultPath(image);
+    if (sidecarPath(image) != image)
+        QFileInfo(path).absoluteDir().mkpath(".");
+
+    QFile results(path);
+    if (!results.open(QIODevice::WriteOnly | QIODevice::Text) ||
+        results.write(QJsonDocument(root).toJson()) < 0) {
+        error = results.errorString();
+        return false;
+    }
+    return true;
+}
+
+
+//
+// IndexStore
+//
+
+IndexStore::IndexStore(const QString &path)
+    : path(QFileInfo(path).absoluteFilePath()),
+      connection(QString("index:%1").arg(this->path)) {
+    QSqlDatabase db = QSqlDatabase::addDatabase("QSQLITE", connection);
+    db.setDatabaseName(this->path);
+    if (!db.open()) {
+        error = db.lastError().text();
+        return;
+    }
+
+    // every review is a transaction of its own, don't sync the disk for each
+    QSqlQuery query(db);
+    query.exec("PRAGMA journal_mode = WAL");
+    query.exec("PRAGMA synchronous = NORMAL");
+    if (!query.exec("CREATE TABLE IF NOT EXISTS scans ("
+                    "path TEXT PRIMARY KEY, status INTEGER, "
+                    "modified INTEGER, hash BLOB, shapes TEXT, "
+                    "phash INTEGER)")) {
+        error = query.lastError().text();
+        return;
+    }
+
+    // added later, failing if the index has it already
+    query.exec("ALTER TABLE scans ADD COLUMN phash INTEGER");
+
+    // read the whole index at once
+    query.setForwardOnly(true);
+    if (!query.exec(
+            "SELECT path, status, modified, hash, shapes, phash FROM scans")) {
+        error = query.lastError().text();
+        return;
+    }
+    while (query.next()) {
+        ScanRecord record;
+        record.status = (ScanStatus)query.value(1).toInt();
+        record.modified =
+            QDateTime::fromMSecsSinceEpoch(query.value(2).toLongLong());
+        record.hash = query.value(3).toByteArray();
+        record.shapes = shapesFromJson(
+            QJsonDocument::fromJson(query.value(4).toByteArray()).array());
+        record.phash = query.value(5).toULongLong();
+        records[query.value(0).toString()] = record;
+    }
+    open = true;
+}
+
+IndexStore::~IndexStore() {
+    QSqlDatabase::database(connection, false).close();
+    QSqlDatabase::removeDatabase(connection);
+}
+
+// Scans are indexed relative to the index, so a project can be moved
+QString IndexStore::key(const QString &image) const {
+    return QFileInfo(path).absoluteDir().relativeFilePath(
+        QFileInfo(image).absoluteFilePath());
+}
+
+bool IndexStore::find(const QString &image, ScanRecord &record,
+                      bool listed) {
+    error.clear();
+    auto it = records.constFind(key(image));
+    if (it != records.constEnd()) {
+        record = it.value();
+        return true;
+    }
+
+    // import results from before the index existed
+    if (!fallback.find(image, record, listed)) {
+        error = fallback.errorString();
+        return false;
+    }
+    if (!store(image, record))
+        qWarning("Could not import results for %s: %s", qPrintable(image),
+                 qPrintable(error));
+    return true;
+}
+
+bool IndexStore::store(const QString &image, const ScanRecord &record) {
+    error.clear();
+    QSqlQuery query(QSqlDatabase::database(connection, false));
+    query.prepare("INSERT OR REPLACE INTO scans "
+                  "(path, status, modified, hash, shapes, phash) "
+                  "VALUES (?, ?, ?, ?, ?, ?)");
+    query.addBindValue(key(image));
+    query.addBindValue((int)record.status);
+    query.addBindValue(record.modified.toMSecsSinceEpoch());
+    query.addBindValue(record.hash);
+    query.addBindValue(QJsonDocument(shapesToJson(record.shapes))
+                           .toJson(QJsonDocument::Compact));
+    query.addBindValue((qint64)record.phash);
+    if (!query.exec()) {
+        error = query.lastError().text();
+        return false;
+    }
+
+    records[key(image)] = record;
+    return true;
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <QByteArray>
+#include <QDateTime>
+#include <QHash>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QList>
+#include <QPolygon>
+#include <QString>
+
+struct ScanData;
+
+// Progress of a scan through the pipeline, as far as it has been stored
+enum class ScanStatus { Detected = 0, Reviewed = 1, Postprocessed = 2 };
+
+// Stored results of a scan
+struct ScanRecord {
+    QList<QPolygon> shapes;
+    QList<QPolygon> rejects, ungrouped; // only kept until reviewed
+    ScanStatus status = ScanStatus::Reviewed;
+    QDateTime modified;
+    QByteArray hash; // of the scanned image, to drop results when replaced
+    quint64 phash = 0; // perceptual hash, to recognize rescans of it
+};
+
+// Storage of the results of all reviewed scans
+class ResultStore {
+  public:
+    virtual ~ResultStore() {}
+
+    // Look up the results of a scan, returning false if there are none.
+    // `listed` tells whether its .dat file was seen when listing the
+    // directory, which saves probing for it.
+    virtual bool find(const QString &image, ScanRecord &record,
+                      bool listed = true) = 0;
+    virtual bool store(const QString &image, const ScanRecord &record) = 0;
+
+    QString errorString() const { return error; }
+
+  protected:
+    QString error;
+};
+
+// Results stored as JSON, in a .dat file next to every scanned image
+class DatStore : public ResultStore {
+  public:
+    bool find(const QString &image, ScanRecord &record,
+              bool listed = true) override;
+    bool store(const QString &image, const ScanRecord &record) override;
+};
+
+// Results of a whole project in a single SQLite database, read at once when
+// opened. Scans without results in the index fall back to their .dat file,
+// which is then imported.
+class IndexStore : public ResultStore {
+  public:
+    IndexStore(const QString &path);
+    ~IndexStore();
+
+    bool isOpen() const { return open; }
+    bool find(const QString &image, ScanRecord &record,
+              bool listed = true) override;
+    bool store(const QString &image, const ScanRecord &record) override;
+
+  private:
+    QString key(const QString &image) const;
+
+    QString path, connection;
+    bool open = false;
+    QHash<QString, ScanRecord> records;
+    DatStore fallback;
+};
+
+// Shapes as stored in the results
+QList<QPolygon> shapesFromJson(const QJsonArray &json_shapes);
+QJsonArray shapesToJson(const QList<QPolygon> &shapes);
+
+// Results of a previous review, stored next to the scanned image
+QString getResultPath(QString image);
+void fromJson(ScanData *data, QJsonDocument doc);
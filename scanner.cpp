@@ -1,8 +1,10 @@
 #include "scanner.hpp"
 
-#include <QDirIterator>
 #include <QStatusBar>
+#include <QBuffer>
+#include <QCryptographicHash>
 #include <QDebug>
+#include <QFile>
 #include <QImageReader>
 #include <QImageWriter>
 #include <QJsonDocument>
@@ -10,9 +12,18 @@
 #include <QJsonArray>
 #include <QDateTime>
 #include <QMessageBox>
+#include <QSaveFile>
+#include <QTextStream>
+#include <QTimer>
 
+#include <algorithm>
+#include <memory>
+
+#include "archive.hpp"
+#include "bands.hpp"
 #include "detection.hpp"
 #include "postprocessing.hpp"
+#include "trace.hpp"
 
 // Although limited by QThreadPool, don't have too many detection tasks alive
 // to reduce memory usage and allow the postprocess task to run
@@ -20,6 +31,25 @@
 #define DETECTION_PRIORITY 1
 #define POSTPROCESS_PRIORITY 0
 
+// Pages a detection server keeps ready for review. Their images are dropped
+// until requested, so this is only bound by the memory of their shapes.
+#define SERVER_BUFFER 1024
+
+// Longest side of the previews a detection server sends to review clients, in
+// pixels
+#define PREVIEW_SIZE 2000
+
+// Interval at which a review client asks for a page when none was ready, in
+// milliseconds
+#define CLIENT_POLL 2000
+
+// Interval at which scans left to other processes are re-examined, for those
+// handed over to this one, in milliseconds
+#define HANDOVER_POLL 5000
+
+// Interval between writes of the metrics file, in milliseconds
+#define METRICS_INTERVAL 10000
+
 using namespace std;
 
 
@@ -27,218 +57,677 @@ using namespace std;
 // ScanData
 //
 
-ScanData::ScanData(const QString &file) : file(file) {}
-
-void ScanData::load() {
-    if (image.isNull()) {
-        QImageReader reader(file);
-        reader.setAutoTransform(true);
-        image = reader.read();
-        if (image.isNull()) {
-            throw new runtime_error(QString("Cannot load %1: %2")
-                                        .arg(file, reader.errorString())
-                                        .toStdString());
-        }
+// Hash stored archive entries and plain files without copying them
+static bool hashInPlace(QIODevice *device, QByteArray &hash) {
+    if (auto buffer = qobject_cast<QBuffer *>(device)) {
+        hash = QCryptographicHash::hash(buffer->data(),
+                                        QCryptographicHash::Sha1);
+        return true;
     }
+    auto file = qobject_cast<QFile *>(device);
+    uchar *mapping = file ? file->map(0, file->size()) : nullptr;
+    if (!mapping)
+        return false;
+    hash = QCryptographicHash::hash(
+        QByteArray::fromRawData((const char *)mapping, file->size()),
+        QCryptographicHash::Sha1);
+    file->unmap(mapping);
+    return true;
 }
 
-static void fromJson(ScanData *data, QJsonDocument doc) {
-    QJsonObject root = doc.object();
-    QJsonArray json_shapes = root["pictures"].toArray();
-    for (auto json_shape_obj : json_shapes) {
-        auto json_shape = json_shape_obj.toArray();
-        QPolygon shape;
-        for (auto json_shape_obj : json_shape) {
-            auto json_point = json_shape_obj.toObject();
-            shape << QPoint(json_point["x"].toInt(), json_point["y"].toInt());
-        }
-        data->shapes << shape;
+// Hash of a scan as taken when decoding it: mapped pages only hash their own
+// data, other files are hashed whole
+static QByteArray hashScan(const QString &file) {
+    if (auto page = TiffPage::open(file))
+        return page->hash();
+    QString path = file;
+    int number = 1;
+    splitPagePath(file, path, number);
+    std::unique_ptr<QIODevice> device(openFile(path));
+    QByteArray hash;
+    if (device && !hashInPlace(device.get(), hash)) {
+        QCryptographicHash sha1(QCryptographicHash::Sha1);
+        sha1.addData(device.get());
+        hash = sha1.result();
     }
+    return hash;
 }
 
-static QJsonDocument toJson(const ScanData *data) {
-    QJsonArray json_shapes;
-    for (auto shape : data->shapes) {
-        QJsonArray json_shape;
-        for (auto point : shape) {
-            QJsonObject json_point;
-            json_point["x"] = point.x();
-            json_point["y"] = point.y();
-            json_shape << json_point;
-        }
-        json_shapes << json_shape;
-    }
-
-    QJsonObject root;
-    root["pictures"] = json_shapes;
+ScanData::ScanData(const QString &file) : file(file) {}
 
-    QJsonDocument doc;
-    doc.setObject(root);
+void ScanData::load(bool full) {
+    if (full && imageScale != 1) {
+        image = QImage();
+        imageScale = 1;
+    }
+    if (image.isNull()) {
+        TraceSpan span("decode", file);
+        UsageMeter meter(stats.decode);
+
+        // large scans are reduced band by band, never being decoded at once
+        std::unique_ptr<BandReader> bands;
+        if (maxPixels > 0 && !full)
+            bands = BandReader::open(file);
+        if (bands && (qint64)bands->size().width() * bands->size().height() <=
+                         maxPixels)
+            bands.reset();
+
+        // uncompressed TIFF pages are converted straight from the mapped file
+        std::shared_ptr<TiffPage> page = mapped;
+        if (!page && !bands)
+            page = TiffPage::open(file);
+
+        if (bands || page) {
+            image = bands ? bands->reduced(maxPixels, imageScale)
+                          : page->read(page->rect());
+            if (image.isNull())
+                throw new runtime_error(
+                    QString("Cannot load %1").arg(file).toStdString());
+            span.arg("scale", imageScale);
+        } else {
+            QString path = file;
+            int number = 1;
+            splitPagePath(file, path, number);
+            std::unique_ptr<QIODevice> device(openFile(path));
+            if (!device)
+                throw new runtime_error(
+                    QString("Cannot open %1").arg(file).toStdString());
+
+            // devices that can't be hashed in place are read at once, so the
+            // same bytes are hashed and decoded
+            QByteArray bytes;
+            QBuffer buffer(&bytes);
+            QIODevice *input = device.get();
+            if (hash.isEmpty() && !hashInPlace(input, hash)) {
+                bytes = input->readAll();
+                hash = QCryptographicHash::hash(bytes,
+                                                QCryptographicHash::Sha1);
+                buffer.open(QIODevice::ReadOnly);
+                input = &buffer;
+            }
+            QImageReader reader(input);
+            reader.setAutoTransform(true);
+            if (number > 1)
+                reader.jumpToImage(number - 1);
+            image = reader.read();
+            if (image.isNull()) {
+                throw new runtime_error(QString("Cannot load %1: %2")
+                                            .arg(file, reader.errorString())
+                                            .toStdString());
+            }
+            stats.bytes_read += input->size();
+        }
 
-    return doc;
+        // mapped pages are hashed from the mapping, scans reduced band by band
+        // (which are large by definition) aren't, to read them only once
+        if (page) {
+            stats.bytes_read += page->byteCount();
+            if (hash.isEmpty())
+                hash = page->hash();
+        } else if (bands)
+            stats.bytes_read += QFileInfo(file).size();
+        stats.bytes_decoded += image.sizeInBytes();
+        if (phash == 0)
+            phash = perceptualHash(image);
+    }
 }
 
-static QString getResultPath(QFileInfo image_info) {
-    QDir dir(image_info.absolutePath());
-    QFile result(dir.absoluteFilePath(
-        QString("%1.dat").arg(image_info.completeBaseName())));
-    QFileInfo result_info(result);
-    return result_info.absoluteFilePath();
+bool ScanData::map() {
+    if (!mapped)
+        mapped = TiffPage::open(file);
+    return mapped != nullptr;
 }
 
-static QString getResultPath(QString image) {
-    return getResultPath(QFileInfo(image));
+bool ScanData::stream() {
+    if (!streamed && maxPixels > 0) {
+        streamed = BandReader::open(file);
+        if (streamed && (qint64)streamed->size().width() *
+                                streamed->size().height() <=
+                            maxPixels)
+            streamed.reset();
+    }
+    return streamed != nullptr;
 }
 
+void ScanData::encodePreview() {
+    TraceSpan span("encodePreview", file);
+
+    // the image can be a reduced copy of the scan already
+    QImage reduced = image;
+    previewScale = imageScale;
+    int size = qMax(reduced.width(), reduced.height());
+    if (size > previewSize) {
+        double factor = (double)previewSize / size;
+        reduced = reduced.scaled(reduced.size() * factor, Qt::KeepAspectRatio,
+                                 Qt::SmoothTransformation);
+        previewScale *= factor;
+    }
+
+    preview.clear();
+    QBuffer buffer(&preview);
+    buffer.open(QIODevice::WriteOnly);
+    QImageWriter writer(&buffer, "jpeg");
+    writer.write(reduced);
+}
 
 //
 // Scanner
 //
 
-Scanner::Scanner(int &argc, char **argv) : QApplication(argc, argv), start(QDateTime::currentDateTime()) {
+Scanner::Scanner(int &argc, char **argv) : QApplication(argc, argv) {
     QGuiApplication::setApplicationDisplayName("Foto Scanner");
 
 #if defined(_OPENMP)
     pool.setMaxThreadCount(1);
 #endif
+    metrics.setConcurrency(pool.maxThreadCount());
 
     connect(&viewer, SIGNAL(success(ScanData *)), this,
             SLOT(onReviewSuccess(ScanData *)));
     connect(&viewer, SIGNAL(failure(ScanData *, std::exception *)), this,
             SLOT(onReviewFailure(ScanData *, std::exception *)));
+    connect(&enumerator, SIGNAL(found(QString, QStringList, QList<bool>)),
+            this, SLOT(onScansFound(QString, QStringList, QList<bool>)));
+    connect(&enumerator, SIGNAL(finished()), this,
+            SLOT(onEnumerationFinished()));
 
     viewer.show();
 }
 
-int Scanner::scan() {
+void Scanner::scan() {
+    // review clients hand the scans over to the detection server
+    if (client != nullptr) {
+        if (inputDir != QDir())
+            client->submit(QStringList() << inputDir.absolutePath());
+        return;
+    }
+
     if (inputDir == QDir())
         throw runtime_error("No input directory set");
 
-    return scan(inputDir.absolutePath());
+    QString path = inputDir.absolutePath();
+    if (!QFileInfo(path).isDir() && !isArchiveFile(path))
+        throw runtime_error(
+            QString("Unable to handle %1").arg(path).toStdString());
+
+    // scans are fed into the queues directory by directory as they are found
+    enumerator.start(path);
 }
 
-int Scanner::scan(QString path) {
-    QFileInfo finfo(path);
+// Copy stored results into a scan
+static void fromRecord(ScanData *data, const ScanRecord &record) {
+    data->shapes = record.shapes;
+    data->rejects = record.rejects;
+    data->ungrouped = record.ungrouped;
+    data->modified = record.modified;
+    data->hash = record.hash;
+    data->phash = record.phash;
+}
 
-    // file handling: verify extension, check for previous results, add to queue
-    if (finfo.isFile()) {
-        // check file extension
-        const QStringList extensions = {"jpg", "png"};
-        bool match = false;
-        for (auto extension : extensions) {
-            if (QString::compare(finfo.suffix(), extension,
-                                 Qt::CaseInsensitive) == 0) {
-                match = true;
-                break;
-            }
+// Look up the results of a scan, dropping those of a scan replaced since.
+// Only scans modified after their results are hashed again, to tell.
+bool Scanner::findResults(const QString &path, ScanRecord &record,
+                          bool listed) {
+    if (!store->find(path, record, listed))
+        return false;
+    QString file = path;
+    int number = 1;
+    splitPagePath(path, file, number);
+    QFileInfo info(file);
+    if (record.hash.isEmpty() || !record.modified.isValid() ||
+        !info.exists() || info.lastModified() <= record.modified)
+        return true;
+    if (hashScan(path) == record.hash)
+        return true;
+    qWarning().noquote() << "Dropping outdated results of" << path;
+    return false;
+}
+
+// Queue a scan, checking for previous results
+void Scanner::addScan(const QString &path, bool listed) {
+    ScanRecord record;
+    if (findResults(path, record, listed)) {
+        ScanData *data = new ScanData(path);
+        data->maxPixels = detectionOptions.streamPixels;
+        if (server != nullptr)
+            data->previewSize = PREVIEW_SIZE;
+        fromRecord(data, record);
+        if (record.status != ScanStatus::Detected)
+            rememberLayout(data);
+
+        // skip stages other processes take care of
+        bool wanted;
+        if (record.status == ScanStatus::Detected ||
+            mode == ProgramMode::CORRECT_RESULTS)
+            wanted = performs(Stage::Review);
+        else
+            wanted = performs(Stage::Postprocess) &&
+                     !(shared && record.status == ScanStatus::Postprocessed);
+        if (!wanted) {
+            if (shared && mode != ProgramMode::CORRECT_RESULTS &&
+                performsFrom(static_cast<int>(record.status) + 1))
+                elsewhere << path;
+            delete data;
+            return;
         }
-        if (!match)
-            return 0;
-
-        // check if already processed
-        QFile results(getResultPath(finfo));
-        if (results.exists()) {
-            if (results.open(QIODevice::ReadOnly | QIODevice::Text)) {
-                QString json = results.readAll();
-                QJsonDocument doc = QJsonDocument::fromJson(json.toUtf8());
-
-                ScanData *data = new ScanData(path);
-                fromJson(data, doc);
-
-                queueLock.lock();
-                if (mode == ProgramMode::CORRECT_RESULTS)
-                    toReview << data;
-                else
-                    toPostprocess << data;
-                queueLock.unlock();
-            } else {
-                QMessageBox::critical(qobject_cast<QWidget *> (parent()), "Error",
-                                      QString("Could not read results for %1: %2")
-                                      .arg(path)
-                                      .arg(results.errorString()));
-            }
-        } else if (mode != ProgramMode::CORRECT_RESULTS) {
-            queueLock.lock();
-            toDetect << new ScanData(path);
-            queueLock.unlock();
+
+        // pages detected earlier get their preview before a server hands
+        // them out
+        if (server != nullptr && record.status == ScanStatus::Detected) {
+            auto T = new PreviewTask(data);
+            connect(T, SIGNAL(success(ScanData *)), this,
+                    SLOT(onPreviewSuccess(ScanData *)));
+            connect(T, SIGNAL(failure(ScanData *, std::exception *)), this,
+                    SLOT(onPreviewFailure(ScanData *, std::exception *)));
+            pool.start(T, DETECTION_PRIORITY);
+            return;
         }
-        return 1;
 
+        queueLock.lock();
+        if (record.status == ScanStatus::Detected)
+            toReview << data;
+        else if (mode == ProgramMode::CORRECT_RESULTS) {
+            // process the most recently modified one first
+            auto it = upper_bound(toReview.begin(), toReview.end(), data,
+                                  [](const ScanData *a, const ScanData *b) {
+                                      return a->modified > b->modified;
+                                  });
+            toReview.insert(it, data);
+        } else
+            toPostprocess << data;
+        queueLock.unlock();
+    } else if (!store->errorString().isEmpty()) {
+        showError(QString("Could not read results for %1: %2")
+                      .arg(path)
+                      .arg(store->errorString()));
+    } else if (mode != ProgramMode::CORRECT_RESULTS &&
+               performs(Stage::Detection)) {
+        ScanData *data = new ScanData(path);
+        data->maxPixels = detectionOptions.streamPixels;
+        if (server != nullptr)
+            data->previewSize = PREVIEW_SIZE;
+        queueLock.lock();
+        toDetect << data;
+        queueLock.unlock();
+    } else if (shared && mode != ProgramMode::CORRECT_RESULTS &&
+               performsFrom(static_cast<int>(Stage::Detection))) {
+        elsewhere << path;
     }
+}
 
-    // directory handling: recursively scan
-    else if (finfo.isDir()) {
-        size_t files = 0;
-        QDirIterator it(path, QDir::Files, QDirIterator::Subdirectories);
-        while (it.hasNext())
-            files += scan(it.next());
-        return files;
-    }
+bool Scanner::performs(Stage stage) const {
+    return stages[static_cast<int>(stage)];
+}
 
-    else {
-        throw runtime_error(
-            QString("Unable to handle %1").arg(path).toStdString());
+// Whether this process performs the given stage or any later one
+bool Scanner::performsFrom(int stage) const {
+    for (; stage < 3; stage++)
+        if (stages[stage])
+            return true;
+    return false;
+}
+
+// Claim a scan for a stage when sharing the work with other processes, making
+// sure no other process got there first. Scans that can't be claimed are
+// re-examined later, as their current owner may hand them over or crash.
+bool Scanner::claim(ScanData *data, Stage stage) {
+    if (!shared)
+        return true;
+    if (mode != ProgramMode::CORRECT_RESULTS)
+        elsewhere << data->file;
+    if (!leases.acquire(data->file))
+        return false;
+
+    ScanRecord record;
+    bool found = findResults(data->file, record);
+    bool current = false;
+    switch (stage) {
+    case Stage::Detection:
+        current = !found && store->errorString().isEmpty();
+        break;
+    case Stage::Review:
+        current = found && (record.status == ScanStatus::Detected ||
+                            mode == ProgramMode::CORRECT_RESULTS);
+        break;
+    case Stage::Postprocess:
+        current = found && record.status == ScanStatus::Reviewed;
+        break;
+    }
+    if (!current) {
+        leases.release(data->file);
+        return false;
     }
+
+    elsewhere.remove(data->file);
+    if (found)
+        fromRecord(data, record);
+    return true;
 }
 
-void Scanner::setOutputDir(QString dir) { outputDir = QDir(dir); }
+// Hand a scan over to the process performing its next stage, if that's not us
+void Scanner::handOver(ScanData *data, ScanStatus status) {
+    if (!storeResults(data, status))
+        showError(QString("Could not write results for %1: %2")
+                      .arg(data->file)
+                      .arg(store->errorString()));
+    leases.release(data->file);
+    if (performsFrom(static_cast<int>(status) + 1))
+        elsewhere << data->file;
+    delete data;
+}
+
+// Show an error, or log it when running headless
+void Scanner::showError(const QString &message) {
+    if (headless)
+        qWarning("%s", qPrintable(message));
+    else
+        QMessageBox::critical(qobject_cast<QWidget *>(parent()), "Error",
+                              message);
+}
+
+// All scans of a directory, in order so that each page can use the previous
+// as a prior
+void Scanner::onScansFound(QString dir, QStringList scans,
+                           QList<bool> listed) {
+    for (int i = 0; i < scans.size(); i++)
+        if (watcher == nullptr || watcher->claim(scans[i]))
+            addScan(scans[i], listed[i]);
+
+    if (watcher != nullptr)
+        watcher->watch(dir);
+
+    if (!scans.isEmpty())
+        enqueue();
+}
+
+// A new scan was dropped into a watched directory
+void Scanner::onScanAdded(QString path) {
+    addScan(path, true);
+    enqueue();
+}
+
+bool Scanner::setOutput(QString path) {
+    auto output = createSink(path);
+    if (!output->isOpen()) {
+        showError(QString("Could not open output %1: %2")
+                      .arg(path)
+                      .arg(output->errorString()));
+        return false;
+    }
+    sink = std::move(output);
+    return true;
+}
 
 void Scanner::setInputDir(QString dir) { inputDir = QDir(dir); }
 
 void Scanner::setMode(ProgramMode mode) { this->mode = mode; }
 
+bool Scanner::setIndexFile(QString path) {
+    auto index = new IndexStore(path);
+    if (!index->isOpen()) {
+        showError(QString("Could not open index %1: %2")
+                      .arg(path)
+                      .arg(index->errorString()));
+        delete index;
+        return false;
+    }
+    store.reset(index);
+    return true;
+}
+
+void Scanner::setWorker(const QList<Stage> &stages) {
+    headless = shared = true;
+    for (auto stage : {Stage::Detection, Stage::Review, Stage::Postprocess})
+        this->stages[static_cast<int>(stage)] = stages.contains(stage);
+    viewer.hide();
+}
+
+void Scanner::setReviewOnly() {
+    shared = true;
+    stages[static_cast<int>(Stage::Detection)] = false;
+    stages[static_cast<int>(Stage::Postprocess)] = false;
+}
+
+bool Scanner::setServer(QString name) {
+    headless = true;
+    viewer.hide();
+
+    server = new DetectionServer(this);
+    connect(server, SIGNAL(submitted(QString)), this,
+            SLOT(onSubmitted(QString)));
+    connect(server, SIGNAL(pageRequested(MessageSocket *)), this,
+            SLOT(onPageRequested(MessageSocket *)));
+    connect(server, SIGNAL(reviewed(QString, QList<QPolygon>)), this,
+            SLOT(onRemoteReview(QString, QList<QPolygon>)));
+    connect(server, SIGNAL(released(QString)), this,
+            SLOT(onRemoteRelease(QString)));
+
+    if (!server->listen(name)) {
+        qCritical("Could not listen on %s: %s", qPrintable(name),
+                  qPrintable(server->errorString()));
+        return false;
+    }
+    return true;
+}
+
+bool Scanner::setClient(QString name) {
+    stages[static_cast<int>(Stage::Detection)] = false;
+    stages[static_cast<int>(Stage::Postprocess)] = false;
+
+    client = new DetectionClient(this);
+    connect(client, SIGNAL(page(ScanData *)), this,
+            SLOT(onPageReceived(ScanData *)));
+    connect(client, SIGNAL(empty()), this, SLOT(onNoPage()));
+    connect(client, SIGNAL(error(QString)), this,
+            SLOT(onServerError(QString)));
+
+    if (!client->connectToServer(name)) {
+        showError(QString("Could not connect to %1: %2")
+                      .arg(name)
+                      .arg(client->errorString()));
+        return false;
+    }
+    return true;
+}
+
+void Scanner::setWatch(bool enabled) {
+    if (enabled && watcher == nullptr) {
+        watcher = new Watcher(this);
+        connect(watcher, SIGNAL(added(QString)), this,
+                SLOT(onScanAdded(QString)));
+    }
+}
+
+void Scanner::setLayoutPrior(bool enabled) { layoutPrior = enabled; }
+
+void Scanner::setDuplicateDetection(bool enabled) {
+    duplicateDetection = enabled;
+}
+
+void Scanner::setDetectionOptions(const DetectionOptions &options) {
+    detectionOptions = options;
+}
+
+void Scanner::setPostprocessOptions(const PostprocessOptions &options) {
+    postprocessOptions = options;
+}
+
+void Scanner::setMetricsFile(QString path) {
+    metricsFile = path;
+
+    auto timer = new QTimer(this);
+    connect(timer, SIGNAL(timeout()), this, SLOT(writeMetrics()));
+    timer->start(METRICS_INTERVAL);
+
+    // once more when quitting, so the last interval isn't lost
+    connect(this, SIGNAL(aboutToQuit()), this, SLOT(writeMetrics()));
+}
+
+void Scanner::setStatsFile(QString path) { statsFile = path; }
+
+// Print the resources used by all completed scans, and append them to the
+// statistics file if requested
+void Scanner::reportStats() {
+    if (stats.empty())
+        return;
+
+    QTextStream(stderr) << stats.summary();
+    if (!statsFile.isNull() && !stats.appendCsv(statsFile))
+        qWarning("Could not write statistics to %s", qPrintable(statsFile));
+}
+
+bool Scanner::storeResults(ScanData *data, ScanStatus status) {
+    ScanRecord record;
+    record.shapes = data->shapes;
+    record.status = status;
+    // the detection hints are kept until review
+    if (status == ScanStatus::Detected) {
+        record.rejects = data->rejects;
+        record.ungrouped = data->ungrouped;
+    }
+    // post-processing doesn't change the results, so keeps their review time
+    if (status != ScanStatus::Postprocessed || !data->modified.isValid())
+        data->modified = QDateTime::currentDateTime();
+    record.modified = data->modified;
+    record.hash = data->hash;
+    record.phash = data->phash;
+    return store->store(data->file, record);
+}
+
+void Scanner::rememberLayout(const ScanData *data) {
+    QFileInfo finfo(data->file);
+    layouts[finfo.absolutePath()][finfo.fileName()] = data->shapes;
+    if (data->phash != 0)
+        reviewedPages.insert(
+            {data->file, data->hash, data->phash, data->shapes});
+}
+
+// Find the layout of the closest preceding page that has been reviewed
+QList<QPolygon> Scanner::findLayout(const QString &file) {
+    QFileInfo finfo(file);
+    auto dir = layouts.find(finfo.absolutePath());
+    if (dir == layouts.end())
+        return QList<QPolygon>();
+
+    auto it = dir->lowerBound(finfo.fileName());
+    if (it == dir->begin())
+        return QList<QPolygon>();
+    return (--it).value();
+}
+
+static QString formatDuration(double seconds) {
+    if (seconds < 0)
+        return "?";
+    int minutes = (int)(seconds / 60);
+    return QString("%1h %2m").arg(minutes / 60).arg(minutes % 60);
+}
+
 // Enqueue now work for all primary tasks (detect -> review -> post-process)
 void Scanner::enqueue() {
     queueLock.lock();
 
-    // review
-    if (viewer.current() == nullptr && toReview.size() > 0) {
+    // review (pages wait for clients to ask for them on a server)
+    if (client != nullptr && viewer.current() == nullptr && !waiting) {
+        waiting = true;
+        client->requestPage();
+    }
+    while (server == nullptr && viewer.current() == nullptr &&
+           toReview.size() > 0) {
         auto data = toReview.takeFirst();
+        if (!claim(data, Stage::Review)) {
+            delete data;
+            continue;
+        }
+        metrics.started(Stage::Review, data);
         viewer.display(data);
     }
 
     // detection
-    if (toDetect.size() > 0 && toReview.size() < DETECTION_BUFFER) {
-        auto T = new DetectionTask(toDetect.takeFirst());
+    int buffer = server != nullptr ? SERVER_BUFFER : DETECTION_BUFFER;
+    while (toDetect.size() > 0 && toReview.size() < buffer) {
+        auto data = toDetect.takeFirst();
+        if (!claim(data, Stage::Detection)) {
+            delete data;
+            continue;
+        }
+        if (layoutPrior)
+            data->prior = findLayout(data->file);
+        if (duplicateDetection)
+            data->reviewed = reviewedPages;
+        metrics.started(Stage::Detection, data);
+        auto T = new DetectionTask(data, detectionOptions);
+        connect(T, SIGNAL(started(ScanData *)), this,
+                SLOT(onDetectionStarted(ScanData *)));
         connect(T, SIGNAL(success(ScanData *)), this,
                 SLOT(onDetectionSuccess(ScanData *)));
         connect(T, SIGNAL(failure(ScanData *, std::exception *)), this,
                 SLOT(onDetectionFailure(ScanData *, std::exception *)));
         pool.start(T, DETECTION_PRIORITY);
+        if (!workerHasRoom())
+            break;
     }
 
     // postprocess
-    if (toPostprocess.size() > 0) {
-        auto T = new PostprocessTask(toPostprocess.takeFirst());
+    while (toPostprocess.size() > 0) {
+        auto data = toPostprocess.takeFirst();
+        if (!claim(data, Stage::Postprocess)) {
+            delete data;
+            continue;
+        }
+        metrics.started(Stage::Postprocess, data);
+        auto T = new PostprocessTask(data, postprocessOptions);
+        connect(T, SIGNAL(started(ScanData *)), this,
+                SLOT(onPostprocessStarted(ScanData *)));
         connect(T, SIGNAL(success(ScanData *)), this,
                 SLOT(onPostprocessSuccess(ScanData *)));
         connect(T, SIGNAL(failure(ScanData *, std::exception *)), this,
                 SLOT(onPostprocessFailure(ScanData *, std::exception *)));
         pool.start(T, POSTPROCESS_PRIORITY);
+        if (!workerHasRoom())
+            break;
     }
 
-    queueLock.unlock();
-
-    // TODO: this is messy, use a proper ETA estimator instead
-    size_t reviews_remaining = toDetect.size() + toReview.size();
-    auto now = QDateTime::currentDateTime();
-    auto done = start.secsTo(now);
-    auto reviews_done = reviews - reviews_remaining;
-    auto remaining =
-        reviews_done != 0 ? done / reviews_done * reviews_remaining : 0;
-    auto remaining_hours = remaining/3600;
-    auto remaining_minutes = (remaining-3600*remaining_hours)/60;
-
+    // sample the queues while we hold the lock
+    metrics.sample(toDetect.size(), toReview.size(), toPostprocess.size());
     const QString message =
         tr("Remaining work: %1 to detect, %2 to review, %3 to post-process, "
-           "%4 currently active (%5h %6m review remaining)")
+           "%4 currently active (ETA: detection %5, review %6, "
+           "post-processing %7)")
             .arg(toDetect.size())
             .arg(toReview.size())
             .arg(toPostprocess.size())
             .arg(pool.activeThreadCount())
-            .arg(remaining_hours)
-            .arg(remaining_minutes);
+            .arg(formatDuration(metrics.eta(Stage::Detection)))
+            .arg(formatDuration(metrics.eta(Stage::Review)))
+            .arg(formatDuration(metrics.eta(Stage::Postprocess)));
+
+    bool done = headless && enumerated && watcher == nullptr &&
+                server == nullptr && elsewhere.isEmpty() &&
+                toDetect.isEmpty() && toPostprocess.isEmpty() &&
+                metrics.active(Stage::Detection) == 0 &&
+                metrics.active(Stage::Postprocess) == 0;
+
+    queueLock.unlock();
+
     viewer.statusBar()->showMessage(message);
+
+    // workers are done once all work they could claim has been processed, and
+    // no scan is left with other processes that may hand it over
+    if (done)
+        quit();
+}
+
+// Whether a headless worker should start another task right away, rather
+// than waiting for the next one to finish
+bool Scanner::workerHasRoom() const {
+    return headless && metrics.active(Stage::Detection) +
+                               metrics.active(Stage::Postprocess) <
+                           pool.maxThreadCount();
+}
+
+void Scanner::onEnumerationFinished() {
+    enumerated = true;
+    enqueue();
 }
 
 
@@ -247,20 +736,51 @@ void Scanner::enqueue() {
 //
 
 void Scanner::onEventLoopStarted() {
-    // when correcting results, process the most recently modified one first
-    reviews = toDetect.size() + toReview.size();
-    if (mode == ProgramMode::CORRECT_RESULTS) {
-        sort(toReview.begin(), toReview.end(),
-             [](const ScanData *a, const ScanData *b) -> bool {
-                 return QFileInfo(getResultPath(a->file)).lastModified() >
-                        QFileInfo(getResultPath(b->file)).lastModified();
-             });
+    if (shared) {
+        auto timer = new QTimer(this);
+        connect(timer, SIGNAL(timeout()), this, SLOT(onHandOverPoll()));
+        timer->start(HANDOVER_POLL);
     }
+    enqueue();
+}
 
+// Re-examine the scans left to other processes, queueing those that were
+// handed over to this one (or abandoned) in the meantime
+void Scanner::onHandOverPoll() {
+    if (elsewhere.isEmpty())
+        return;
+    QSet<QString> scans;
+    scans.swap(elsewhere);
+    for (auto path : scans)
+        addScan(path, true);
     enqueue();
 }
 
+void Scanner::onDetectionStarted(ScanData *data) {
+    metrics.running(Stage::Detection, data);
+}
+
 void Scanner::onDetectionSuccess(ScanData *data) {
+    metrics.finished(Stage::Detection, data);
+
+    // rescans of reviewed pages take over their review (as recorded in the
+    // trace and statistics)
+    if (!data->duplicateOf.isEmpty()) {
+        finishReview(data);
+        return;
+    }
+
+    if (!performs(Stage::Review)) {
+        handOver(data, ScanStatus::Detected);
+        enqueue();
+        return;
+    }
+
+    // a server only keeps the preview for clients, the image is reloaded for
+    // post-processing
+    if (server != nullptr)
+        data->image = QImage();
+
     queueLock.lock();
     toReview << data;
     queueLock.unlock();
@@ -269,10 +789,12 @@ void Scanner::onDetectionSuccess(ScanData *data) {
 }
 
 void Scanner::onDetectionFailure(ScanData *data, exception *ex) {
-    QMessageBox::critical(qobject_cast<QWidget *> (parent()), "Error",
-                          QString("Detection for %1 failed: %2")
-                          .arg(data->file)
-                          .arg(ex->what()));
+    metrics.finished(Stage::Detection, data, false);
+    leases.release(data->file);
+
+    showError(QString("Detection for %1 failed: %2")
+                  .arg(data->file)
+                  .arg(ex->what()));
 
     delete data;
     delete ex;
@@ -281,19 +803,32 @@ void Scanner::onDetectionFailure(ScanData *data, exception *ex) {
 }
 
 void Scanner::onReviewSuccess(ScanData *data) {
+    metrics.finished(Stage::Review, data);
     viewer.clear();
 
-    QFileInfo finfo(data->file);
-    QFile results(getResultPath(finfo));
-    if (results.open(QIODevice::WriteOnly | QIODevice::Text)) {
-        QTextStream stream(&results);
-        QJsonDocument doc = toJson(data);
-        stream << doc.toJson();
-    } else {
-        QMessageBox::critical(qobject_cast<QWidget *> (parent()), "Error",
-                              QString("Could not write results for %1: %2")
-                              .arg(data->file)
-                              .arg(results.errorString()));
+    if (client != nullptr) {
+        client->review(data);
+        delete data;
+        enqueue();
+        return;
+    }
+    finishReview(data);
+}
+
+// Pass a reviewed scan on to post-processing
+void Scanner::finishReview(ScanData *data) {
+    rememberLayout(data);
+
+    if (!performs(Stage::Postprocess)) {
+        handOver(data, ScanStatus::Reviewed);
+        enqueue();
+        return;
+    }
+
+    if (!storeResults(data, ScanStatus::Reviewed)) {
+        showError(QString("Could not write results for %1: %2")
+                      .arg(data->file)
+                      .arg(store->errorString()));
     }
 
     queueLock.lock();
@@ -304,12 +839,15 @@ void Scanner::onReviewSuccess(ScanData *data) {
 }
 
 void Scanner::onReviewFailure(ScanData *data, exception *ex) {
+    metrics.finished(Stage::Review, data, false);
+    leases.release(data->file);
     viewer.clear();
+    if (client != nullptr)
+        client->release(data);
 
-    QMessageBox::critical(qobject_cast<QWidget *> (parent()), "Error",
-                          QString("Review for %1 failed: %2")
-                          .arg(data->file)
-                          .arg(ex->what()));
+    showError(QString("Review for %1 failed: %2")
+                  .arg(data->file)
+                  .arg(ex->what()));
 
     delete data;
     delete ex;
@@ -317,44 +855,179 @@ void Scanner::onReviewFailure(ScanData *data, exception *ex) {
     enqueue();
 }
 
+void Scanner::onPostprocessStarted(ScanData *data) {
+    metrics.running(Stage::Postprocess, data);
+}
+
 void Scanner::onPostprocessSuccess(ScanData *data) {
-    QImageReader reader(data->file);
-
-    QString relative_input = inputDir.relativeFilePath(data->file);
-    QString output = outputDir.absoluteFilePath(relative_input);
-    QFileInfo finfo(output);
-    for (int i = 0; i < data->photos.size(); ++i) {
-        auto photo = data->photos[i];
-        QDir output_dir(finfo.absolutePath());
-        QFile output_split(
-            output_dir.absoluteFilePath(QString("%1_%2.%3")
-                                            .arg(finfo.completeBaseName())
-                                            .arg(i)
-                                            .arg(finfo.suffix())));
-        QString output_split_path = QFileInfo(output_split).absoluteFilePath();
-        QDir().mkpath(QFileInfo(output_split).absolutePath());
-        QImageWriter writer(output_split_path, reader.format());
-        if (!writer.write(photo)) {
-            QMessageBox::critical(qobject_cast<QWidget *> (parent()), "Error",
-                                  QString("Saving %1 failed: %2")
-                                  .arg(output_split_path)
-                                  .arg(writer.errorString()) );
+    metrics.finished(Stage::Postprocess, data);
+
+    QFileInfo finfo(inputDir.relativeFilePath(data->file));
+    bool saved = true;
+    for (int i = 0; i < data->encoded.size(); ++i) {
+        TraceSpan span("write", data->file);
+        span.arg("photo", i);
+
+        // encoded by the post-processing already, along with reduced copies
+        // named after their size
+        QString name = QString("%1/%2_%3")
+                           .arg(finfo.path())
+                           .arg(scanBaseName(data->file))
+                           .arg(i);
+        QList<QPair<QString, QByteArray>> outputs;
+        outputs << qMakePair(name, data->encoded[i]);
+        for (int j = 0; j < data->reduced.size(); ++j)
+            outputs << qMakePair(
+                QString("%1_%2").arg(name).arg(postprocessOptions.sizes[j]),
+                data->reduced[j][i]);
+
+        for (const auto &output : outputs) {
+            QString path = QDir::cleanPath(
+                QString("%1.%2").arg(output.first).arg(photoSuffix(data->file)));
+            UsageMeter meter(data->stats.write);
+            if (!sink->write(path, output.second)) {
+                showError(QString("Saving %1 failed: %2")
+                              .arg(path)
+                              .arg(sink->errorString()));
+                saved = false;
+                continue;
+            }
+            data->stats.bytes_written += output.second.size();
         }
     }
 
+    // the photos have to be safe before the scan is marked as done
+    if (saved) {
+        UsageMeter meter(data->stats.write);
+        saved = sink->flush();
+        if (!saved)
+            showError(QString("Saving photos of %1 failed: %2")
+                          .arg(data->file)
+                          .arg(sink->errorString()));
+    }
+
+    if (saved && !storeResults(data, ScanStatus::Postprocessed))
+        qWarning("Could not update results for %s: %s",
+                 qPrintable(data->file), qPrintable(store->errorString()));
+
+    stats.add(data->file, data->stats);
+    leases.release(data->file);
     delete data;
 
     enqueue();
 }
 
 void Scanner::onPostprocessFailure(ScanData *data, exception *ex) {
-    QMessageBox::critical(qobject_cast<QWidget *> (parent()), "Error",
-                          QString("Postprocess for %1 failed: %2")
-                          .arg(data->file)
-                          .arg(ex->what()));
+    metrics.finished(Stage::Postprocess, data, false);
+    leases.release(data->file);
+
+    showError(QString("Postprocess for %1 failed: %2")
+                  .arg(data->file)
+                  .arg(ex->what()));
 
     delete data;
     delete ex;
 
     enqueue();
 }
+
+// Write the metrics file, atomically so scrapers never see a partial file
+void Scanner::writeMetrics() {
+    QSaveFile file(metricsFile);
+    if (file.open(QIODevice::WriteOnly | QIODevice::Text)) {
+        file.write(metrics.toPrometheus().toUtf8());
+        if (file.commit())
+            return;
+    }
+    qWarning("Could not write metrics to %s: %s", qPrintable(metricsFile),
+             qPrintable(file.errorString()));
+}
+
+
+//
+// Detection server
+//
+
+// Scans or directories submitted by a client
+void Scanner::onSubmitted(QString path) {
+    if (QFileInfo(path).isDir() || isArchiveFile(path))
+        enumerator.start(path);
+    else if (isScanFile(path)) {
+        for (auto page : scanPages(path))
+            addScan(page, true);
+        enqueue();
+    }
+}
+
+// Pages to review come with their preview, from detection or a PreviewTask
+void Scanner::onPageRequested(MessageSocket *socket) {
+    queueLock.lock();
+    ScanData *data = toReview.isEmpty() ? nullptr : toReview.takeFirst();
+    queueLock.unlock();
+
+    if (data == nullptr) {
+        server->sendEmpty(socket);
+        return;
+    }
+
+    metrics.started(Stage::Review, data);
+    remote[data->file] = data;
+    server->sendPage(socket, data);
+}
+
+void Scanner::onPreviewSuccess(ScanData *data) {
+    queueLock.lock();
+    toReview << data;
+    queueLock.unlock();
+}
+
+void Scanner::onPreviewFailure(ScanData *data, std::exception *ex) {
+    showError(QString("Preview of %1 failed: %2")
+                  .arg(data->file)
+                  .arg(ex->what()));
+    delete data;
+    delete ex;
+}
+
+void Scanner::onRemoteReview(QString file, QList<QPolygon> shapes) {
+    auto data = remote.take(file);
+    if (data == nullptr)
+        return;
+    data->shapes = shapes;
+    onReviewSuccess(data);
+}
+
+// Pages given back, or of a client that went away, are handed out again
+void Scanner::onRemoteRelease(QString file) {
+    auto data = remote.take(file);
+    if (data == nullptr)
+        return;
+    metrics.finished(Stage::Review, data, false);
+
+    queueLock.lock();
+    toReview.prepend(data);
+    queueLock.unlock();
+}
+
+
+//
+// Review client
+//
+
+void Scanner::onPageReceived(ScanData *data) {
+    waiting = false;
+    metrics.started(Stage::Review, data);
+    viewer.display(data);
+}
+
+void Scanner::onNoPage() {
+    waiting = false;
+    QTimer::singleShot(CLIENT_POLL, this, SLOT(onPoll()));
+}
+
+void Scanner::onPoll() { enqueue(); }
+
+void Scanner::onServerError(QString message) {
+    waiting = false;
+    showError(message);
+}
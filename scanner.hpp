@@ -6,27 +6,98 @@
 #include <QImage>
 #include <QDir>
 #include <QDateTime>
+#include <QJsonDocument>
+#include <QHash>
+#include <QMap>
+#include <QSet>
 
 #include "viewer.hpp"
+#include "detection.hpp"
+#include "duplicates.hpp"
+#include "postprocessing.hpp"
+#include "enumerator.hpp"
+#include "leases.hpp"
+#include "server.hpp"
+#include "watcher.hpp"
+#include "metrics.hpp"
+#include "output.hpp"
+#include "results.hpp"
+#include "stats.hpp"
+#include "tiff.hpp"
+#include "bands.hpp"
 
 #include <chrono>
+#include <memory>
 
 enum class ProgramMode { DEFAULT, CORRECT_RESULTS };
 
 struct ScanData {
     QString file;
     QImage image;
+    double imageScale = 1; // of `image` relative to the scan, for previews
     ScanData(const QString &file);
-    void load();
+
+    // Decode the scan into `image`. Scans above `maxPixels` that can be read
+    // in bands are decoded as reduced copy, unless the `full` scan is needed.
+    qint64 maxPixels = 0;
+    void load(bool full = false);
+
+    // scans that can be read region by region (uncompressed TIFF pages) are
+    // mapped rather than loaded for extracting photos, returning false for
+    // other scans
+    std::shared_ptr<TiffPage> mapped;
+    bool map();
+
+    // scans above `maxPixels` that can be read in bands have the regions of
+    // their photos read band by band, rather than being decoded as a whole,
+    // returning false for other scans
+    std::shared_ptr<BandReader> streamed;
+    bool stream();
+
+    // JPEG preview of `image` for review clients of a detection server, at
+    // `previewSize` along its longest side (0 for none), and its scale
+    // relative to the scan
+    int previewSize = 0;
+    QByteArray preview;
+    double previewScale = 1;
+    void encodePreview();
+
+    // shapes of a similar page (eg. the previous one in the same directory),
+    // used to speed up detection
+    QList<QPolygon> prior;
+
+    // reviewed pages this scan may be a rescan of, and the one it turned out
+    // to be, whose review it takes over
+    DuplicateIndex reviewed;
+    QString duplicateOf;
+
+    // per-pass statistics of the adaptive detection
+    QVector<LevelYield> yields;
 
     // result of detection
     // NOTE: `ungrouped` & `shapes` are actually quads (Polygon <: Quad <: Rect)
     QList<QPolygon> rejects, ungrouped, shapes;
 
-    // result of post-processing
+    // result of post-processing, along with the orientation of every photo
+    // when left to be applied by the viewer
     QList<QImage> photos;
+    QVector<Orientation> orientations;
+
+    // regions of the photos cut losslessly out of the scan (null for resampled
+    // ones), and the resulting files
+    QVector<QRect> crops;
+    QVector<QByteArray> encoded;
+
+    // encoded reduced copies of every photo, per size of the post-processing
+    QVector<QVector<QByteArray>> reduced;
 
     std::chrono::milliseconds elapsed = std::chrono::milliseconds::zero();
+    ScanStats stats;
+
+    // bookkeeping of the stored results
+    QDateTime modified;
+    QByteArray hash;
+    quint64 phash = 0; // perceptual hash, computed when decoding the scan
 };
 
 class Scanner : public QApplication {
@@ -34,32 +105,102 @@ class Scanner : public QApplication {
 
   public:
     Scanner(int &argc, char *argv[]);
-    int scan();
-    void setOutputDir(QString dir);
+    void scan();
+    bool setOutput(QString path);
     void setInputDir(QString dir);
     void setMode(ProgramMode);
+    void setWatch(bool);
+    bool setServer(QString name);
+    bool setClient(QString name);
+    void setWorker(const QList<Stage> &stages);
+    void setReviewOnly();
+    bool setIndexFile(QString path);
+    void setLayoutPrior(bool);
+    void setDuplicateDetection(bool);
+    void setDetectionOptions(const DetectionOptions &);
+    void setPostprocessOptions(const PostprocessOptions &);
+    void setMetricsFile(QString path);
+    void setStatsFile(QString path);
+    void reportStats();
 
   public slots:
     void onEventLoopStarted();
 
   private slots:
+    void onScansFound(QString, QStringList, QList<bool>);
+    void onScanAdded(QString);
+    void onEnumerationFinished();
+    void onSubmitted(QString);
+    void onPageRequested(MessageSocket *);
+    void onPreviewSuccess(ScanData *);
+    void onPreviewFailure(ScanData *, std::exception *);
+    void onRemoteReview(QString, QList<QPolygon>);
+    void onRemoteRelease(QString);
+    void onPageReceived(ScanData *);
+    void onNoPage();
+    void onPoll();
+    void onHandOverPoll();
+    void onServerError(QString);
+    void onDetectionStarted(ScanData *);
     void onDetectionSuccess(ScanData *);
     void onDetectionFailure(ScanData *, std::exception *);
     void onReviewSuccess(ScanData *);
     void onReviewFailure(ScanData *, std::exception *);
+    void onPostprocessStarted(ScanData *);
     void onPostprocessSuccess(ScanData *);
     void onPostprocessFailure(ScanData *, std::exception *);
+    void writeMetrics();
 
   private:
-    int scan(QString);
+    bool findResults(const QString &path, ScanRecord &record,
+                     bool listed = true);
+    void addScan(const QString &path, bool listed);
+    bool performs(Stage) const;
+    bool performsFrom(int stage) const;
+    bool claim(ScanData *, Stage);
+    void handOver(ScanData *, ScanStatus);
+    bool workerHasRoom() const;
+    void showError(const QString &message);
     void enqueue();
+    bool storeResults(ScanData *, ScanStatus);
+    void finishReview(ScanData *);
+    void rememberLayout(const ScanData *);
+    QList<QPolygon> findLayout(const QString &file);
 
     Viewer viewer;
+    Enumerator enumerator;
+    bool enumerated = false;
+    Watcher *watcher = nullptr;
+
+    // detection as a service: pages out for review on a server, or whether a
+    // client is waiting for a page
+    DetectionServer *server = nullptr;
+    QHash<QString, ScanData *> remote;
+    DetectionClient *client = nullptr;
+    bool waiting = false;
 
     ProgramMode mode = ProgramMode::DEFAULT;
 
+    // stages performed by this process, and whether the others are performed
+    // by other processes sharing the work through leases
+    bool stages[3] = {true, true, true};
+    bool shared = false, headless = false;
+    Leases leases;
+
+    // scans whose next stage is up to other processes, or that are claimed by
+    // one, which may still be handed over to this process
+    QSet<QString> elsewhere;
+
+    bool layoutPrior = true;
+    DetectionOptions detectionOptions;
+    PostprocessOptions postprocessOptions;
+
+    // results of reviews, in .dat files unless a project index is used
+    std::unique_ptr<ResultStore> store =
+        std::unique_ptr<ResultStore>(new DatStore);
+
     QDir inputDir;
-    QDir outputDir = QDir::current();
+    std::unique_ptr<OutputSink> sink = createSink(QDir::currentPath());
 
     QThreadPool pool;
     QMutex queueLock;
@@ -67,6 +208,16 @@ class Scanner : public QApplication {
     QList<ScanData *> toReview;
     QList<ScanData *> toPostprocess;
 
-    QDateTime start;
-    size_t reviews;
+    // reviewed shapes, per directory and file name
+    QHash<QString, QMap<QString, QList<QPolygon>>> layouts;
+
+    // reviewed pages by file, to recognize rescans of
+    bool duplicateDetection = true;
+    DuplicateIndex reviewedPages;
+
+    Metrics metrics;
+    QString metricsFile;
+
+    StatsReport stats;
+    QString statsFile;
 };
@@ -0,0 +1,207 @@
+#include "server.hpp"
+
+#include <QDataStream>
+#include <QJsonArray>
+#include <QJsonDocument>
+
+#include "results.hpp"
+#include "scanner.hpp"
+
+// Largest message accepted, as protection against garbage on the socket
+#define MAX_MESSAGE (64 << 20)
+
+
+//
+// MessageSocket
+//
+
+MessageSocket::MessageSocket(QLocalSocket *socket, QObject *parent)
+    : QObject(parent), sock(socket) {
+    connect(sock, SIGNAL(readyRead()), this, SLOT(onReadyRead()));
+}
+
+void MessageSocket::send(const QString &type, QJsonObject message) {
+    message["type"] = type;
+    QByteArray json = QJsonDocument(message).toJson(QJsonDocument::Compact);
+
+    QByteArray length;
+    QDataStream(&length, QIODevice::WriteOnly) << (quint32)json.size();
+    sock->write(length + json);
+}
+
+void MessageSocket::onReadyRead() {
+    buffer += sock->readAll();
+
+    while (buffer.size() >= 4) {
+        quint32 length;
+        QDataStream(buffer) >> length;
+        if (length > MAX_MESSAGE) {
+            qWarning("Dropping connection after a message of %u bytes",
+                     length);
+            sock->abort();
+            return;
+        }
+        if ((quint32)buffer.size() < 4 + length)
+            return;
+
+        QJsonObject message = QJsonDocument::fromJson(buffer.mid(4, length))
+                                  .object();
+        buffer.remove(0, 4 + length);
+        emit received(message);
+    }
+}
+
+
+//
+// DetectionServer
+//
+
+DetectionServer::DetectionServer(QObject *parent) : QObject(parent) {
+    connect(&server, SIGNAL(newConnection()), this, SLOT(onNewConnection()));
+}
+
+bool DetectionServer::listen(const QString &name) {
+    // take over the socket of a previous instance that didn't shut down
+    QLocalServer::removeServer(name);
+    return server.listen(name);
+}
+
+void DetectionServer::onNewConnection() {
+    while (auto socket = server.nextPendingConnection()) {
+        auto client = new MessageSocket(socket, this);
+        outstanding[client];
+        connect(client, SIGNAL(received(QJsonObject)), this,
+                SLOT(onReceived(QJsonObject)));
+        connect(socket, SIGNAL(disconnected()), this, SLOT(onDisconnected()));
+    }
+}
+
+void DetectionServer::onReceived(QJsonObject message) {
+    auto client = qobject_cast<MessageSocket *>(sender());
+    QString type = message["type"].toString();
+    QString file = message["file"].toString();
+
+    if (type == "submit") {
+        for (auto file : message["files"].toArray())
+            emit submitted(file.toString());
+    } else if (type == "next") {
+        emit pageRequested(client);
+    } else if (type == "review" && outstanding[client].removeOne(file)) {
+        emit reviewed(file, shapesFromJson(message["shapes"].toArray()));
+    } else if (type == "release" && outstanding[client].removeOne(file)) {
+        emit released(file);
+    } else {
+        QJsonObject error;
+        error["message"] = QString("Unexpected %1 message").arg(type);
+        client->send("error", error);
+    }
+}
+
+// Pages of a client that went away are handed out again
+void DetectionServer::onDisconnected() {
+    auto socket = qobject_cast<QLocalSocket *>(sender());
+    for (auto client : outstanding.keys()) {
+        if (client->socket() != socket)
+            continue;
+        for (auto file : outstanding.take(client))
+            emit released(file);
+        client->deleteLater();
+        socket->deleteLater();
+    }
+}
+
+void DetectionServer::sendPage(MessageSocket *client, ScanData *data) {
+    QJsonObject message;
+    message["file"] = data->file;
+    message["rejects"] = shapesToJson(data->rejects);
+    message["ungrouped"] = shapesToJson(data->ungrouped);
+    message["shapes"] = shapesToJson(data->shapes);
+    message["preview"] = QString::fromLatin1(data->preview.toBase64());
+    message["scale"] = data->previewScale;
+    client->send("page", message);
+
+    outstanding[client] << data->file;
+}
+
+void DetectionServer::sendEmpty(MessageSocket *client) {
+    client->send("empty");
+}
+
+
+//
+// PreviewTask
+//
+
+void PreviewTask::run() {
+    try {
+        data->load();
+    } catch (std::exception *ex) {
+        emit failure(data, ex);
+        return;
+    }
+    data->encodePreview();
+    data->image = QImage();
+    emit success(data);
+}
+
+
+//
+// DetectionClient
+//
+
+DetectionClient::DetectionClient(QObject *parent)
+    : QObject(parent), socket(new MessageSocket(new QLocalSocket(this), this)) {
+    connect(socket, SIGNAL(received(QJsonObject)), this,
+            SLOT(onReceived(QJsonObject)));
+    connect(socket->socket(), SIGNAL(disconnected()), this,
+            SLOT(onDisconnected()));
+}
+
+bool DetectionClient::connectToServer(const QString &name) {
+    socket->socket()->connectToServer(name);
+    return socket->socket()->waitForConnected();
+}
+
+void DetectionClient::submit(const QStringList &files) {
+    QJsonObject message;
+    message["files"] = QJsonArray::fromStringList(files);
+    socket->send("submit", message);
+}
+
+void DetectionClient::requestPage() { socket->send("next"); }
+
+void DetectionClient::review(const ScanData *data) {
+    QJsonObject message;
+    message["file"] = data->file;
+    message["shapes"] = shapesToJson(data->shapes);
+    socket->send("review", message);
+}
+
+void DetectionClient::release(const ScanData *data) {
+    QJsonObject message;
+    message["file"] = data->file;
+    socket->send("release", message);
+}
+
+void DetectionClient::onReceived(QJsonObject message) {
+    QString type = message["type"].toString();
+    if (type == "page") {
+        auto data = new ScanData(message["file"].toString());
+        data->image = QImage::fromData(
+            QByteArray::fromBase64(message["preview"].toString().toLatin1()),
+            "jpeg");
+        data->imageScale = message["scale"].toDouble(1);
+        data->rejects = shapesFromJson(message["rejects"].toArray());
+        data->ungrouped = shapesFromJson(message["ungrouped"].toArray());
+        data->shapes = shapesFromJson(message["shapes"].toArray());
+        emit page(data);
+    } else if (type == "empty") {
+        emit empty();
+    } else {
+        emit error(message["message"].toString());
+    }
+}
+
+void DetectionClient::onDisconnected() {
+    emit error("Lost the connection to the detection server");
+}
@@ -0,0 +1,123 @@
+#pragma once
+
+#include <QHash>
+#include <QImage>
+#include <QJsonObject>
+#include <QList>
+#include <QLocalServer>
+#include <QLocalSocket>
+#include <QObject>
+#include <QPolygon>
+#include <QRunnable>
+#include <QStringList>
+
+struct ScanData;
+
+// Detection as a service: a long-running process detects scans and hands them
+// out for review to thin clients, over a local socket. Messages are JSON
+// objects, each preceded by its length as a 32-bit big-endian integer:
+//
+//   submit  {"files": [...]}            queue scans for detection
+//   next    {}                          ask for a detected page, answered by
+//                                       "page" or "empty"
+//   page    {"file", "rejects", "ungrouped", "shapes", "preview", "scale"}
+//                                       shapes in scan coordinates, along with
+//                                       a JPEG preview scaled by `scale`
+//   review  {"file", "shapes"}          reviewed shapes of a page
+//   release {"file"}                    give a page back without review
+//   error   {"message"}
+//
+// Each message has its name in the "type" field.
+
+// Reading and writing messages on a socket
+class MessageSocket : public QObject {
+    Q_OBJECT
+
+  public:
+    MessageSocket(QLocalSocket *socket, QObject *parent = nullptr);
+
+    QLocalSocket *socket() const { return sock; }
+    void send(const QString &type, QJsonObject message = QJsonObject());
+
+  signals:
+    void received(QJsonObject message);
+
+  private slots:
+    void onReadyRead();
+
+  private:
+    QLocalSocket *sock;
+    QByteArray buffer;
+};
+
+class DetectionServer : public QObject {
+    Q_OBJECT
+
+  public:
+    DetectionServer(QObject *parent = nullptr);
+    bool listen(const QString &name);
+    QString errorString() const { return server.errorString(); }
+
+    void sendPage(MessageSocket *client, ScanData *data);
+    void sendEmpty(MessageSocket *client);
+
+  signals:
+    void submitted(QString file);
+    void pageRequested(MessageSocket *client);
+    void reviewed(QString file, QList<QPolygon> shapes);
+    void released(QString file);
+
+  private slots:
+    void onNewConnection();
+    void onReceived(QJsonObject message);
+    void onDisconnected();
+
+  private:
+    QLocalServer server;
+
+    // pages out for review, per client
+    QHash<MessageSocket *, QStringList> outstanding;
+};
+
+// Loads a page detected by an earlier run and encodes its preview, so that it
+// is ready to be handed out
+class PreviewTask : public QObject, public QRunnable {
+    Q_OBJECT
+
+  public:
+    PreviewTask(ScanData *data) : data(data) {}
+    void run();
+
+  signals:
+    void success(ScanData *);
+    void failure(ScanData *, std::exception *);
+
+  private:
+    ScanData *data;
+};
+
+class DetectionClient : public QObject {
+    Q_OBJECT
+
+  public:
+    DetectionClient(QObject *parent = nullptr);
+    bool connectToServer(const QString &name);
+    QString errorString() const { return socket->socket()->errorString(); }
+
+    void submit(const QStringList &files);
+    void requestPage();
+    void review(const ScanData *data);
+    void release(const ScanData *data);
+
+  signals:
+    void page(ScanData *data);
+    void empty();
+    void error(QString message);
+
+  private slots:
+    void onReceived(QJsonObject message);
+    void onDisconnected();
+
+  private:
+    MessageSocket *socket;
+};
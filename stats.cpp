@@ -0,0 +1,210 @@
+#include "stats.hpp"
+
+#include <QFile>
+#include <QStringList>
+#include <QTextStream>
+
+#include <algorithm>
+
+#if defined(Q_OS_UNIX)
+#include <sys/resource.h>
+#include <time.h>
+#endif
+
+using namespace std;
+
+
+//
+// Sampling
+//
+
+#if defined(Q_OS_UNIX)
+static double seconds(const timeval &tv) {
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+#endif
+
+// CPU time of a step. With OpenMP, steps spread their work over OpenMP's own
+// threads, but then the pool runs a single task at a time, so the CPU time of
+// the whole process is a fair approximation. Otherwise it is the time of the
+// calling thread, which runs the step on its own.
+static double cpuTime() {
+#if defined(Q_OS_UNIX) && defined(_OPENMP)
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return seconds(usage.ru_utime) + seconds(usage.ru_stime);
+#elif defined(Q_OS_UNIX)
+    timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+#else
+    return 0;
+#endif
+}
+
+// Peak resident set size of the process over its lifetime, in bytes
+static size_t peakRss() {
+#if defined(Q_OS_UNIX)
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return (size_t)usage.ru_maxrss * 1024;
+#else
+    return 0;
+#endif
+}
+
+// Linux lets the peak resident set size be reset, so it can be sampled per
+// step; elsewhere, it is the peak over the lifetime of the process
+static void resetPeakRss() {
+#if defined(Q_OS_LINUX)
+    QFile refs("/proc/self/clear_refs");
+    if (refs.open(QIODevice::WriteOnly))
+        refs.write("5");
+#endif
+}
+
+// Peak resident set size of the process since the last reset, in bytes
+static size_t currentPeakRss() {
+#if defined(Q_OS_LINUX)
+    QFile status("/proc/self/status");
+    if (status.open(QIODevice::ReadOnly | QIODevice::Text)) {
+        for (QByteArray line = status.readLine(); !line.isEmpty();
+             line = status.readLine())
+            if (line.startsWith("VmHWM:"))
+                return line.mid(6).trimmed().split(' ').first().toULongLong() *
+                       1024;
+    }
+#endif
+    return peakRss();
+}
+
+UsageMeter::UsageMeter(Usage &usage) : usage(usage), start(cpuTime()) {
+    resetPeakRss();
+}
+
+void UsageMeter::stop() {
+    if (!running)
+        return;
+    running = false;
+
+    usage.cpu += cpuTime() - start;
+    usage.peak_rss = max(usage.peak_rss, currentPeakRss());
+}
+
+
+//
+// Report
+//
+
+void StatsReport::add(const QString &file, const ScanStats &stats) {
+    scans << qMakePair(file, stats);
+}
+
+static const struct {
+    const char *name;
+    Usage ScanStats::*usage;
+} steps[] = {{"decode", &ScanStats::decode},
+             {"detect", &ScanStats::detect},
+             {"postprocess", &ScanStats::postprocess},
+             {"encode", &ScanStats::encode},
+             {"write", &ScanStats::write}};
+
+static const struct {
+    const char *name;
+    size_t ScanStats::*count;
+} counters[] = {{"bytes_read", &ScanStats::bytes_read},
+                {"bytes_decoded", &ScanStats::bytes_decoded},
+                {"bytes_encoded", &ScanStats::bytes_encoded},
+                {"bytes_written", &ScanStats::bytes_written},
+                {"contours", &ScanStats::contours},
+                {"candidates", &ScanStats::candidates},
+                {"shapes", &ScanStats::shapes},
+                {"passes", &ScanStats::passes},
+                {"rescans", &ScanStats::rescans}};
+
+static QString megabytes(double bytes) {
+    return QString::number(bytes / (1 << 20), 'f', 1);
+}
+
+// A row of the summary table, with a left aligned label
+static QString row(const QString &label, const QStringList &cells) {
+    QString line = label.leftJustified(12);
+    for (auto &cell : cells)
+        line += cell.rightJustified(14);
+    return line + "\n";
+}
+
+QString StatsReport::summary() const {
+    int n = scans.size();
+    QString text = QString("Resources used by %1 scans:\n").arg(n);
+
+    text += QString("Peak RSS: %1 MB\n").arg(megabytes(peakRss()));
+
+    text += row("step", QStringList() << "CPU total s"
+                                      << "CPU/scan ms"
+                                      << "peak RSS MB");
+    for (auto &step : steps) {
+        double cpu = 0;
+        size_t rss = 0;
+        for (auto &scan : scans) {
+            cpu += (scan.second.*step.usage).cpu;
+            rss = max(rss, (scan.second.*step.usage).peak_rss);
+        }
+        text += row(step.name,
+                    QStringList() << QString::number(cpu, 'f', 2)
+                                  << QString::number(n ? 1000 * cpu / n : 0,
+                                                     'f', 1)
+                                  << megabytes(rss));
+    }
+
+    text += row("counter", QStringList() << "total"
+                                         << "per scan");
+    for (auto &counter : counters) {
+        double total = 0;
+        for (auto &scan : scans)
+            total += scan.second.*counter.count;
+        double mean = n ? total / n : 0;
+
+        QString name(counter.name);
+        if (name.startsWith("bytes_"))
+            text += row(name.mid(6) + " MB", QStringList()
+                                                 << megabytes(total)
+                                                 << megabytes(mean));
+        else
+            text += row(name, QStringList() << QString::number(total, 'f', 0)
+                                            << QString::number(mean, 'f', 1));
+    }
+
+    return text;
+}
+
+bool StatsReport::appendCsv(const QString &path) const {
+    QFile file(path);
+    if (!file.open(QIODevice::Append | QIODevice::Text))
+        return false;
+
+    QTextStream stream(&file);
+    if (file.size() == 0) {
+        stream << "file";
+        for (auto &step : steps)
+            stream << "," << step.name << "_cpu_s," << step.name
+                   << "_peak_rss";
+        for (auto &counter : counters)
+            stream << "," << counter.name;
+        stream << "\n";
+    }
+
+    for (auto &scan : scans) {
+        QString name = scan.first;
+        stream << "\"" << name.replace("\"", "\"\"") << "\"";
+        for (auto &step : steps)
+            stream << "," << (scan.second.*step.usage).cpu << ","
+                   << (qulonglong)(scan.second.*step.usage).peak_rss;
+        for (auto &counter : counters)
+            stream << "," << (qulonglong)(scan.second.*counter.count);
+        stream << "\n";
+    }
+
+    stream.flush();
+    return file.error() == QFile::NoError;
+}
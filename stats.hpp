@@ -0,0 +1,60 @@
+#pragma once
+
+#include <QList>
+#include <QPair>
+#include <QString>
+
+// CPU time and memory used by a processing step of a single scan
+struct Usage {
+    double cpu = 0;      // seconds
+    size_t peak_rss = 0; // bytes, peak of the whole process during the step
+};
+
+// Resource accounting of a single scan, for capacity planning
+struct ScanStats {
+    Usage decode, detect, postprocess, encode, write;
+
+    size_t bytes_read = 0, bytes_decoded = 0;
+    size_t bytes_encoded = 0, bytes_written = 0;
+
+    // shapes remaining after every detection step
+    size_t contours = 0, candidates = 0, shapes = 0;
+
+    // adaptive threshold passes run before they stopped yielding new shapes
+    size_t passes = 0;
+
+    // 1 for a rescan of a reviewed page, which took over its review
+    size_t rescans = 0;
+};
+
+// Adds the CPU time spent until it goes out of scope to a step, along with
+// the peak RSS in the meantime
+class UsageMeter {
+  public:
+    UsageMeter(Usage &usage);
+    ~UsageMeter() { stop(); }
+
+    // Stop early, before handing the scan over to another thread
+    void stop();
+
+  private:
+    Usage &usage;
+    double start;
+    bool running = true;
+};
+
+// Statistics of all completed scans
+class StatsReport {
+  public:
+    void add(const QString &file, const ScanStats &stats);
+    bool empty() const { return scans.isEmpty(); }
+
+    // Human readable summary table, along with the peak RSS of the process
+    QString summary() const;
+
+    // Append a row per scan to a CSV file, writing a header if it is new
+    bool appendCsv(const QString &path) const;
+
+  private:
+    QList<QPair<QString, ScanStats>> scans;
+};
@@ -0,0 +1,331 @@
+#include "tiff.hpp"
+
+#include <QCryptographicHash>
+#include <QFileInfo>
+#include <QSet>
+#include <QtEndian>
+
+#include <opencv2/core/core.hpp>
+
+using namespace cv;
+
+// Pages followed through a file at most, against corrupt directory chains
+#define TIFF_MAX_PAGES 10000
+
+
+//
+// Paths
+//
+
+bool isTiffFile(const QString &name) {
+    return name.endsWith(".tif", Qt::CaseInsensitive) ||
+           name.endsWith(".tiff", Qt::CaseInsensitive);
+}
+
+bool splitPagePath(const QString &path, QString &file, int &page) {
+    int hash = path.lastIndexOf('#');
+    if (hash < 0 || !isTiffFile(path.left(hash)))
+        return false;
+    bool ok;
+    page = path.mid(hash + 1).toInt(&ok);
+    if (!ok || page < 2)
+        return false;
+    file = path.left(hash);
+    return true;
+}
+
+QString scanBaseName(const QString &path) {
+    QString file;
+    int page;
+    if (splitPagePath(path, file, page))
+        return QString("%1-%2")
+            .arg(QFileInfo(file).completeBaseName())
+            .arg(page);
+    return QFileInfo(path).completeBaseName();
+}
+
+
+//
+// File structure
+//
+
+// Layout of a mapped TIFF file, which is either classic TIFF or BigTIFF (with
+// 64-bit offsets), in either byte order
+struct Structure {
+    const uchar *data;
+    qint64 size;
+    bool bigEndian, big;
+
+    // Unsigned number of 1 to 8 bytes, or 0 outside of the file
+    quint64 number(quint64 offset, int length) const {
+        if (offset + length > (quint64)size)
+            return 0;
+        const uchar *p = data + offset;
+        switch (length) {
+        case 1:
+            return *p;
+        case 2:
+            return bigEndian ? qFromBigEndian<quint16>(p)
+                             : qFromLittleEndian<quint16>(p);
+        case 4:
+            return bigEndian ? qFromBigEndian<quint32>(p)
+                             : qFromLittleEndian<quint32>(p);
+        default:
+            return bigEndian ? qFromBigEndian<quint64>(p)
+                             : qFromLittleEndian<quint64>(p);
+        }
+    }
+    quint64 offset(quint64 at) const { return number(at, big ? 8 : 4); }
+
+    // Offset of the first image file directory, or 0 if this isn't a TIFF file
+    quint64 first() {
+        if (size < 16)
+            return 0;
+        if (data[0] == 'I' && data[1] == 'I')
+            bigEndian = false;
+        else if (data[0] == 'M' && data[1] == 'M')
+            bigEndian = true;
+        else
+            return 0;
+
+        quint64 version = number(2, 2);
+        if (version != 42 && version != 43)
+            return 0;
+        big = version == 43;
+        return offset(big ? 8 : 4);
+    }
+
+    // Offset of the directory after another, or 0 after the last one
+    quint64 next(quint64 directory) const {
+        quint64 entries = number(directory, big ? 8 : 2);
+        return offset(directory + (big ? 8 : 2) + entries * (big ? 20 : 12));
+    }
+
+    // Values of a field of a directory, empty if it is missing
+    QVector<quint64> field(quint64 directory, int tag) const {
+        QVector<quint64> values;
+        quint64 entries = number(directory, big ? 8 : 2);
+        quint64 entry = directory + (big ? 8 : 2);
+        for (quint64 i = 0; i < entries; i++, entry += big ? 20 : 12) {
+            if (number(entry, 2) != (quint64)tag)
+                continue;
+
+            int length;
+            switch (number(entry + 2, 2)) {
+            case 1: // BYTE
+                length = 1;
+                break;
+            case 3: // SHORT
+                length = 2;
+                break;
+            case 4: // LONG
+                length = 4;
+                break;
+            case 16: // LONG8
+                length = 8;
+                break;
+            default:
+                return values;
+            }
+            quint64 count = number(entry + 4, big ? 8 : 4);
+            if (count > (quint64)size / length)
+                return values;
+
+            // stored in the entry itself if they fit
+            quint64 value = entry + (big ? 12 : 8);
+            if (count * length > (big ? 8u : 4u))
+                value = offset(value);
+            if (value + count * length > (quint64)size)
+                return values;
+
+            values.resize(count);
+            for (quint64 j = 0; j < count; j++)
+                values[j] = number(value + j * length, length);
+            return values;
+        }
+        return values;
+    }
+
+    // Single value of a field, or a default if it is missing
+    quint64 value(quint64 directory, int tag, quint64 fallback) const {
+        QVector<quint64> values = field(directory, tag);
+        return values.isEmpty() ? fallback : values[0];
+    }
+
+    // Offsets of all image file directories
+    QVector<quint64> directories() {
+        QVector<quint64> found;
+        QSet<quint64> seen;
+        for (quint64 directory = first();
+             directory != 0 && found.size() < TIFF_MAX_PAGES &&
+             !seen.contains(directory);
+             directory = next(directory)) {
+            found << directory;
+            seen << directory;
+        }
+        return found;
+    }
+};
+
+QStringList scanPages(const QString &path) {
+    QStringList pages(path);
+    if (!isTiffFile(path))
+        return pages;
+
+    // only the directories are read from the mapping
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly) || file.size() == 0)
+        return pages;
+    const uchar *data = file.map(0, file.size());
+    if (data == nullptr)
+        return pages;
+
+    Structure tiff = {data, file.size(), false, false};
+    int count = tiff.directories().size();
+    for (int page = 2; page <= count; page++)
+        pages << QString("%1#%2").arg(path).arg(page);
+    return pages;
+}
+
+
+//
+// TiffPage
+//
+
+std::unique_ptr<TiffPage> TiffPage::open(const QString &path) {
+    QString file = path;
+    int page = 1;
+    if (!splitPagePath(path, file, page) && !isTiffFile(path))
+        return nullptr;
+
+    std::unique_ptr<TiffPage> tiff(new TiffPage(file));
+    if (!tiff->file.open(QIODevice::ReadOnly) || tiff->file.size() == 0)
+        return nullptr;
+    tiff->size = tiff->file.size();
+    tiff->data = tiff->file.map(0, tiff->size);
+    if (tiff->data == nullptr || !tiff->readDirectory(page))
+        return nullptr;
+    return tiff;
+}
+
+bool TiffPage::readDirectory(int page) {
+    Structure tiff = {data, size, false, false};
+    QVector<quint64> directories = tiff.directories();
+    if (page > directories.size())
+        return false;
+    quint64 directory = directories[page - 1];
+    bigEndian = tiff.bigEndian;
+
+    // uncompressed, interleaved samples of 8 or 16 bits, in the orientation
+    // they are shown in
+    width = tiff.value(directory, 256, 0);
+    height = tiff.value(directory, 257, 0);
+    samples = tiff.value(directory, 277, 1);
+    int photometric = tiff.value(directory, 262, 0);
+    gray = photometric == 1;
+    if (width <= 0 || height <= 0 || samples < 1 ||
+        tiff.value(directory, 259, 1) != 1 ||
+        tiff.value(directory, 284, 1) != 1 ||
+        tiff.value(directory, 274, 1) != 1 ||
+        tiff.value(directory, 339, 1) != 1 ||
+        !(gray || (photometric == 2 && samples >= 3)))
+        return false;
+    QVector<quint64> bits = tiff.field(directory, 258);
+    if (bits.isEmpty())
+        bits << 1;
+    for (auto sample_bits : bits)
+        if (sample_bits != bits[0])
+            return false;
+    if (bits[0] != 8 && bits[0] != 16)
+        return false;
+    bytes = bits[0] / 8;
+
+    // tiles, or strips spanning the width of the page
+    if (tiff.value(directory, 322, 0) != 0) {
+        chunkWidth = tiff.value(directory, 322, 0);
+        chunkHeight = tiff.value(directory, 323, 0);
+        offsets = tiff.field(directory, 324);
+        counts = tiff.field(directory, 325);
+    } else {
+        chunkWidth = width;
+        chunkHeight = qMin<quint64>(tiff.value(directory, 278, height), height);
+        offsets = tiff.field(directory, 273);
+        counts = tiff.field(directory, 279);
+    }
+    if (chunkWidth <= 0 || chunkHeight <= 0)
+        return false;
+
+    // every strip or tile has to be complete, so reading needs no checks
+    int across = (width + chunkWidth - 1) / chunkWidth;
+    int down = (height + chunkHeight - 1) / chunkHeight;
+    if (offsets.size() < across * down || counts.size() < across * down)
+        return false;
+    bool strips = chunkWidth == width;
+    for (int i = 0; i < across * down; i++) {
+        int rows = strips ? qMin(chunkHeight, height - i * chunkHeight)
+                          : chunkHeight;
+        quint64 needed = (quint64)rows * chunkWidth * samples * bytes;
+        if (counts[i] < needed || offsets[i] + needed > (quint64)size)
+            return false;
+    }
+    return true;
+}
+
+qint64 TiffPage::byteCount() const {
+    qint64 count = 0;
+    for (auto chunk : counts)
+        count += chunk;
+    return count;
+}
+
+QByteArray TiffPage::hash() const {
+    // only the strips or tiles of this page, as far as they are mapped
+    QCryptographicHash hash(QCryptographicHash::Sha1);
+    for (int i = 0; i < offsets.size() && i < counts.size(); i++) {
+        if (offsets[i] >= (quint64)size)
+            continue;
+        quint64 count = qMin(counts[i], (quint64)size - offsets[i]);
+        hash.addData((const char *)data + offsets[i], (int)count);
+    }
+    return hash.result();
+}
+
+QImage TiffPage::read(const QRect &region) const {
+    QRect area = region & rect();
+    QImage image(area.size(), QImage::Format_RGB32);
+    if (image.isNull())
+        return image;
+    image.fill(0xffffffff);
+    Mat to_image(area.height(), area.width(), CV_8UC4, image.bits(),
+                 image.bytesPerLine());
+
+    // samples are picked by their most significant byte, which narrows 16-bit
+    // samples in the same pass as the conversion to BGRX
+    int high = bytes == 2 && !bigEndian ? 1 : 0;
+    int red = high, green = (gray ? 0 : bytes) + high,
+        blue = (gray ? 0 : 2 * bytes) + high;
+    const int pairs[] = {blue, 0, green, 1, red, 2};
+
+    int across = (width + chunkWidth - 1) / chunkWidth;
+    for (int y = area.top() / chunkHeight; y <= area.bottom() / chunkHeight;
+         y++) {
+        for (int x = area.left() / chunkWidth; x <= area.right() / chunkWidth;
+             x++) {
+            QRect chunk(x * chunkWidth, y * chunkHeight, chunkWidth,
+                        chunkHeight);
+            QRect part = chunk & area;
+
+            // view of the mapped strip or tile, as many bytes per pixel
+            Mat from_chunk(part.bottom() - chunk.top() + 1, chunkWidth,
+                           CV_8UC(samples * bytes),
+                           (void *)(data + offsets[y * across + x]));
+            Mat from = from_chunk(Rect(part.x() - chunk.x(),
+                                       part.y() - chunk.y(), part.width(),
+                                       part.height()));
+            Mat to = to_image(Rect(part.x() - area.x(), part.y() - area.y(),
+                                   part.width(), part.height()));
+            mixChannels(&from, 1, &to, 1, pairs, 3);
+        }
+    }
+    return image;
+}
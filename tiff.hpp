@@ -0,0 +1,67 @@
+#pragma once
+
+#include <QFile>
+#include <QImage>
+#include <QRect>
+#include <QString>
+#include <QStringList>
+#include <QVector>
+
+#include <memory>
+
+// Pages of multi-page TIFF files are scans of their own, with a path made of
+// the file and the page, counted from 1: "/box1/scan.tif#2". The first page
+// is the file itself, so single-page files are handled like any other scan.
+
+// Whether a file name is that of a TIFF file
+bool isTiffFile(const QString &name);
+
+// Split the path of a later page of a TIFF file into the file and its page,
+// returning false for other paths
+bool splitPagePath(const QString &path, QString &file, int &page);
+
+// Scans in a file: the file itself, followed by the later pages of a
+// multi-page TIFF file
+QStringList scanPages(const QString &path);
+
+// Base name of the files belonging to a scan (results, leases and photos):
+// that of the scan file, followed by the page for later pages of TIFF files
+QString scanBaseName(const QString &path);
+
+// Page of a TIFF or BigTIFF file stored uncompressed, with 8 or 16 bits per
+// sample. The file is memory-mapped, and its strips or tiles are read in place
+// as OpenCV views, so only those covering a region are ever touched.
+class TiffPage {
+  public:
+    // Mapped page of a scan, or nullptr for other files and for pages in any
+    // other format (compressed, planar, palette, ...), which are left to
+    // QImageReader
+    static std::unique_ptr<TiffPage> open(const QString &path);
+
+    QRect rect() const { return QRect(0, 0, width, height); }
+
+    // Bytes of pixel data in the file
+    qint64 byteCount() const;
+
+    // SHA-1 hash of the strips or tiles of the page, read from the mapping
+    QByteArray hash() const;
+
+    // Region of the page as 32-bit image (QImage::Format_RGB32). 16-bit
+    // samples are narrowed to 8 bits on the way, for the region only.
+    QImage read(const QRect &region) const;
+
+  private:
+    TiffPage(const QString &path) : file(path) {}
+    bool readDirectory(int page);
+
+    QFile file;
+    const uchar *data = nullptr;
+    qint64 size = 0;
+    bool bigEndian = false;
+
+    int width = 0, height = 0;
+    int samples = 0, bytes = 0; // per pixel, and per sample
+    bool gray = false;
+    int chunkWidth = 0, chunkHeight = 0; // of a strip or tile
+    QVector<quint64> offsets, counts;    // of every strip or tile
+};
@@ -0,0 +1,115 @@
+#include "trace.hpp"
+
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QJsonDocument>
+#include <QMutex>
+
+#include <atomic>
+
+
+//
+// Recorder state
+//
+
+static std::atomic<bool> recording(false);
+static QElapsedTimer timer;
+
+// Events are written as they are recorded, as a JSON array that is only
+// closed when finishing (trace viewers accept an unterminated one, so the
+// trace of a crashed or killed run loads as well)
+static QMutex outputLock;
+static QFile output;
+static bool failed = false, empty = true;
+
+// Small, stable thread identifiers (the native ones are unwieldy)
+static std::atomic<int> threads(0);
+static int threadId() {
+    static thread_local int id = ++threads;
+    return id;
+}
+
+// File of the innermost span on this thread
+static thread_local QString innerFile;
+
+
+//
+// Trace
+//
+
+bool Trace::start(const QString &path) {
+    output.setFileName(path);
+    if (!output.open(QIODevice::WriteOnly | QIODevice::Truncate) ||
+        output.write("[\n") < 0)
+        return false;
+    timer.start();
+    recording = true;
+    return true;
+}
+
+bool Trace::enabled() { return recording; }
+
+// Stop recording, and terminate the spans written so far
+bool Trace::finish() {
+    if (!recording)
+        return true;
+    recording = false;
+
+    outputLock.lock();
+    failed |= output.write("\n]\n") < 0 || !output.flush();
+    output.close();
+    outputLock.unlock();
+    return !failed;
+}
+
+
+//
+// TraceSpan
+//
+
+TraceSpan::TraceSpan(const char *name, const QString &file)
+    : active(recording), name(name) {
+    if (active) {
+        this->file = file;
+        outer_file = innerFile;
+        innerFile = file;
+        start = timer.nsecsElapsed();
+    }
+}
+
+TraceSpan::~TraceSpan() {
+    if (!active)
+        return;
+    qint64 end = timer.nsecsElapsed();
+    innerFile = outer_file;
+
+    args["file"] = file;
+
+    QJsonObject event;
+    event["name"] = QString(name);
+    event["cat"] = QString("fotoscan");
+    event["ph"] = QString("X");
+    event["ts"] = start / 1000.;
+    event["dur"] = (end - start) / 1000.;
+    event["pid"] = QCoreApplication::applicationPid();
+    event["tid"] = threadId();
+    event["args"] = args;
+
+    QByteArray line = QJsonDocument(event).toJson(QJsonDocument::Compact);
+    outputLock.lock();
+    if (output.isOpen()) {
+        if (!empty)
+            line.prepend(",\n");
+        failed |= output.write(line) < 0;
+        empty = false;
+    }
+    outputLock.unlock();
+}
+
+void TraceSpan::arg(const char *key, const QJsonValue &value) {
+    if (active)
+        args[key] = value;
+}
+
+QString TraceSpan::currentFile() { return innerFile; }
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <QJsonObject>
+#include <QString>
+
+// Recording of spans in the Chrome trace event format, for loading a run into
+// a trace viewer (eg. chrome://tracing). Recording is disabled unless started,
+// in which case spans cost next to nothing. Spans are written to the file as
+// they end, so memory use doesn't grow with the length of a run.
+class Trace {
+  public:
+    static bool start(const QString &path);
+    static bool finish();
+    static bool enabled();
+};
+
+// A timed span, recorded when it goes out of scope. Spans carry the scan file
+// they relate to, which defaults to that of the enclosing span on the same
+// thread (pass it explicitly when crossing into OpenMP threads).
+class TraceSpan {
+  public:
+    TraceSpan(const char *name, const QString &file = currentFile());
+    ~TraceSpan();
+
+    void arg(const char *key, const QJsonValue &value);
+
+    static QString currentFile();
+
+  private:
+    bool active;
+    const char *name;
+    QString file, outer_file;
+    qint64 start;
+    QJsonObject args;
+};
@@ -59,6 +59,7 @@ void Viewer::display(ScanData *data) {
     setWindowFilePath(data->file);
 
     imageItem = scene->addPixmap(QPixmap::fromImage(data->image));
+    imageItem->setScale(1 / data->imageScale);
 
     QPen pen;
 
@@ -0,0 +1,122 @@
+#include "watcher.hpp"
+
+#include <QDateTime>
+#include <QFileInfo>
+
+#include "archive.hpp"
+#include "enumerator.hpp"
+#include "tiff.hpp"
+
+// Interval at which new files are checked, in milliseconds. A file is
+// considered complete when it didn't change during a whole interval.
+#define WATCH_INTERVAL 2000
+
+Watcher::Watcher(QObject *parent) : QObject(parent) {
+    connect(&watcher, SIGNAL(directoryChanged(const QString &)), this,
+            SLOT(onDirectoryChanged(const QString &)));
+    connect(&timer, SIGNAL(timeout()), this, SLOT(onTimeout()));
+    timer.setInterval(WATCH_INTERVAL);
+}
+
+bool Watcher::claim(const QString &path) {
+    if (known.contains(path))
+        return false;
+
+    // scans modified lately may still be written, and are only reported once
+    // they are stable, like new ones (archives are not expected to change)
+    QString file = path, archive, entry;
+    int page;
+    splitPagePath(path, file, page);
+    QFileInfo info(file);
+    if (!splitArchivePath(file, archive, entry) &&
+        (info.size() == 0 ||
+         info.lastModified().msecsTo(QDateTime::currentDateTime()) <
+             WATCH_INTERVAL)) {
+        if (!pending.contains(file))
+            pending[file] = {-1, -1};
+        if (!timer.isActive())
+            timer.start();
+        return false;
+    }
+
+    known << path;
+    pending.remove(file);
+    return true;
+}
+
+// Start watching a directory, returning false if it already was. Archives
+// read as directories aren't watched, as they are not expected to change.
+bool Watcher::add(const QString &dir) {
+    QString archive, entry;
+    if (watched.contains(dir) || splitArchivePath(dir, archive, entry))
+        return false;
+    watched << dir;
+    if (!watcher.addPath(dir))
+        qWarning("Could not watch %s", qPrintable(dir));
+    return true;
+}
+
+void Watcher::watch(const QString &dir) {
+    if (!add(dir))
+        return;
+
+    // catch up with scans and subdirectories added since the directory was
+    // listed, those already watched being skipped
+    check(dir, true);
+}
+
+void Watcher::onDirectoryChanged(const QString &dir) { check(dir, true); }
+
+void Watcher::check(const QString &dir, bool descend) {
+    QStringList scans, subdirs;
+    QList<bool> listed;
+    listScans(dir, scans, listed, subdirs);
+
+    // files are pending rather than their pages, which are only known once
+    // the file is complete
+    for (auto scan : scans) {
+        QString file = scan;
+        int page;
+        splitPagePath(scan, file, page);
+        if (!known.contains(file) && !pending.contains(file))
+            pending[file] = {-1, -1};
+    }
+
+    // new directories are watched as well, with all their scans being new
+    if (descend)
+        for (auto subdir : subdirs)
+            if (add(subdir))
+                check(subdir, true);
+
+    if (!pending.isEmpty() && !timer.isActive())
+        timer.start();
+}
+
+void Watcher::onTimeout() {
+    for (auto it = pending.begin(); it != pending.end();) {
+        QFileInfo info(it.key());
+        if (!info.exists()) {
+            it = pending.erase(it);
+            continue;
+        }
+
+        // the pages of a TIFF file are only counted once it is complete
+        Pending now = {info.size(), info.lastModified().toMSecsSinceEpoch()};
+        if (now.size > 0 && now.size == it->size &&
+            now.modified == it->modified) {
+            for (auto page : scanPages(it.key())) {
+                if (known.contains(page))
+                    continue;
+                known << page;
+                emit added(page);
+            }
+            it = pending.erase(it);
+        } else {
+            *it = now;
+            ++it;
+        }
+    }
+
+    if (pending.isEmpty())
+        timer.stop();
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <QFileSystemWatcher>
+#include <QHash>
+#include <QObject>
+#include <QSet>
+#include <QString>
+#include <QStringList>
+#include <QTimer>
+
+// Watches directories for new scans, eg. dropped by a scanning station, and
+// reports them once they have been completely written
+class Watcher : public QObject {
+    Q_OBJECT
+
+  public:
+    Watcher(QObject *parent = nullptr);
+
+    // Take over a scan found elsewhere, unless it was already reported or is
+    // still being written (in which case it is reported once complete)
+    bool claim(const QString &path);
+
+    // Watch a directory, whose scans have been claimed
+    void watch(const QString &dir);
+
+  signals:
+    void added(QString path);
+
+  private slots:
+    void onDirectoryChanged(const QString &dir);
+    void onTimeout();
+
+  private:
+    bool add(const QString &dir);
+    void check(const QString &dir, bool descend);
+
+    // size and modification time of a file that is still being written (by
+    // file, not page)
+    struct Pending {
+        qint64 size;
+        qint64 modified;
+    };
+
+    QFileSystemWatcher watcher;
+    QTimer timer;
+    QSet<QString> watched, known;
+    QHash<QString, Pending> pending;
+};